@@ -0,0 +1,167 @@
+#include "trace.hh"
+#include "columnar.hh"
+#include "filter.hh"
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string_view>
+#include <functional>
+#include <cerrno>
+#include <stdexcept>
+#include <system_error>
+
+// Times every stage of the analysis of a trace, the way main runs it, repeat times each,
+// and prints the best and the median run with the throughput of the best. Render cost is
+// measured by main itself: ./main --frames N FILE.
+int main(int argc, char** argv) {
+    const char* path = nullptr;
+    unsigned n_threads = std::max(1u, std::thread::hardware_concurrency());
+    int repeat = 5;
+    size_t memory_cap = size_t(1024) << 20;
+    for (int i = 1; i < argc; ++i) {
+        auto arg = std::string_view(argv[i]);
+        if ((arg == "-j" || arg == "--threads") && i + 1 < argc) {
+            n_threads = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "-r" && i + 1 < argc) {
+            repeat = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--memory-cap" && i + 1 < argc) {
+            memory_cap = size_t(std::max(16, std::atoi(argv[++i]))) << 20;
+        } else {
+            path = argv[i];
+        }
+    }
+    if (!path) {
+        throw std::runtime_error("USAGE: ./bench [-j THREADS] [-r REPEAT] [--memory-cap MB] FILE");
+    }
+    int fd = open(path, O_RDONLY);
+    struct stat sb;
+    if (fd < 0 || fstat(fd, &sb)) {
+        throw std::system_error(errno, std::generic_category(), path);
+    }
+    size_t file_size = sb.st_size;
+    size_t n_entries = file_size / sizeof(entry);
+    auto head = columnar_header{};
+    if (pread(fd, &head, sizeof(head), 0) == sizeof(head) && is_columnar(std::span<const char>(reinterpret_cast<const char*>(&head), sizeof(head)))) {
+        n_entries = head.n_entries;
+    }
+    fmt::print("{}: {} entries, {:.1f} MiB, {} threads, {}\n", path, n_entries, file_size / 1048576.0, n_threads, simd_name(simd()));
+    fmt::print("{:14s} {:>12s} {:>12s} {:>12s} {:>10s}\n", "stage", "best ms", "median ms", "Mitems/s", "MiB/s");
+
+    // Items are entries for the stages that sweep the trace, and queries for the others.
+    auto measure = [&] (std::string stage, size_t items, bool entries, std::function<void()> run) {
+        auto times = std::vector<double>();
+        for (int r = 0; r < repeat; ++r) {
+            auto t0 = std::chrono::steady_clock::now();
+            run();
+            times.push_back(std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count());
+        }
+        std::ranges::sort(times);
+        auto bandwidth = entries ? fmt::format("{:.1f}", items * sizeof(entry) / times[0] / 1048576.0) : "-";
+        fmt::print("{:14s} {:12.3f} {:12.3f} {:12.2f} {:>10s}\n", stage, times[0] * 1e3, times[times.size() / 2] * 1e3, items / times[0] / 1e6, bandwidth);
+    };
+
+    // Load: map the file, or decode it if columnar, and fault every page in, as the first
+    // sweep over it does. Throughput is in raw entries either way.
+    auto trace = loaded_trace();
+    measure("load", n_entries, true, [&] {
+        trace = loaded_trace();
+        trace = load_trace(fd, file_size, n_threads);
+        volatile uint64_t sink = 0;
+        for (size_t off = 0; off < trace.span.size_bytes(); off += 4096) {
+            sink = sink + reinterpret_cast<const char*>(trace.span.data())[off];
+        }
+    });
+    auto span = trace.span;
+
+    trace_columns columns;
+    measure("columns", n_entries, true, [&] {
+        columns = trace_columns();
+        columns = make_columns(span, n_threads);
+    });
+    query_index index;
+    measure("sort", n_entries, true, [&] {
+        index = build_index(span, columns, n_threads);
+    });
+    std::vector<query> queries;
+    measure("segment", n_entries, true, [&] {
+        queries = segment_queries(index, columns);
+        std::ranges::sort(queries, std::ranges::less(), [] (const auto &x) {return x.latency;});
+    });
+    auto segmented = queries;
+    measure("attribute", n_entries, true, [&] {
+        queries = segmented;
+        attribute(columns, index, queries, n_threads);
+    });
+    measure("blame", n_entries, true, [&] {
+        auto blamed = segmented;
+        auto blame = blame_matrix();
+        attribute(columns, index, blamed, n_threads, nullptr, &blame);
+    });
+    measure("io", n_entries, true, [&] {
+        pair_ios(columns, n_threads);
+    });
+    // Preview: one round of 64 strata; throughput is in the trace's entries, not the swept.
+    measure("preview", n_entries, true, [&] {
+        sample_queries(span, 64, 64, n_threads);
+    });
+    measure("stream", n_entries, true, [&] {
+        stream_queries(fd, file_size, memory_cap);
+    });
+    fmt::print("{} queries\n", queries.size());
+    if (queries.empty()) {
+        return 0;
+    }
+
+    // TimeDist: building its index, then the whole table, the slowest 10% and the slowest
+    // 1%, as dragging the selection over the curve does.
+    auto plot_x = std::vector<double>();
+    for (int i = 0; i < 1024; ++i) {
+        plot_x.push_back(i * (1.0/1024));
+    }
+    auto dist_index = time_dist_index();
+    measure("timedist index", queries.size(), false, [&] {
+        dist_index = make_time_dist_index(queries, n_threads);
+    });
+    for (double p : {0.0, 0.9, 0.99}) {
+        size_t w1 = quantile_index(queries.size(), p);
+        measure(fmt::format("timedist {}", p), queries.size() - w1, false, [&] {
+            make_time_dist(dist_index, w1, queries.size() - 1, plot_x);
+        });
+    }
+
+    // Filters: building their index, then a predicate mixing bitmaps and binned ranges.
+    auto query_filter_index = filter_index();
+    measure("filter index", queries.size(), false, [&] {
+        query_filter_index = make_filter_index(queries, n_threads);
+    });
+    auto predicate = parse_filter("(rcs=1 or rcs=2) and io>2 or not permit");
+    measure("filter", queries.size(), false, [&] {
+        evaluate(predicate, query_filter_index);
+    });
+
+    // Heatmap: building the pyramid, then a view of the whole trace a screen wide.
+    auto pyramid = latency_pyramid();
+    measure("heatmap index", queries.size(), false, [&] {
+        pyramid = make_latency_pyramid(queries, n_threads);
+    });
+    measure("heatmap", queries.size(), false, [&] {
+        size_t level;
+        pyramid.view(pyramid.first_ts, pyramid.first_ts + pyramid.bucket_ticks * int64_t(pyramid.n_buckets(0)), 1920, level);
+    });
+
+    // Curves: histograms of the four times, then the latency curve read off them.
+    auto histograms = time_histograms();
+    measure("histograms", queries.size(), false, [&] {
+        histograms = make_time_histograms(queries, n_threads);
+    });
+    auto curve_ps = std::vector<double>();
+    for (int i = 0; i <= 1000; ++i) {
+        curve_ps.push_back(1 - pow(100000.0, -i/1000.0));
+    }
+    measure("curve", queries.size(), false, [&] {
+        histograms.latency.seconds_at(curve_ps);
+    });
+    return 0;
+}
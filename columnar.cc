@@ -0,0 +1,463 @@
+#include "columnar.hh"
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <immintrin.h>
+#include <cerrno>
+#include <exception>
+#include <ranges>
+#include <stdexcept>
+#include <system_error>
+
+namespace {
+
+uint64_t zigzag(int64_t v) {
+    return (uint64_t(v) << 1) ^ uint64_t(v >> 63);
+}
+
+int64_t unzigzag(uint64_t u) {
+    return int64_t((u >> 1) ^ -(u & 1));
+}
+
+void put_varint(std::vector<char>& out, uint64_t v) {
+    while (v >= 0x80) {
+        out.push_back(char(v | 0x80));
+        v >>= 7;
+    }
+    out.push_back(char(v));
+}
+
+uint64_t get_varint(const uint8_t*& p) {
+    uint64_t v = 0;
+    for (int shift = 0; ; shift += 7) {
+        uint8_t b = *p++;
+        v |= uint64_t(b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            return v;
+        }
+    }
+}
+
+// Far more than the format needs, little enough that a block's columns can't overflow.
+constexpr uint32_t max_block_size = uint32_t(1) << 24;
+
+uint64_t align8(uint64_t x) {
+    return (x + 7) / 8 * 8;
+}
+
+// Where the columns of a block start, relative to its header.
+struct block_layout {
+    uint64_t values;
+    uint64_t events;
+    uint64_t ids;
+    uint64_t args;
+    uint64_t deltas;
+    uint64_t exceptions;
+};
+
+block_layout layout_of(const block_header& h) {
+    auto at = block_layout{};
+    at.values = align8(sizeof(block_header));
+    at.events = at.values + uint64_t(h.n_values) * sizeof(uint64_t);
+    at.ids = align8(at.events + h.n);
+    at.args = align8(at.ids + uint64_t(h.n) * h.index_width);
+    at.deltas = align8(at.args + uint64_t(h.n) * h.index_width);
+    at.exceptions = align8(at.deltas + uint64_t(h.n) * h.ts_width);
+    return at;
+}
+
+uint64_t load_width(const char* p, unsigned width) {
+    uint64_t v = 0;
+    memcpy(&v, p, width);
+    return v;
+}
+
+std::vector<char> encode_block(std::span<const entry> block) {
+    auto values = std::vector<uint64_t>();
+    values.reserve(block.size() * 2);
+    for (const auto& e : block) {
+        if (e.event > 0xff) {
+            throw std::runtime_error(fmt::format("event code {} does not fit the columnar format", e.event));
+        }
+        values.push_back(e.id);
+        values.push_back(e.arg);
+    }
+    std::ranges::sort(values);
+    values.erase(std::ranges::unique(values).begin(), values.end());
+
+    // Deltas wrap around, as the vector decoder's additions do, so that any two
+    // timestamps have one.
+    auto deltas = std::vector<uint64_t>(block.size());
+    for (size_t i = 1; i < block.size(); ++i) {
+        deltas[i] = zigzag(int64_t(uint64_t(block[i].ts) - uint64_t(block[i - 1].ts)));
+    }
+    // The narrowest width that leaves at most one delta in 64 as an exception.
+    uint8_t ts_width = 8;
+    for (uint8_t w : {1, 2, 4}) {
+        size_t wide = std::ranges::count_if(deltas, [&] (uint64_t d) {return d >> (8 * w);});
+        if (wide * 64 <= block.size()) {
+            ts_width = w;
+            break;
+        }
+    }
+
+    auto h = block_header{};
+    h.n = block.size();
+    h.ts_width = ts_width;
+    h.index_width = values.size() <= 0x100 ? 1 : values.size() <= 0x10000 ? 2 : 4;
+    h.n_values = values.size();
+    h.first_ts = block[0].ts;
+    auto exceptions = std::vector<char>();
+    size_t last_exception = 0;
+    for (size_t i = 0; i < block.size(); ++i) {
+        if (ts_width < 8 && deltas[i] >> (8 * ts_width)) {
+            put_varint(exceptions, i - last_exception);
+            put_varint(exceptions, deltas[i]);
+            last_exception = i;
+            deltas[i] = 0;
+            h.n_exceptions += 1;
+        }
+    }
+
+    auto at = layout_of(h);
+    auto out = std::vector<char>(align8(at.exceptions + exceptions.size()));
+    memcpy(out.data(), &h, sizeof(h));
+    memcpy(out.data() + at.values, values.data(), values.size() * sizeof(uint64_t));
+    for (size_t i = 0; i < block.size(); ++i) {
+        uint64_t id = std::ranges::lower_bound(values, block[i].id) - values.begin();
+        uint64_t arg = std::ranges::lower_bound(values, block[i].arg) - values.begin();
+        out[at.events + i] = char(block[i].event);
+        memcpy(out.data() + at.ids + i * h.index_width, &id, h.index_width);
+        memcpy(out.data() + at.args + i * h.index_width, &arg, h.index_width);
+        memcpy(out.data() + at.deltas + i * ts_width, &deltas[i], ts_width);
+    }
+    std::ranges::copy(exceptions, out.data() + at.exceptions);
+    return out;
+}
+
+// The columns of one encoded block, and a cursor over its exceptions.
+struct block_reader {
+    block_header h;
+    const uint64_t* values;
+    const uint8_t* events;
+    const char* ids;
+    const char* args;
+    const char* deltas;
+    const uint8_t* exceptions;
+    uint32_t exceptions_left;
+    uint64_t exception_at = -1;
+    uint64_t exception_delta = 0;
+
+    explicit block_reader(const char* p) {
+        memcpy(&h, p, sizeof(h));
+        auto at = layout_of(h);
+        values = reinterpret_cast<const uint64_t*>(p + at.values);
+        events = reinterpret_cast<const uint8_t*>(p + at.events);
+        ids = p + at.ids;
+        args = p + at.args;
+        deltas = p + at.deltas;
+        exceptions = reinterpret_cast<const uint8_t*>(p + at.exceptions);
+        exceptions_left = h.n_exceptions;
+        exception_at = 0;
+        next_exception();
+    }
+    void next_exception() {
+        if (exceptions_left == 0) {
+            exception_at = -1;
+            return;
+        }
+        exceptions_left -= 1;
+        exception_at += get_varint(exceptions);
+        exception_delta = get_varint(exceptions);
+    }
+    uint64_t delta(size_t i) {
+        if (i == exception_at) {
+            uint64_t d = exception_delta;
+            next_exception();
+            return d;
+        }
+        return load_width(deltas + i * h.ts_width, h.ts_width);
+    }
+    // Decodes entries [i, n) following ts, the timestamp of entry i - 1.
+    void decode_scalar(size_t i, int64_t ts, entry* out) {
+        for (; i < h.n; ++i) {
+            ts = int64_t(uint64_t(ts) + uint64_t(unzigzag(delta(i))));
+            out[i] = entry{events[i], values[load_width(ids + i * h.index_width, h.index_width)],
+                values[load_width(args + i * h.index_width, h.index_width)], ts};
+        }
+    }
+};
+
+std::runtime_error corrupt_columnar() {
+    return std::runtime_error("corrupt columnar trace");
+}
+
+template <typename T>
+uint64_t max_of(const char* p, size_t n) {
+    T m = 0;
+    for (size_t i = 0; i < n; ++i) {
+        T v;
+        memcpy(&v, p + i * sizeof(T), sizeof(T));
+        m = std::max(m, v);
+    }
+    return m;
+}
+
+// Checks what open_columnar() leaves to decoding, as it takes a pass over the block: that
+// every index is within the values, and that the exceptions are in order, within the
+// block's entries and within its bytes.
+void check_block(const char* p, uint64_t size) {
+    auto h = block_header{};
+    memcpy(&h, p, sizeof(h));
+    auto at = layout_of(h);
+    for (uint64_t column : {at.ids, at.args}) {
+        uint64_t max_index = h.index_width == 1 ? max_of<uint8_t>(p + column, h.n)
+            : h.index_width == 2 ? max_of<uint16_t>(p + column, h.n) : max_of<uint32_t>(p + column, h.n);
+        if (h.n && max_index >= h.n_values) {
+            throw corrupt_columnar();
+        }
+    }
+    const auto* x = reinterpret_cast<const uint8_t*>(p + at.exceptions);
+    const auto* end = reinterpret_cast<const uint8_t*>(p + size);
+    auto varint = [&] {
+        uint64_t v = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            if (x == end) {
+                break;
+            }
+            uint8_t b = *x++;
+            v |= uint64_t(b & 0x7f) << shift;
+            if (!(b & 0x80)) {
+                return v;
+            }
+        }
+        throw corrupt_columnar();
+    };
+    uint64_t position = 0;
+    for (uint32_t k = 0; k < h.n_exceptions; ++k) {
+        uint64_t gap = varint();
+        varint();
+        if (gap >= h.n - position || (k > 0 && gap == 0)) {
+            throw corrupt_columnar();
+        }
+        position += gap;
+    }
+}
+
+__attribute__((target("avx2")))
+__m256i widen(const char* p, unsigned width) {
+    switch (width) {
+    case 1: return _mm256_cvtepu8_epi64(_mm_cvtsi32_si128(int(load_width(p, 4))));
+    case 2: return _mm256_cvtepu16_epi64(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(p)));
+    case 4: return _mm256_cvtepu32_epi64(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p)));
+    default: return _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+    }
+}
+
+// Four entries at a time: widening loads of the events, indexes and deltas, gathers from
+// the values, an in-register prefix sum of the deltas, and a 4x4 transpose into entries.
+__attribute__((target("avx2")))
+void decode_avx2(block_reader& r, entry* out) {
+    const auto zero = _mm256_setzero_si256();
+    const auto one = _mm256_set1_epi64x(1);
+    const auto* values = reinterpret_cast<const long long*>(r.values);
+    unsigned iw = r.h.index_width;
+    unsigned tw = r.h.ts_width;
+    auto carry = _mm256_set1_epi64x(r.h.first_ts);
+    size_t i = 0;
+    for (; i + 4 <= r.h.n; i += 4) {
+        auto ev = _mm256_cvtepu8_epi64(_mm_cvtsi32_si128(int(load_width(reinterpret_cast<const char*>(r.events) + i, 4))));
+        auto id = _mm256_i64gather_epi64(values, widen(r.ids + i * iw, iw), 8);
+        auto arg = _mm256_i64gather_epi64(values, widen(r.args + i * iw, iw), 8);
+        auto d = widen(r.deltas + i * tw, tw);
+        if (r.exception_at < i + 4) {
+            alignas(32) uint64_t lanes[4];
+            _mm256_store_si256(reinterpret_cast<__m256i*>(lanes), d);
+            while (r.exception_at < i + 4) {
+                lanes[r.exception_at - i] = r.exception_delta;
+                r.next_exception();
+            }
+            d = _mm256_load_si256(reinterpret_cast<const __m256i*>(lanes));
+        }
+        auto ts = _mm256_xor_si256(_mm256_srli_epi64(d, 1), _mm256_sub_epi64(zero, _mm256_and_si256(d, one)));
+        ts = _mm256_add_epi64(ts, _mm256_blend_epi32(_mm256_permute4x64_epi64(ts, _MM_SHUFFLE(2, 1, 0, 0)), zero, 0x03));
+        ts = _mm256_add_epi64(ts, _mm256_blend_epi32(_mm256_permute4x64_epi64(ts, _MM_SHUFFLE(1, 0, 0, 0)), zero, 0x0f));
+        ts = _mm256_add_epi64(ts, carry);
+        carry = _mm256_permute4x64_epi64(ts, _MM_SHUFFLE(3, 3, 3, 3));
+
+        auto t0 = _mm256_unpacklo_epi64(ev, id);
+        auto t1 = _mm256_unpackhi_epi64(ev, id);
+        auto t2 = _mm256_unpacklo_epi64(arg, ts);
+        auto t3 = _mm256_unpackhi_epi64(arg, ts);
+        auto* dst = reinterpret_cast<__m256i*>(out + i);
+        _mm256_storeu_si256(dst + 0, _mm256_permute2x128_si256(t0, t2, 0x20));
+        _mm256_storeu_si256(dst + 1, _mm256_permute2x128_si256(t1, t3, 0x20));
+        _mm256_storeu_si256(dst + 2, _mm256_permute2x128_si256(t0, t2, 0x31));
+        _mm256_storeu_si256(dst + 3, _mm256_permute2x128_si256(t1, t3, 0x31));
+    }
+    r.decode_scalar(i, _mm256_extract_epi64(carry, 0), out);
+}
+
+}
+
+bool is_columnar(std::span<const char> file) {
+    return file.size() >= sizeof(columnar_header) && memcmp(file.data(), columnar_magic, sizeof(columnar_magic)) == 0;
+}
+
+void write_columnar(std::span<const entry> trace, FILE* out, unsigned n_threads) {
+    auto h = columnar_header{};
+    std::ranges::copy(columnar_magic, h.magic);
+    h.version = columnar_version;
+    h.block_size = columnar_block_size;
+    h.n_entries = trace.size();
+    h.n_blocks = (trace.size() + columnar_block_size - 1) / columnar_block_size;
+    auto write = [&] (const void* p, size_t size) {
+        if (fwrite(p, 1, size, out) != size) {
+            throw std::system_error(errno, std::generic_category(), "fwrite");
+        }
+    };
+    write(&h, sizeof(h));
+    uint64_t offset = sizeof(h);
+    auto directory = std::vector<columnar_block>();
+    // Blocks are encoded a batch at a time in parallel and written in order.
+    size_t batch = size_t(n_threads) * 4;
+    auto encoded = std::vector<std::vector<char>>(batch);
+    for (size_t first = 0; first < h.n_blocks; first += batch) {
+        size_t count = std::min<size_t>(batch, h.n_blocks - first);
+        parallel_tasks(count, n_threads, [&] (size_t k) {
+            size_t begin = (first + k) * columnar_block_size;
+            encoded[k] = encode_block(trace.subspan(begin, std::min<size_t>(columnar_block_size, trace.size() - begin)));
+        });
+        for (size_t k = 0; k < count; ++k) {
+            write(encoded[k].data(), encoded[k].size());
+            directory.push_back(columnar_block{offset, encoded[k].size()});
+            offset += encoded[k].size();
+        }
+    }
+    h.directory_offset = offset;
+    write(directory.data(), directory.size() * sizeof(columnar_block));
+    if (fseek(out, 0, SEEK_SET)) {
+        throw std::system_error(errno, std::generic_category(), "fseek");
+    }
+    write(&h, sizeof(h));
+}
+
+columnar_trace open_columnar(std::span<const char> file) {
+    const auto* h = reinterpret_cast<const columnar_header*>(file.data());
+    if (h->version != columnar_version) {
+        throw std::runtime_error(fmt::format("unsupported columnar trace version {}", h->version));
+    }
+    if (h->block_size == 0 || h->block_size > max_block_size) {
+        throw corrupt_columnar();
+    }
+    if (h->directory_offset < sizeof(columnar_header) || h->directory_offset % alignof(columnar_block)
+            || h->directory_offset > file.size() || h->n_blocks > (file.size() - h->directory_offset) / sizeof(columnar_block)
+            || h->n_blocks != h->n_entries / h->block_size + (h->n_entries % h->block_size != 0)) {
+        throw std::runtime_error("truncated columnar trace");
+    }
+    auto blocks = std::span<const columnar_block>(reinterpret_cast<const columnar_block*>(file.data() + h->directory_offset), h->n_blocks);
+    // Every block between the header and the directory, aligned, and holding the columns
+    // its header says it has: all full but the last, which has the rest of the entries.
+    for (size_t b = 0; b < blocks.size(); ++b) {
+        const auto& block = blocks[b];
+        if (block.offset < sizeof(columnar_header) || block.offset % 8 || block.offset > h->directory_offset
+                || block.size > h->directory_offset - block.offset || block.size < sizeof(block_header)) {
+            throw corrupt_columnar();
+        }
+        auto bh = block_header{};
+        memcpy(&bh, file.data() + block.offset, sizeof(bh));
+        uint64_t n = b + 1 < blocks.size() ? h->block_size : h->n_entries - b * h->block_size;
+        bool widths = (bh.ts_width == 1 || bh.ts_width == 2 || bh.ts_width == 4 || bh.ts_width == 8)
+            && (bh.index_width == 1 || bh.index_width == 2 || bh.index_width == 4);
+        // Each exception takes two varints of at least a byte.
+        if (bh.n != n || !widths || bh.n_values > 2 * uint64_t(bh.n) || layout_of(bh).exceptions > block.size
+                || bh.n_exceptions > (block.size - layout_of(bh).exceptions) / 2) {
+            throw corrupt_columnar();
+        }
+    }
+    return columnar_trace{h, blocks, file.data()};
+}
+
+size_t columnar_trace::decode(size_t b, entry* out) const {
+    check_block(base + blocks[b].offset, blocks[b].size);
+    auto r = block_reader(base + blocks[b].offset);
+    if (simd() >= simd_level::avx2) {
+        decode_avx2(r, out);
+    } else {
+        r.decode_scalar(0, r.h.first_ts, out);
+    }
+    return r.h.n;
+}
+
+namespace {
+
+std::shared_ptr<const void> map_file(int fd, size_t file_size) {
+    void* p = mmap(nullptr, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p == MAP_FAILED) {
+        throw std::system_error(errno, std::generic_category(), "mmap");
+    }
+    return std::shared_ptr<const void>(p, [file_size] (const void* p) {munmap(const_cast<void*>(p), file_size);});
+}
+
+// Decodes blocks [first, end) of trace in parallel into one buffer.
+loaded_trace decode_blocks(const columnar_trace& trace, size_t first, size_t end, unsigned n_threads, progress* done) {
+    size_t block_size = trace.header->block_size;
+    size_t n = first < end ? std::min<size_t>(end * block_size, trace.size()) - first * block_size : 0;
+    auto decoded = std::shared_ptr<entry[]>(new entry[n]);
+    auto n_decoded = std::atomic<size_t>(0);
+    // A corrupt block is reported once all are done, from this thread.
+    auto error = std::exception_ptr();
+    auto error_mutex = std::mutex();
+    parallel_tasks(end - std::min(first, end), n_threads, [&] (size_t k) {
+        try {
+            trace.decode(first + k, decoded.get() + k * block_size);
+        } catch (const std::exception&) {
+            auto lock = std::lock_guard(error_mutex);
+            error = std::current_exception();
+        }
+        if (done) {
+            *done = double(++n_decoded) / (end - first);
+        }
+    });
+    if (error) {
+        std::rethrow_exception(error);
+    }
+    return loaded_trace{std::span<const entry>(decoded.get(), n), decoded};
+}
+
+}
+
+loaded_trace load_trace(int fd, size_t file_size, unsigned n_threads, progress* done) {
+    auto mapping = map_file(fd, file_size);
+    auto file = std::span<const char>(static_cast<const char*>(mapping.get()), file_size);
+    if (!is_columnar(file)) {
+        return loaded_trace{std::span<const entry>(static_cast<const entry*>(mapping.get()), file_size / sizeof(entry)), mapping};
+    }
+    auto trace = open_columnar(file);
+    return decode_blocks(trace, 0, trace.blocks.size(), n_threads, done);
+}
+
+std::shared_ptr<const encoded_trace> map_columnar(int fd, size_t file_size) {
+    auto head = columnar_header{};
+    if (pread(fd, &head, sizeof(head), 0) != sizeof(head) || !is_columnar(std::span<const char>(reinterpret_cast<const char*>(&head), sizeof(head)))) {
+        return nullptr;
+    }
+    auto mapping = map_file(fd, file_size);
+    auto trace = open_columnar(std::span<const char>(static_cast<const char*>(mapping.get()), file_size));
+    return std::make_shared<const encoded_trace>(encoded_trace{trace, mapping});
+}
+
+loaded_trace decode_window(const encoded_trace& encoded, int64_t begin_ts, int64_t end_ts, unsigned n_threads) {
+    const auto& trace = encoded.trace;
+    auto first_ts = [&] (size_t b) {
+        auto h = block_header{};
+        memcpy(&h, trace.base + trace.blocks[b].offset, sizeof(h));
+        return h.first_ts;
+    };
+    // From the block before the first to start at begin_ts or later, which may end with
+    // entries at begin_ts, to the last to start at end_ts or earlier.
+    auto blocks = std::views::iota(size_t(0), trace.blocks.size());
+    size_t first = *std::ranges::partition_point(blocks, [&] (size_t b) {return first_ts(b) < begin_ts;});
+    size_t end = *std::ranges::partition_point(blocks, [&] (size_t b) {return first_ts(b) <= end_ts;});
+    return decode_blocks(trace, first ? first - 1 : 0, end, n_threads, nullptr);
+}
@@ -0,0 +1,94 @@
+#pragma once
+
+#include "trace.hh"
+
+// A compact, columnar encoding of a trace, in blocks of up to block_size entries that
+// decode independently of each other. The file is a columnar_header, the blocks, and a
+// directory of where each block is. Within a block, at 8-byte aligned offsets:
+//
+//   block_header
+//   values[n_values]            every distinct id and arg of the block, sorted (uint64_t)
+//   events[n]                   event codes (uint8_t)
+//   ids[n], args[n]             indexes into values, index_width bytes each
+//   deltas[n]                   zigzag ts deltas from the previous entry, ts_width bytes each;
+//                               a delta too wide for that is 0 here and an exception below
+//   exceptions[n_exceptions]    varint pairs: gap from the previous exception's position,
+//                               and the zigzag delta
+//
+// Every column is fixed width, so that decoding is a widening load, a gather from values
+// and a prefix sum, a few entries per instruction.
+struct columnar_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t block_size;
+    uint64_t n_entries;
+    uint64_t n_blocks;
+    uint64_t directory_offset;
+};
+constexpr char columnar_magic[8] = {'T', 'R', 'A', 'C', 'E', 'C', 'O', 'L'};
+constexpr uint32_t columnar_version = 1;
+constexpr uint32_t columnar_block_size = 32768;
+
+struct columnar_block {
+    uint64_t offset;
+    uint64_t size;
+};
+
+struct block_header {
+    uint32_t n;
+    uint8_t ts_width;
+    uint8_t index_width;
+    uint16_t reserved;
+    uint32_t n_values;
+    uint32_t n_exceptions;
+    int64_t first_ts;
+};
+
+// Whether file starts like a columnar trace.
+bool is_columnar(std::span<const char> file);
+
+// Writes trace to out in the columnar format; n_threads encode blocks in parallel.
+void write_columnar(std::span<const entry> trace, FILE* out, unsigned n_threads);
+
+// A view of a mapped columnar file.
+struct columnar_trace {
+    const columnar_header* header;
+    std::span<const columnar_block> blocks;
+    const char* base;
+
+    size_t size() const {
+        return header->n_entries;
+    }
+    // Decodes block b into out, which has room for block_size entries, and returns the
+    // number of entries in it. Throws std::runtime_error if the block's indexes or
+    // exceptions are corrupt.
+    size_t decode(size_t b, entry* out) const;
+};
+
+// Checks the header and the directory of a columnar file, and that every block lies
+// between them and has room for the columns and entries its header says it has; throws
+// std::runtime_error otherwise.
+columnar_trace open_columnar(std::span<const char> file);
+
+// A trace in memory: raw files are mapped, columnar ones decoded in parallel into an
+// anonymous buffer. storage keeps whichever it is alive.
+struct loaded_trace {
+    std::span<const entry> span;
+    std::shared_ptr<const void> storage;
+};
+
+loaded_trace load_trace(int fd, size_t file_size, unsigned n_threads, progress* done = nullptr);
+
+// A columnar trace left encoded, as a streaming analysis leaves it, for windows of it to be
+// decoded when wanted. mapping keeps the file mapped.
+struct encoded_trace {
+    columnar_trace trace;
+    std::shared_ptr<const void> mapping;
+};
+
+// Maps fd's trace and checks it as open_columnar() does, if it is columnar; null if not.
+std::shared_ptr<const encoded_trace> map_columnar(int fd, size_t file_size);
+
+// Decodes the blocks that may hold entries with timestamps in [begin_ts, end_ts] of a trace
+// in timestamp order: the entries around the window are decoded along with it.
+loaded_trace decode_window(const encoded_trace& trace, int64_t begin_ts, int64_t end_ts, unsigned n_threads);
@@ -0,0 +1,275 @@
+#include "trace.hh"
+#include <stdlib.h>
+#include <string.h>
+#include <immintrin.h>
+#include <bit>
+#include <limits>
+
+namespace {
+
+// What kernels may read past the end of the event column.
+constexpr size_t event_padding = 8;
+
+// Each kernel in three versions. The AVX-512 ones take 8 entries (or 16 positions) per
+// instruction, the AVX2 ones 4 (or 8); both finish partial vectors with masks or in
+// scalar code.
+struct kernels {
+    void (*split)(const entry* in, size_t n, uint8_t* event, int64_t* ts, uint64_t* query, uint64_t* arg);
+    size_t (*count_below)(const int64_t* ts, size_t n, int64_t key);
+    size_t (*find_event)(const uint8_t* event, const uint32_t* positions, size_t n, uint8_t code);
+};
+
+void split_scalar(const entry* in, size_t n, uint8_t* event, int64_t* ts, uint64_t* query, uint64_t* arg) {
+    for (size_t i = 0; i < n; ++i) {
+        event[i] = uint8_t(std::min<uint64_t>(in[i].event, 0xff));
+        ts[i] = in[i].ts;
+        query[i] = in[i].query();
+        arg[i] = in[i].arg;
+    }
+}
+
+size_t count_below_scalar(const int64_t* ts, size_t n, int64_t key) {
+    size_t count = 0;
+    for (size_t i = 0; i < n; ++i) {
+        count += ts[i] < key;
+    }
+    return count;
+}
+
+size_t find_event_scalar(const uint8_t* event, const uint32_t* positions, size_t n, uint8_t code) {
+    size_t k = 0;
+    while (k < n && event[positions[k]] != code) {
+        ++k;
+    }
+    return k;
+}
+
+// Four entries per iteration: a 4x4 transpose of their fields into columns, with the
+// query picked from id or arg by a compare on the event.
+__attribute__((target("avx2")))
+void split_avx2(const entry* in, size_t n, uint8_t* event, int64_t* ts, uint64_t* query, uint64_t* arg) {
+    const auto zero = _mm256_setzero_si256();
+    const auto one = _mm256_set1_epi64x(1);
+    const auto permit = _mm256_set1_epi64x(0xa);
+    const auto byte_max = _mm256_set1_epi64x(0xff);
+    // The low byte of each 64-bit lane, to the bottom of its 128-bit half.
+    const auto low_bytes = _mm256_setr_epi8(0, 8, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                                            0, 8, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        const auto* src = reinterpret_cast<const __m256i*>(in + i);
+        auto r0 = _mm256_loadu_si256(src + 0);
+        auto r1 = _mm256_loadu_si256(src + 1);
+        auto r2 = _mm256_loadu_si256(src + 2);
+        auto r3 = _mm256_loadu_si256(src + 3);
+        auto t0 = _mm256_unpacklo_epi64(r0, r1);
+        auto t1 = _mm256_unpackhi_epi64(r0, r1);
+        auto t2 = _mm256_unpacklo_epi64(r2, r3);
+        auto t3 = _mm256_unpackhi_epi64(r2, r3);
+        auto ev = _mm256_permute2x128_si256(t0, t2, 0x20);
+        auto a = _mm256_permute2x128_si256(t0, t2, 0x31);
+        auto id = _mm256_permute2x128_si256(t1, t3, 0x20);
+        auto t = _mm256_permute2x128_si256(t1, t3, 0x31);
+
+        auto pair = _mm256_andnot_si256(one, ev);
+        auto from_arg = _mm256_or_si256(_mm256_cmpeq_epi64(pair, zero), _mm256_cmpeq_epi64(pair, permit));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(query + i), _mm256_blendv_epi8(id, a, from_arg));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(ts + i), t);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(arg + i), a);
+
+        auto fits = _mm256_cmpeq_epi64(_mm256_srli_epi64(ev, 8), zero);
+        auto bytes = _mm256_shuffle_epi8(_mm256_blendv_epi8(byte_max, ev, fits), low_bytes);
+        uint32_t packed = uint32_t(_mm256_extract_epi16(bytes, 0)) | uint32_t(_mm256_extract_epi16(bytes, 8)) << 16;
+        memcpy(event + i, &packed, sizeof(packed));
+    }
+    split_scalar(in + i, n - i, event + i, ts + i, query + i, arg + i);
+}
+
+__attribute__((target("avx2")))
+size_t count_below_avx2(const int64_t* ts, size_t n, int64_t key) {
+    const auto k = _mm256_set1_epi64x(key);
+    size_t count = 0;
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        auto below = _mm256_cmpgt_epi64(k, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(ts + i)));
+        count += std::popcount(unsigned(_mm256_movemask_pd(_mm256_castsi256_pd(below))));
+    }
+    return count + count_below_scalar(ts + i, n - i, key);
+}
+
+// Gathers 32 bits at each position and keeps the low byte, the event.
+__attribute__((target("avx2")))
+size_t find_event_avx2(const uint8_t* event, const uint32_t* positions, size_t n, uint8_t code) {
+    const auto low = _mm256_set1_epi32(0xff);
+    const auto c = _mm256_set1_epi32(code);
+    size_t k = 0;
+    for (; k + 8 <= n; k += 8) {
+        auto at = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(positions + k));
+        auto ev = _mm256_and_si256(_mm256_i32gather_epi32(reinterpret_cast<const int*>(event), at, 1), low);
+        if (unsigned hit = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(ev, c)))) {
+            return k + std::countr_zero(hit);
+        }
+    }
+    return k + find_event_scalar(event, positions + k, n - k, code);
+}
+
+// Eight entries per iteration, transposed by two rounds of two-source permutes: the
+// first sorts every two entries into (event, id) and (arg, ts) quarters, the second
+// joins the quarters into whole columns.
+__attribute__((target("avx512f")))
+void split_avx512(const entry* in, size_t n, uint8_t* event, int64_t* ts, uint64_t* query, uint64_t* arg) {
+    const auto pair_bits = _mm512_set1_epi64(~uint64_t(1));
+    const auto permit = _mm512_set1_epi64(0xa);
+    const auto zero = _mm512_setzero_si512();
+    const auto first_halves = _mm512_setr_epi64(0, 4, 8, 12, 1, 5, 9, 13);
+    const auto second_halves = _mm512_setr_epi64(2, 6, 10, 14, 3, 7, 11, 15);
+    const auto low_quarters = _mm512_setr_epi64(0, 1, 2, 3, 8, 9, 10, 11);
+    const auto high_quarters = _mm512_setr_epi64(4, 5, 6, 7, 12, 13, 14, 15);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        const auto* src = reinterpret_cast<const __m512i*>(in + i);
+        auto z0 = _mm512_loadu_si512(src + 0);
+        auto z1 = _mm512_loadu_si512(src + 1);
+        auto z2 = _mm512_loadu_si512(src + 2);
+        auto z3 = _mm512_loadu_si512(src + 3);
+        auto ev_id_lo = _mm512_permutex2var_epi64(z0, first_halves, z1);
+        auto arg_ts_lo = _mm512_permutex2var_epi64(z0, second_halves, z1);
+        auto ev_id_hi = _mm512_permutex2var_epi64(z2, first_halves, z3);
+        auto arg_ts_hi = _mm512_permutex2var_epi64(z2, second_halves, z3);
+        auto ev = _mm512_permutex2var_epi64(ev_id_lo, low_quarters, ev_id_hi);
+        auto id = _mm512_permutex2var_epi64(ev_id_lo, high_quarters, ev_id_hi);
+        auto a = _mm512_permutex2var_epi64(arg_ts_lo, low_quarters, arg_ts_hi);
+        auto t = _mm512_permutex2var_epi64(arg_ts_lo, high_quarters, arg_ts_hi);
+
+        auto pair = _mm512_and_si512(ev, pair_bits);
+        auto from_arg = _mm512_cmpeq_epi64_mask(pair, zero) | _mm512_cmpeq_epi64_mask(pair, permit);
+        _mm512_storeu_si512(query + i, _mm512_mask_blend_epi64(from_arg, id, a));
+        _mm512_storeu_si512(ts + i, t);
+        _mm512_storeu_si512(arg + i, a);
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(event + i), _mm512_mask_cvtusepi64_epi8(_mm_setzero_si128(), 0xff, ev));
+    }
+    split_scalar(in + i, n - i, event + i, ts + i, query + i, arg + i);
+}
+
+__attribute__((target("avx512f")))
+size_t count_below_avx512(const int64_t* ts, size_t n, int64_t key) {
+    const auto k = _mm512_set1_epi64(key);
+    size_t count = 0;
+    for (size_t i = 0; i < n; i += 8) {
+        __mmask8 valid = n - i >= 8 ? 0xff : (1u << (n - i)) - 1;
+        count += std::popcount(unsigned(_mm512_mask_cmplt_epi64_mask(valid, _mm512_maskz_loadu_epi64(valid, ts + i), k)));
+    }
+    return count;
+}
+
+__attribute__((target("avx512f")))
+size_t find_event_avx512(const uint8_t* event, const uint32_t* positions, size_t n, uint8_t code) {
+    const auto low = _mm512_set1_epi32(0xff);
+    const auto c = _mm512_set1_epi32(code);
+    for (size_t k = 0; k < n; k += 16) {
+        __mmask16 valid = n - k >= 16 ? 0xffff : (1u << (n - k)) - 1;
+        auto at = _mm512_maskz_loadu_epi32(valid, positions + k);
+        auto ev = _mm512_and_si512(_mm512_mask_i32gather_epi32(_mm512_setzero_si512(), valid, at, event, 1), low);
+        if (unsigned hit = _mm512_mask_cmpeq_epi32_mask(valid, ev, c)) {
+            return k + std::countr_zero(hit);
+        }
+    }
+    return n;
+}
+
+const kernels& active_kernels() {
+    static const kernels scalar = {split_scalar, count_below_scalar, find_event_scalar};
+    static const kernels avx2 = {split_avx2, count_below_avx2, find_event_avx2};
+    static const kernels avx512 = {split_avx512, count_below_avx512, find_event_avx512};
+    switch (simd()) {
+    case simd_level::avx512: return avx512;
+    case simd_level::avx2: return avx2;
+    default: return scalar;
+    }
+}
+
+}
+
+simd_level simd() {
+    static const simd_level level = [] {
+        auto supported = simd_level::scalar;
+        if (__builtin_cpu_supports("avx512f")) {
+            supported = simd_level::avx512;
+        } else if (__builtin_cpu_supports("avx2")) {
+            supported = simd_level::avx2;
+        }
+        const char* cap = getenv("TRACE_SIMD");
+        for (auto l : {simd_level::scalar, simd_level::avx2, simd_level::avx512}) {
+            if (cap && simd_name(l) == cap) {
+                return std::min(supported, l);
+            }
+        }
+        return supported;
+    }();
+    return level;
+}
+
+std::string_view simd_name(simd_level level) {
+    switch (level) {
+    case simd_level::avx512: return "avx512";
+    case simd_level::avx2: return "avx2";
+    default: return "scalar";
+    }
+}
+
+trace_columns make_columns(std::span<const entry> span, unsigned n_threads) {
+    struct arrays {
+        std::unique_ptr<uint8_t[]> event;
+        std::unique_ptr<int64_t[]> ts;
+        std::unique_ptr<uint64_t[]> query;
+        std::unique_ptr<uint64_t[]> arg;
+    };
+    // Left uninitialized, as every element is written once.
+    auto storage = std::make_shared<arrays>();
+    storage->event.reset(new uint8_t[span.size() + event_padding]);
+    storage->ts.reset(new int64_t[span.size()]);
+    storage->query.reset(new uint64_t[span.size()]);
+    storage->arg.reset(new uint64_t[span.size()]);
+    memset(storage->event.get() + span.size(), 0, event_padding);
+    const auto& k = active_kernels();
+    parallel_for(span.size(), n_threads, [&] (size_t begin, size_t end, unsigned) {
+        k.split(span.data() + begin, end - begin, storage->event.get() + begin, storage->ts.get() + begin, storage->query.get() + begin, storage->arg.get() + begin);
+    });
+    size_t n = span.size();
+    return trace_columns{
+        std::span<const uint8_t>(storage->event.get(), n),
+        std::span<const int64_t>(storage->ts.get(), n),
+        std::span<const uint64_t>(storage->query.get(), n),
+        std::span<const uint64_t>(storage->arg.get(), n),
+        storage,
+    };
+}
+
+size_t trace_columns::lower_bound(int64_t key) const {
+    // Halve down to 64 timestamps, eight cache lines, and count those below key.
+    size_t lo = 0;
+    size_t n = ts.size();
+    while (n > 64) {
+        size_t half = n / 2;
+        if (ts[lo + half] < key) {
+            lo += half + 1;
+            n -= half + 1;
+        } else {
+            n = half;
+        }
+    }
+    return lo + active_kernels().count_below(ts.data() + lo, n, key);
+}
+
+size_t trace_columns::upper_bound(int64_t key) const {
+    return key == std::numeric_limits<int64_t>::max() ? ts.size() : lower_bound(key + 1);
+}
+
+size_t trace_columns::find_event(std::span<const uint32_t> positions, uint8_t code) const {
+    // Gathers take signed 32-bit offsets.
+    if (event.size() > size_t(std::numeric_limits<int32_t>::max())) {
+        return find_event_scalar(event.data(), positions.data(), positions.size(), code);
+    }
+    return active_kernels().find_event(event.data(), positions.data(), positions.size(), code);
+}
+
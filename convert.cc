@@ -0,0 +1,52 @@
+#include "trace.hh"
+#include "columnar.hh"
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string_view>
+#include <cerrno>
+#include <stdexcept>
+#include <system_error>
+
+// Converts a raw trace to the columnar format, or back with --raw.
+int main(int argc, char** argv) {
+    const char* paths[2] = {};
+    int n_paths = 0;
+    unsigned n_threads = std::max(1u, std::thread::hardware_concurrency());
+    bool to_raw = false;
+    for (int i = 1; i < argc; ++i) {
+        auto arg = std::string_view(argv[i]);
+        if ((arg == "-j" || arg == "--threads") && i + 1 < argc) {
+            n_threads = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--raw") {
+            to_raw = true;
+        } else if (n_paths < 2) {
+            paths[n_paths++] = argv[i];
+        }
+    }
+    if (n_paths != 2) {
+        throw std::runtime_error("USAGE: ./convert [-j THREADS] [--raw] IN OUT");
+    }
+    int fd = open(paths[0], O_RDONLY);
+    struct stat sb;
+    if (fd < 0 || fstat(fd, &sb)) {
+        throw std::system_error(errno, std::generic_category(), paths[0]);
+    }
+    auto trace = load_trace(fd, sb.st_size, n_threads);
+    FILE* out = fopen(paths[1], "wb");
+    if (!out) {
+        throw std::system_error(errno, std::generic_category(), paths[1]);
+    }
+    if (to_raw) {
+        if (fwrite(trace.span.data(), sizeof(entry), trace.span.size(), out) != trace.span.size()) {
+            throw std::system_error(errno, std::generic_category(), paths[1]);
+        }
+    } else {
+        write_columnar(trace.span, out, n_threads);
+    }
+    if (fclose(out)) {
+        throw std::system_error(errno, std::generic_category(), paths[1]);
+    }
+    return 0;
+}
@@ -0,0 +1,224 @@
+#include "engine.hh"
+#include "columnar.hh"
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <filesystem>
+#include <cerrno>
+#include <system_error>
+
+std::vector<trace_file> open_traces(const std::vector<std::string>& paths) {
+    auto files = std::vector<trace_file>();
+    for (const auto& p : paths) {
+        auto in_dir = std::vector<std::string>();
+        if (std::filesystem::is_directory(p)) {
+            for (const auto& f : std::filesystem::directory_iterator(p)) {
+                if (f.is_regular_file() && f.path().extension() != ".idx") {
+                    in_dir.push_back(f.path().string());
+                }
+            }
+            std::ranges::sort(in_dir);
+        } else {
+            in_dir.push_back(p);
+        }
+        for (auto& f : in_dir) {
+            files.push_back(trace_file{std::move(f)});
+        }
+    }
+    for (auto& f : files) {
+        f.fd = open(f.path.c_str(), O_RDONLY);
+        if (f.fd < 0 || fstat(f.fd, &f.sb)) {
+            throw std::system_error(errno, std::generic_category(), f.path);
+        }
+    }
+    return files;
+}
+
+void analyse_trace(const trace_file& file, const analysis_options& options, const analysis_hooks& hooks) {
+    unsigned n_threads = options.n_threads;
+    progress* done = hooks.done;
+    size_t file_size = file.sb.st_size;
+    auto r = trace_analysis();
+    auto table = std::vector<query>();
+    auto publish = [&] (const trace_analysis& analysis, std::vector<query> t) {
+        if (hooks.publish) {
+            hooks.publish(analysis, std::move(t));
+        }
+    };
+    // Runs one stage of the analysis, timed.
+    auto stage = [&] (const char* name, auto&& run) {
+        if (hooks.begin_stage) {
+            hooks.begin_stage(name);
+        }
+        double seconds = 0;
+        {
+            auto timer = scoped_timer{seconds};
+            run();
+        }
+        if (hooks.end_stage) {
+            hooks.end_stage(name, seconds, r.n_entries());
+        }
+    };
+    // Streaming sweeps a columnar trace a block at a time, so it is only mapped here.
+    stage("load", [&] {
+        if (options.streaming && (r.encoded = map_columnar(file.fd, file_size))) {
+            return;
+        }
+        auto trace = load_trace(file.fd, file_size, n_threads, done);
+        r.span = trace.span;
+        r.storage = trace.storage;
+    });
+    auto sidecar_path = file.path + ".idx";
+    auto save = [&] {
+        stage("cache", [&] {
+            save_sidecar(sidecar_path, file.sb, r.span, r.index, table, r.blame.get(), r.ios.get());
+        });
+    };
+    // Only the "IO latency" window needs the IOs, so they are paired after the table is out.
+    auto pair = [&] {
+        stage("io", [&] {
+            r.ios = std::make_shared<const std::vector<io_request>>(pair_ios(r.columns, n_threads));
+        });
+    };
+    bool details = options.details && !options.streaming;
+    // The fingerprint of an encoded trace would take decoding it.
+    if (options.use_cache && !r.encoded && load_sidecar(sidecar_path, file.sb, r.span, r.index, table, details ? &r.blame : nullptr, details ? &r.ios : nullptr)) {
+        if (options.streaming) {
+            // Just the table: the log windows index what they show, as after streaming.
+            r.index = query_index();
+        } else {
+            stage("columns", [&] {
+                r.columns = make_columns(r.span, n_threads);
+            });
+            r.indexed = true;
+        }
+        // A sidecar written without the blame matrix and the IOs, by a run that had no use
+        // for them: show the table, then add them and write them back, so that the next
+        // open needn't.
+        if (details && (!r.blame || !r.ios)) {
+            publish(r, table);
+            if (!r.blame) {
+                stage("blame", [&] {
+                    auto blame = std::make_shared<blame_matrix>();
+                    auto scratch = table;
+                    attribute(r.columns, r.index, scratch, n_threads, done, blame.get());
+                    r.blame = std::move(blame);
+                });
+            }
+            if (!r.ios) {
+                pair();
+            }
+            save();
+        }
+    } else if (options.streaming) {
+        stage("stream", [&] {
+            table = stream_queries(file.fd, file_size, options.memory_cap, done);
+            std::ranges::sort(table, std::ranges::less(), [] (const auto &x) {return x.latency;});
+        });
+    } else {
+        // A preview from pooled samples, with four times as many strata every round, until
+        // they have swept a quarter of the trace (or it has no more room for strata); the
+        // exact analysis then takes over.
+        if (options.preview) {
+            stage("preview", [&] {
+                auto pooled = trace_sample();
+                size_t max_strata = r.span.size() / trace_sample::seed_entries;
+                for (size_t n_strata = 16; pooled.n_swept * 4 < r.span.size() && n_strata / 4 <= max_strata; n_strata *= 4) {
+                    pooled.merge(sample_queries(r.span, n_strata, n_strata, n_threads));
+                    auto sampled = r;
+                    sampled.sample = pooled;
+                    sampled.sample->queries.clear();
+                    publish(sampled, pooled.queries);
+                    if (done) {
+                        *done = std::min(1.0, 4.0 * pooled.n_swept / std::max<size_t>(r.span.size(), 1));
+                    }
+                }
+            });
+        }
+        stage("columns", [&] {
+            r.columns = make_columns(r.span, n_threads);
+        });
+        stage("sort", [&] {
+            r.index = build_index(r.span, r.columns, n_threads, done);
+        });
+        stage("segment", [&] {
+            table = segment_queries(r.index, r.columns);
+            std::ranges::sort(table, std::ranges::less(), [] (const auto &x) {return x.latency;});
+        });
+        // The latencies are all the curve needs: show them while attributing.
+        publish(r, table);
+        stage("attribute", [&] {
+            auto blame = details ? std::make_shared<blame_matrix>() : nullptr;
+            attribute(r.columns, r.index, table, n_threads, done, blame.get());
+            r.blame = std::move(blame);
+        });
+        r.indexed = true;
+        if (details) {
+            publish(r, table);
+            pair();
+        }
+        if (options.use_cache) {
+            save();
+        }
+    }
+    publish(r, std::move(table));
+}
+
+std::vector<query> merge_tables(std::span<const std::vector<query>> tables) {
+    auto queries = std::vector<query>();
+    for (uint32_t s = 0; s < tables.size(); ++s) {
+        size_t mid = queries.size();
+        queries.insert(queries.end(), tables[s].begin(), tables[s].end());
+        for (size_t i = mid; i < queries.size(); ++i) {
+            queries[i].shard = s;
+        }
+        std::inplace_merge(queries.begin(), queries.begin() + mid, queries.end(), [] (const query& a, const query& b) {return a.latency < b.latency;});
+    }
+    return queries;
+}
+
+analysed_run analyse_run(const std::vector<std::string>& paths, const analysis_options& options) {
+    auto run = analysed_run{open_traces(paths)};
+    run.shards.resize(run.files.size());
+    auto tables = std::vector<std::vector<query>>(run.files.size());
+    auto shard_options = options;
+    shard_options.n_threads = std::max<size_t>(1, options.n_threads / std::max<size_t>(run.files.size(), 1));
+    parallel_tasks(run.files.size(), options.n_threads, [&] (size_t s) {
+        auto hooks = analysis_hooks();
+        hooks.publish = [&] (const trace_analysis& analysis, std::vector<query> table) {
+            run.shards[s] = analysis;
+            tables[s] = std::move(table);
+        };
+        analyse_trace(run.files[s], shard_options, hooks);
+    });
+    run.queries = merge_tables(tables);
+    return run;
+}
+
+std::vector<entry> query_events(const trace_analysis& shard, uint64_t id) {
+    auto events = std::vector<entry>();
+    if (shard.indexed) {
+        auto [begin, end] = shard.index.slots(id);
+        for (uint64_t slot = begin; slot < end; ++slot) {
+            events.push_back(shard.index.event(slot));
+        }
+        return events;
+    }
+    auto scan = [&] (std::span<const entry> entries) {
+        for (const auto& e : entries) {
+            if (e.query() == id) {
+                events.push_back(e);
+            }
+        }
+    };
+    if (shard.encoded) {
+        const auto& trace = shard.encoded->trace;
+        auto block = std::vector<entry>(trace.header->block_size);
+        for (size_t b = 0; b < trace.blocks.size(); ++b) {
+            scan(std::span<const entry>(block.data(), trace.decode(b, block.data())));
+        }
+        return events;
+    }
+    scan(shard.span);
+    return events;
+}
@@ -0,0 +1,95 @@
+#pragma once
+
+#include "trace.hh"
+#include "columnar.hh"
+#include <functional>
+#include <optional>
+#include <string>
+#include <sys/stat.h>
+
+// The analysis pipeline as a library, for the viewer, the server and anything else that
+// wants a query table: open the traces of a run, analyse each into its table and indexes,
+// and merge the tables. Everything here and in trace.hh is in libtrace.a.
+//
+// engine_api_version changes whenever a declaration here changes incompatibly.
+constexpr int engine_api_version = 1;
+
+// The trace file of one reactor shard, open for reading.
+struct trace_file {
+    std::string path;
+    int fd = -1;
+    struct stat sb = {};
+};
+
+// Opens the traces named by paths; a directory stands for the traces in it (but not their
+// sidecars), in name order. Throws std::system_error naming the first that won't open.
+std::vector<trace_file> open_traces(const std::vector<std::string>& paths);
+
+struct analysis_options {
+    unsigned n_threads = 1;
+    // Read and write the sidecar index next to the trace.
+    bool use_cache = true;
+    // Compute just the table, in one pass of bounded memory, without any index.
+    bool streaming = false;
+    size_t memory_cap = size_t(1024) << 20;
+    // Publish tables of pooled samples before the exact one.
+    bool preview = false;
+    // Pair the IOs and compute the blame matrix, which only interactive use needs.
+    bool details = true;
+};
+
+// What the analysis of one trace has found so far. Without a full index (streaming),
+// columns is empty and only the table is known; a columnar trace is then left encoded, span
+// empty, for the windows of it that are looked at to be decoded.
+struct trace_analysis {
+    std::span<const entry> span;
+    std::shared_ptr<const void> storage;
+    std::shared_ptr<const encoded_trace> encoded;
+    query_index index;
+    trace_columns columns;
+    std::shared_ptr<const std::vector<io_request>> ios;
+    std::shared_ptr<const blame_matrix> blame;
+    // While the table is a preview, the sample it is (without its queries).
+    std::optional<trace_sample> sample;
+    bool indexed = false;
+
+    size_t n_entries() const {
+        return encoded ? encoded->trace.size() : span.size();
+    }
+};
+
+// How analyse_trace() reports as it goes; every hook is optional.
+struct analysis_hooks {
+    // Around every stage, with the stage's time and the trace's entries once done.
+    std::function<void(const char* stage)> begin_stage;
+    std::function<void(const char* stage, double seconds, size_t entries)> end_stage;
+    // Every table as soon as it is known, in latency order: previews, the latencies alone,
+    // and last the complete one.
+    std::function<void(const trace_analysis& analysis, std::vector<query> table)> publish;
+    // The progress of the current stage.
+    progress* done = nullptr;
+};
+
+// Analyses one trace: maps it, then takes the table and index from its sidecar if that is
+// valid, or streams it, or indexes, segments and attributes it (saving the sidecar). The
+// blame matrix and the IO table are cached in the sidecar along with the table, and made
+// after it is published when the sidecar lacks them. Streaming takes just the table from
+// the sidecar, and leaves a columnar trace encoded.
+void analyse_trace(const trace_file& file, const analysis_options& options, const analysis_hooks& hooks);
+
+// Merges the latency-sorted tables of a run's shards into one, each query's shard its
+// table's position.
+std::vector<query> merge_tables(std::span<const std::vector<query>> tables);
+
+// A whole run, analysed before returning: the shards run in parallel, sharing the threads.
+struct analysed_run {
+    std::vector<trace_file> files;
+    std::vector<trace_analysis> shards;
+    std::vector<query> queries;
+};
+
+analysed_run analyse_run(const std::vector<std::string>& paths, const analysis_options& options);
+
+// The events of one query of a shard, in trace order: a range of the index, or without
+// one, a scan of the whole trace, a block at a time if it is encoded.
+std::vector<entry> query_events(const trace_analysis& shard, uint64_t id);
@@ -0,0 +1,399 @@
+#include "filter.hh"
+#include <cctype>
+#include <charconv>
+#include <limits>
+#include <stdexcept>
+
+bitmap bitmap::compress(std::span<const uint64_t> words) {
+    constexpr size_t chunk_words = chunk_bits / 64;
+    auto b = bitmap();
+    for (size_t begin = 0; begin < words.size(); begin += chunk_words) {
+        auto chunk_of = words.subspan(begin, std::min(chunk_words, words.size() - begin));
+        size_t n = 0;
+        for (auto w : chunk_of) {
+            n += std::popcount(w);
+        }
+        if (n == 0) {
+            continue;
+        }
+        auto c = chunk{uint32_t(begin / chunk_words)};
+        if (n <= max_sparse) {
+            c.positions.reserve(n);
+            for (size_t w = 0; w < chunk_of.size(); ++w) {
+                for (uint64_t bits = chunk_of[w]; bits; bits &= bits - 1) {
+                    c.positions.push_back(w * 64 + std::countr_zero(bits));
+                }
+            }
+        } else {
+            c.words.assign(chunk_of.begin(), chunk_of.end());
+        }
+        b.chunks.push_back(std::move(c));
+    }
+    return b;
+}
+
+size_t bitmap::count() const {
+    size_t n = 0;
+    for (const auto& c : chunks) {
+        n += c.positions.size();
+        for (auto w : c.words) {
+            n += std::popcount(w);
+        }
+    }
+    return n;
+}
+
+size_t bitmap::bytes() const {
+    size_t n = chunks.size() * sizeof(chunk);
+    for (const auto& c : chunks) {
+        n += c.positions.size() * sizeof(uint16_t) + c.words.size() * sizeof(uint64_t);
+    }
+    return n;
+}
+
+void bitmap::expand_into(std::span<uint64_t> words) const {
+    constexpr size_t chunk_words = chunk_bits / 64;
+    for (const auto& c : chunks) {
+        auto out = words.subspan(size_t(c.key) * chunk_words);
+        for (auto p : c.positions) {
+            out[p / 64] |= uint64_t(1) << (p % 64);
+        }
+        for (size_t w = 0; w < c.words.size(); ++w) {
+            out[w] |= c.words[w];
+        }
+    }
+}
+
+size_t filter_index::bytes() const {
+    size_t n = n_io.size() * sizeof(uint32_t) + start_ts.size() * sizeof(int64_t) + permit.bytes() + es.bytes();
+    for (const auto& b : rcs) {
+        n += b.bytes();
+    }
+    for (const auto* binned : {&io_bins, &start_bins}) {
+        n += binned->lows.size() * sizeof(int64_t) * 2;
+        for (const auto& b : binned->bins) {
+            n += b.bytes();
+        }
+    }
+    return n;
+}
+
+// Builds the bitmap of the queries for which has(q) holds, a range of words per thread so
+// that no two threads write the same word.
+template <typename Pred>
+static bitmap make_bitmap(size_t n, unsigned n_threads, Pred has) {
+    auto words = std::vector<uint64_t>((n + 63) / 64);
+    parallel_for(words.size(), n_threads, [&] (size_t begin, size_t end, unsigned) {
+        for (size_t w = begin; w < end; ++w) {
+            uint64_t bits = 0;
+            for (size_t q = w * 64; q < std::min(n, w * 64 + 64); ++q) {
+                bits |= uint64_t(has(q)) << (q % 64);
+            }
+            words[w] = bits;
+        }
+    });
+    return bitmap::compress(words);
+}
+
+// Cuts the values into about n_bins bins of equal population; equal values share a bin.
+static filter_index::binned make_bins(std::span<const int64_t> values, size_t n_bins, unsigned n_threads) {
+    auto b = filter_index::binned();
+    if (values.empty()) {
+        return b;
+    }
+    auto sorted = std::vector<int64_t>(values.begin(), values.end());
+    std::ranges::sort(sorted);
+    for (size_t k = 0; k < n_bins; ++k) {
+        int64_t low = sorted[k * sorted.size() / n_bins];
+        if (b.lows.empty() || low > b.lows.back()) {
+            b.lows.push_back(low);
+        }
+    }
+    auto bin_of = std::vector<uint8_t>(values.size());
+    parallel_for(values.size(), n_threads, [&] (size_t begin, size_t end, unsigned) {
+        for (size_t q = begin; q < end; ++q) {
+            bin_of[q] = std::ranges::upper_bound(b.lows, values[q]) - b.lows.begin() - 1;
+        }
+    });
+    for (size_t k = 0; k < b.lows.size(); ++k) {
+        b.bins.push_back(make_bitmap(values.size(), n_threads, [&] (size_t q) {return bin_of[q] == k;}));
+    }
+    return b;
+}
+
+filter_index make_filter_index(std::span<const query> queries, unsigned n_threads) {
+    constexpr size_t n_bins = 64;
+    auto index = filter_index();
+    index.size = queries.size();
+    index.n_io.resize(queries.size());
+    index.start_ts.resize(queries.size());
+    parallel_for(queries.size(), n_threads, [&] (size_t begin, size_t end, unsigned) {
+        for (size_t q = begin; q < end; ++q) {
+            index.n_io[q] = queries[q].traits.n_io;
+            index.start_ts[q] = queries[q].start_ts;
+        }
+    });
+    if (!queries.empty()) {
+        index.first_start_ts = *std::ranges::min_element(index.start_ts);
+    }
+    for (size_t s = 0; s < index.rcs.size(); ++s) {
+        index.rcs[s] = make_bitmap(queries.size(), n_threads, [&] (size_t q) {return (queries[q].traits.rcs >> s) & 1;});
+    }
+    index.permit = make_bitmap(queries.size(), n_threads, [&] (size_t q) {return queries[q].traits.permit;});
+    index.es = make_bitmap(queries.size(), n_threads, [&] (size_t q) {return queries[q].traits.es;});
+    auto io = std::vector<int64_t>(index.n_io.begin(), index.n_io.end());
+    index.io_bins = make_bins(io, n_bins, n_threads);
+    index.start_bins = make_bins(index.start_ts, n_bins, n_threads);
+    return index;
+}
+
+namespace {
+
+// Enough for any filter typed by hand, and few enough that evaluating one, which recurses
+// into every node, takes bounded memory and stack.
+constexpr size_t max_filter_nodes = 256;
+constexpr int max_filter_depth = 256;
+
+struct parser {
+    std::string_view text;
+    size_t at = 0;
+    filter f;
+    int depth = 0;
+
+    [[noreturn]] void fail(std::string_view what) {
+        throw std::runtime_error(fmt::format("filter: {} at offset {}", what, at));
+    }
+    void skip_space() {
+        while (at < text.size() && (text[at] == ' ' || text[at] == '\t')) {
+            ++at;
+        }
+    }
+    bool at_end() {
+        skip_space();
+        return at == text.size();
+    }
+    bool accept(std::string_view token) {
+        skip_space();
+        if (!text.substr(at).starts_with(token)) {
+            return false;
+        }
+        // Words must not run into the next one.
+        size_t end = at + token.size();
+        if (std::isalpha(static_cast<unsigned char>(token.back())) && end < text.size() && std::isalnum(static_cast<unsigned char>(text[end]))) {
+            return false;
+        }
+        at = end;
+        return true;
+    }
+    int add(filter::node n) {
+        if (f.nodes.size() == max_filter_nodes) {
+            fail("too many terms");
+        }
+        f.nodes.push_back(n);
+        return f.nodes.size() - 1;
+    }
+    // Parses an operand of not or parentheses.
+    int nested(auto parse) {
+        if (++depth > max_filter_depth) {
+            fail("nested too deeply");
+        }
+        int n = parse();
+        --depth;
+        return n;
+    }
+    int any_of() {
+        int left = all_of();
+        while (accept("or")) {
+            int right = all_of();
+            left = add(filter::node{filter::kind::any_of, filter::comparison::equal, 0, left, right});
+        }
+        return left;
+    }
+    int all_of() {
+        int left = factor();
+        while (accept("and")) {
+            int right = factor();
+            left = add(filter::node{filter::kind::all_of, filter::comparison::equal, 0, left, right});
+        }
+        return left;
+    }
+    int factor() {
+        if (accept("not")) {
+            int operand = nested([&] {return factor();});
+            return add(filter::node{filter::kind::negate, filter::comparison::equal, 0, operand});
+        }
+        if (accept("(")) {
+            int inner = nested([&] {return any_of();});
+            if (!accept(")")) {
+                fail("expected )");
+            }
+            return inner;
+        }
+        if (accept("permit")) {
+            return add(filter::node{filter::kind::permit});
+        }
+        if (accept("es")) {
+            return add(filter::node{filter::kind::es});
+        }
+        auto n = filter::node();
+        if (accept("rcs")) {
+            n.what = filter::kind::rcs;
+        } else if (accept("io")) {
+            n.what = filter::kind::io;
+        } else if (accept("start")) {
+            n.what = filter::kind::start;
+        } else {
+            fail("expected rcs, io, start, permit, es, not or (");
+        }
+        // Two-character comparisons first, so that <= isn't read as <.
+        if (accept("<=")) {
+            n.cmp = filter::comparison::less_equal;
+        } else if (accept(">=")) {
+            n.cmp = filter::comparison::greater_equal;
+        } else if (accept("<")) {
+            n.cmp = filter::comparison::less;
+        } else if (accept(">")) {
+            n.cmp = filter::comparison::greater;
+        } else if (accept("=")) {
+            n.cmp = filter::comparison::equal;
+        } else {
+            fail("expected a comparison");
+        }
+        if (n.what == filter::kind::rcs && n.cmp != filter::comparison::equal) {
+            fail("rcs only compares with =");
+        }
+        skip_space();
+        auto [end, ec] = std::from_chars(text.data() + at, text.data() + text.size(), n.value);
+        if (ec != std::errc()) {
+            fail("expected a number");
+        }
+        at = end - text.data();
+        return add(n);
+    }
+};
+
+}
+
+filter parse_filter(std::string_view text) {
+    auto p = parser{text};
+    p.f.root = p.any_of();
+    if (!p.at_end()) {
+        p.fail("unexpected text");
+    }
+    return std::move(p.f);
+}
+
+static bool compare(double x, filter::comparison cmp, double value) {
+    switch (cmp) {
+    case filter::comparison::less: return x < value;
+    case filter::comparison::less_equal: return x <= value;
+    case filter::comparison::equal: return x == value;
+    case filter::comparison::greater_equal: return x >= value;
+    case filter::comparison::greater: return x > value;
+    }
+    return false;
+}
+
+// The queries whose value in column, binned by bins, compares to value as cmp says. The
+// comparisons all hold on an interval of values, so a bin whose lowest and highest values
+// both match matches whole, and one entirely outside it doesn't at all.
+template <typename T>
+static void match_range(const filter_index::binned& bins, std::span<const T> column, filter::comparison cmp, double value, std::span<uint64_t> words) {
+    auto test = [&] (double x) {return compare(x, cmp, value);};
+    for (size_t k = 0; k < bins.lows.size(); ++k) {
+        double low = bins.lows[k];
+        // The next bin's low bounds this one's values; the last one's are bounded by nothing.
+        double high = k + 1 < bins.lows.size() ? double(bins.lows[k + 1]) : std::numeric_limits<double>::infinity();
+        bool low_in = test(low);
+        bool high_in = k + 1 < bins.lows.size() ? test(high) : (cmp == filter::comparison::greater || cmp == filter::comparison::greater_equal);
+        if (low_in && high_in && cmp != filter::comparison::equal) {
+            bins.bins[k].expand_into(words);
+        } else if (low_in || high_in || (value > low && value < high)) {
+            bins.bins[k].for_each([&] (size_t q) {
+                if (test(double(column[q]))) {
+                    words[q / 64] |= uint64_t(1) << (q % 64);
+                }
+            });
+        }
+    }
+}
+
+std::vector<uint64_t> evaluate(const filter& f, const filter_index& index) {
+    size_t n_words = (index.size + 63) / 64;
+    auto eval = [&] (auto& self, int at) -> std::vector<uint64_t> {
+        const auto& n = f.nodes[at];
+        // Combinations work in their left operand's words, so that only the leaves allocate
+        // and a chain of them holds no more than two at a time.
+        bool combination = n.what == filter::kind::negate || n.what == filter::kind::all_of || n.what == filter::kind::any_of;
+        auto words = combination ? self(self, n.left) : std::vector<uint64_t>(n_words);
+        switch (n.what) {
+        case filter::kind::rcs:
+            if (n.value >= 0 && n.value < index.rcs.size() && n.value == int(n.value)) {
+                index.rcs[int(n.value)].expand_into(words);
+            }
+            break;
+        case filter::kind::permit:
+            index.permit.expand_into(words);
+            break;
+        case filter::kind::es:
+            index.es.expand_into(words);
+            break;
+        case filter::kind::io:
+            match_range<uint32_t>(index.io_bins, index.n_io, n.cmp, n.value, words);
+            break;
+        case filter::kind::start: {
+            // Milliseconds since the first start, in ticks.
+            double ts = index.first_start_ts + n.value * 1e6 / MULTIPLIER;
+            match_range<int64_t>(index.start_bins, index.start_ts, n.cmp, ts, words);
+            break;
+        }
+        case filter::kind::negate:
+            for (auto& w : words) {
+                w = ~w;
+            }
+            if (index.size % 64) {
+                words.back() &= (uint64_t(1) << (index.size % 64)) - 1;
+            }
+            break;
+        case filter::kind::all_of:
+        case filter::kind::any_of: {
+            auto right = self(self, n.right);
+            for (size_t w = 0; w < n_words; ++w) {
+                words[w] = n.what == filter::kind::all_of ? words[w] & right[w] : words[w] | right[w];
+            }
+            break;
+        }
+        }
+        return words;
+    };
+    if (f.root < 0) {
+        return std::vector<uint64_t>(n_words);
+    }
+    return eval(eval, f.root);
+}
+
+bool matches(const filter& f, const query& q, int64_t first_start_ts) {
+    auto eval = [&] (auto& self, int at) -> bool {
+        const auto& n = f.nodes[at];
+        switch (n.what) {
+        case filter::kind::rcs:
+            return n.value >= 0 && n.value < std::tuple_size_v<decltype(filter_index::rcs)> && n.value == int(n.value) && ((q.traits.rcs >> int(n.value)) & 1);
+        case filter::kind::permit:
+            return q.traits.permit;
+        case filter::kind::es:
+            return q.traits.es;
+        case filter::kind::io:
+            return compare(double(q.traits.n_io), n.cmp, n.value);
+        case filter::kind::start:
+            return compare(double(q.start_ts), n.cmp, first_start_ts + n.value * 1e6 / MULTIPLIER);
+        case filter::kind::negate:
+            return !self(self, n.left);
+        case filter::kind::all_of:
+            return self(self, n.left) && self(self, n.right);
+        case filter::kind::any_of:
+            return self(self, n.left) || self(self, n.right);
+        }
+        return false;
+    };
+    return f.root >= 0 && eval(eval, f.root);
+}
@@ -0,0 +1,100 @@
+#pragma once
+
+#include "trace.hh"
+#include <array>
+#include <string_view>
+
+// A set of positions in a query table, compressed the way roaring bitmaps are: in chunks
+// of 2^16 positions, each either the sorted list of its positions, if it has few, or a
+// bitset. Predicates are evaluated on plain bitsets of 64-bit words, which the chunks
+// expand into.
+struct bitmap {
+    static constexpr size_t chunk_bits = 1 << 16;
+    static constexpr size_t max_sparse = 4096;
+    struct chunk {
+        uint32_t key;
+        std::vector<uint16_t> positions;
+        std::vector<uint64_t> words;
+    };
+    std::vector<chunk> chunks;
+
+    // The set bits of words.
+    static bitmap compress(std::span<const uint64_t> words);
+    size_t count() const;
+    size_t bytes() const;
+    // Sets the bits of the positions in words, which is large enough to hold them all.
+    void expand_into(std::span<uint64_t> words) const;
+
+    template <typename Func>
+    void for_each(Func func) const {
+        for (const auto& c : chunks) {
+            size_t base = size_t(c.key) * chunk_bits;
+            for (auto p : c.positions) {
+                func(base + p);
+            }
+            for (size_t w = 0; w < c.words.size(); ++w) {
+                for (uint64_t bits = c.words[w]; bits; bits &= bits - 1) {
+                    func(base + w * 64 + std::countr_zero(bits));
+                }
+            }
+        }
+    }
+};
+
+// The attributes of every query of a table, in table order, with bitmaps to filter the
+// table on them: one per RCS status, and for PERMIT and ES presence. The IO count and the
+// start time get one bitmap per bin of about equal population; a range takes the bins it
+// covers whole, and checks the members of the bins it cuts against the column.
+struct filter_index {
+    struct binned {
+        // The lowest value of every bin, ascending.
+        std::vector<int64_t> lows;
+        std::vector<bitmap> bins;
+    };
+    size_t size = 0;
+    std::vector<uint32_t> n_io;
+    std::vector<int64_t> start_ts;
+    std::array<bitmap, 5> rcs;
+    bitmap permit;
+    bitmap es;
+    binned io_bins;
+    binned start_bins;
+    // The start of the earliest query, which start times in filters count from.
+    int64_t first_start_ts = 0;
+
+    size_t bytes() const;
+};
+
+filter_index make_filter_index(std::span<const query> queries, unsigned n_threads);
+
+// A predicate over the attributes of queries, parsed from text like
+//
+//     rcs=3 and (io>10 or not permit) and start>=1500
+//
+// Terms are rcs=N (got RCS status N), io and start compared with <, <=, =, >= or > to a
+// number (start in milliseconds since the earliest query start), permit and es; they
+// combine with not, and, or (binding in that order) and parentheses.
+struct filter {
+    enum class kind { rcs, io, start, permit, es, negate, all_of, any_of };
+    enum class comparison { less, less_equal, equal, greater_equal, greater };
+    struct node {
+        kind what;
+        comparison cmp = comparison::equal;
+        double value = 0;
+        // The operands of not, and and or.
+        int left = -1;
+        int right = -1;
+    };
+    std::vector<node> nodes;
+    int root = -1;
+};
+
+// Throws std::runtime_error naming the offset of the first thing it can't make sense of, or
+// at which the filter grows past 256 terms and operators or nests deeper than 256.
+filter parse_filter(std::string_view text);
+
+// The positions in the table of the queries that match f, as bits of 64-bit words.
+std::vector<uint64_t> evaluate(const filter& f, const filter_index& index);
+// Whether q matches f, with start times counted from first_start_ts: for rows added to a
+// table since its index was made.
+bool matches(const filter& f, const query& q, int64_t first_start_ts);
@@ -0,0 +1,132 @@
+#include "trace.hh"
+#include <stdlib.h>
+#include <string.h>
+#include <random>
+#include <string_view>
+#include <cerrno>
+#include <stdexcept>
+#include <system_error>
+
+struct generator_config {
+    uint64_t n_queries = 0;
+    unsigned concurrency = 64;
+    unsigned io_depth = 3;
+    unsigned events_per_query = 24;
+    uint64_t max_size = 0;
+    uint64_t seed = 1;
+};
+
+// Writes a synthetic trace of one reactor: queries START, go through RCS admission and
+// PERMIT, then alternate between running (SWITCH to them), nested IO and waiting for the
+// CPU, and finish with ES. Foreign tasks (SWITCH to 0) get the CPU in between. Ids look
+// like the aligned pointers of a real trace and are never reused.
+void generate(FILE* out, const generator_config& config) {
+    struct live {
+        uint64_t id;
+        unsigned left;
+        std::vector<uint64_t> io;
+    };
+    auto rng = std::mt19937_64(config.seed);
+    auto chance = [&] (unsigned percent) {return rng() % 100 < percent;};
+    auto buffer = std::vector<entry>();
+    uint64_t written = 0;
+    int64_t ts = 1'000'000;
+    auto emit = [&] (uint64_t event, uint64_t id, uint64_t arg) {
+        ts += 1 + rng() % 2000;
+        buffer.push_back(entry{event, id, arg, ts});
+        if (buffer.size() == 65536) {
+            if (fwrite(buffer.data(), sizeof(entry), buffer.size(), out) != buffer.size()) {
+                throw std::system_error(errno, std::generic_category(), "fwrite");
+            }
+            written += buffer.size() * sizeof(entry);
+            buffer.clear();
+        }
+    };
+    auto full = [&] {
+        return config.max_size && written + buffer.size() * sizeof(entry) >= config.max_size;
+    };
+
+    auto queries = std::vector<live>();
+    uint64_t started = 0;
+    uint64_t next_io = 1;
+    size_t running = 0;
+    while (queries.size() || (started < config.n_queries && !full())) {
+        bool can_start = started < config.n_queries && !full() && queries.size() < config.concurrency;
+        if (can_start && (queries.empty() || chance(20))) {
+            uint64_t id = 0x600000000000 + (started++ << 7);
+            emit(0x1, 0, id);
+            emit(0x3, id, chance(70) ? 0 : 1 + rng() % 4);
+            emit(0xa, 0, id);
+            queries.push_back(live{id, 1 + unsigned(rng() % (2 * config.events_per_query))});
+            continue;
+        }
+        if (chance(10)) {
+            emit(0x0, 0, 0);
+            continue;
+        }
+        // The query on the CPU usually keeps it for a few events.
+        if (running >= queries.size() || chance(40)) {
+            running = rng() % queries.size();
+        }
+        auto& q = queries[running];
+        if (q.left == 0 && q.io.empty()) {
+            emit(0xb, 0, q.id);
+            std::swap(q, queries.back());
+            queries.pop_back();
+            continue;
+        }
+        // Pending IO completes first once the query has no events left.
+        if (!q.io.empty() && (q.left == 0 || chance(40))) {
+            emit(0x5, q.id, q.io.back());
+            q.io.pop_back();
+        } else if (q.io.size() < config.io_depth && chance(30)) {
+            q.io.push_back(next_io++);
+            emit(0x4, q.id, q.io.back());
+        } else {
+            emit(0x0, 0, q.id);
+        }
+        q.left -= q.left > 0;
+    }
+    if (fwrite(buffer.data(), sizeof(entry), buffer.size(), out) != buffer.size()) {
+        throw std::system_error(errno, std::generic_category(), "fwrite");
+    }
+}
+
+int main(int argc, char** argv) {
+    const char* path = nullptr;
+    auto config = generator_config();
+    for (int i = 1; i < argc; ++i) {
+        auto arg = std::string_view(argv[i]);
+        if (arg == "-n" && i + 1 < argc) {
+            config.n_queries = std::strtoull(argv[++i], nullptr, 0);
+        } else if (arg == "-c" && i + 1 < argc) {
+            config.concurrency = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "-d" && i + 1 < argc) {
+            config.io_depth = std::max(0, std::atoi(argv[++i]));
+        } else if (arg == "-e" && i + 1 < argc) {
+            config.events_per_query = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "-s" && i + 1 < argc) {
+            config.max_size = std::strtoull(argv[++i], nullptr, 0) << 20;
+        } else if (arg == "--seed" && i + 1 < argc) {
+            config.seed = std::strtoull(argv[++i], nullptr, 0);
+        } else {
+            path = argv[i];
+        }
+    }
+    if (!config.n_queries) {
+        // A size bound alone lifts the query count limit.
+        config.n_queries = config.max_size ? uint64_t(-1) : 100000;
+    }
+    if (!path) {
+        throw std::runtime_error("USAGE: ./gen [-n QUERIES] [-c CONCURRENCY] [-d IO_DEPTH] [-e EVENTS_PER_QUERY] [-s SIZE_MB] [--seed SEED] FILE");
+    }
+    FILE* out = fopen(path, "wb");
+    if (!out) {
+        throw std::system_error(errno, std::generic_category(), path);
+    }
+    generate(out, config);
+    if (fclose(out)) {
+        throw std::system_error(errno, std::generic_category(), path);
+    }
+    return 0;
+}
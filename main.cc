@@ -2,18 +2,40 @@
 #include <imgui/imgui.h>
 #include <imgui/backends/imgui_impl_glfw.h>
 #include <imgui/backends/imgui_impl_opengl3.h>
+#include "trace.hh"
+#include "columnar.hh"
+#include "filter.hh"
+#include "engine.hh"
 #include <algorithm>
+#include <numeric>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <math.h>
 #include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <unistd.h>
 #include <span>
+#include <ranges>
 #include <functional>
 #include <chrono>
 #include <thread>
 #include <vector>
+#include <array>
+#include <bit>
+#include <string>
+#include <memory>
+#include <limits>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <unordered_map>
+#include <filesystem>
+#include <optional>
+#include <utility>
+#include <string_view>
 #include <cerrno>
 #include <atomic>
 #include <stdexcept>
@@ -22,163 +44,512 @@
 #include <fmt/ranges.h>
 #include <GLFW/glfw3.h> // Will drag system OpenGL headers
 
-const double MULTIPLIER = 0.2941171840072451;
-
 inline int64_t rdtsc() {
     uint64_t rax, rdx;
     asm volatile ( "rdtsc" : "=a" (rax), "=d" (rdx) );
     return (int64_t)(( rdx << 32 ) + rax);
 }
 
+// The resident set of the process, from /proc/self/statm, or 0 if unreadable.
+static size_t resident_bytes() {
+    size_t pages = 0, resident = 0;
+    FILE* f = fopen("/proc/self/statm", "r");
+    if (!f) {
+        return 0;
+    }
+    if (fscanf(f, "%zu %zu", &pages, &resident) != 2) {
+        resident = 0;
+    }
+    fclose(f);
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
 static void glfw_error_callback(int error, const char* description) {
     fprintf(stderr, "GLFW Error %d: %s\n", error, description);
 }
 
-struct entry {
-    uint64_t event;
-    uint64_t id;
-    uint64_t arg;
-    int64_t ts;
-
-    uint64_t query() const {
-        if (event == 0 || event == 1 || event == 0xa || event == 0xb) {
-            return arg;
+int main(int argc, char** argv) {
+    auto paths = std::vector<std::string>();
+    unsigned n_threads = std::max(1u, std::thread::hardware_concurrency());
+    bool streaming = false;
+    bool preview = false;
+    bool follow = false;
+    bool use_cache = true;
+    bool headless = false;
+    auto format = report_format::json;
+    size_t top_n = 20;
+    size_t bench_frames = 0;
+    size_t memory_cap = size_t(1024) << 20;
+    int hdr_digits = 3;
+    const char* stats_path = nullptr;
+    for (int i = 1; i < argc; ++i) {
+        auto arg = std::string_view(argv[i]);
+        if ((arg == "-j" || arg == "--threads") && i + 1 < argc) {
+            n_threads = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--stream") {
+            streaming = true;
+        } else if (arg == "--preview") {
+            preview = true;
+        } else if (arg == "--follow") {
+            follow = true;
+        } else if (arg == "--no-cache") {
+            use_cache = false;
+        } else if (arg == "--headless") {
+            headless = true;
+        } else if (arg == "--csv") {
+            format = report_format::csv;
+        } else if (arg == "--top" && i + 1 < argc) {
+            top_n = std::max(0, std::atoi(argv[++i]));
+        } else if (arg == "--frames" && i + 1 < argc) {
+            bench_frames = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--memory-cap" && i + 1 < argc) {
+            memory_cap = size_t(std::max(16, std::atoi(argv[++i]))) << 20;
+        } else if (arg == "--hdr-digits" && i + 1 < argc) {
+            hdr_digits = std::clamp(std::atoi(argv[++i]), 1, 5);
+        } else if (arg == "--stats" && i + 1 < argc) {
+            stats_path = argv[++i];
         } else {
-            return id;
+            paths.push_back(argv[i]);
         }
     }
-};
-template <> struct fmt::formatter<entry> : formatter<string_view> {
-    auto format(const entry& e, auto& ctx) const -> decltype(ctx.out()) {
-        // ctx.out() is an output iterator to write to.
-        return fmt::format_to(ctx.out(), "({:016x} {:016x} {:016x} {:016x})", e.event, e.id, e.arg, e.ts);
-    }
-};
-
-int main(int argc, char** argv) {
-    if (argc == 1) {
-        throw std::runtime_error("USAGE: ./main FILE");
+    if (paths.empty()) {
+        throw std::runtime_error("USAGE: ./main [-j THREADS] [--stream [--memory-cap MB] | --follow] [--preview] [--no-cache] [--headless [--csv] [--top N]] [--hdr-digits 1-5] [--frames N] [--stats FILE] FILE|DIR...");
     }
-    const char *memblock;
-    int fd;
-    struct stat sb;
-
-    fd = open(argv[1], O_RDONLY);
-    fstat(fd, &sb);
-    size_t file_size = sb.st_size;
-    memblock = (char*)mmap(nullptr, file_size, PROT_WRITE | PROT_READ, MAP_PRIVATE, fd, 0);
-    if (memblock == MAP_FAILED) {
-        throw std::system_error(errno, std::generic_category(), argv[1]);
+    // One trace per reactor shard, with what its analysis has found so far once installed.
+    // Without a full index, the log windows get one covering just the shown queries.
+    struct shard : trace_file, trace_analysis {};
+    auto shards = std::vector<shard>();
+    for (auto& f : open_traces(paths)) {
+        shards.push_back(shard{std::move(f)});
     }
-    size_t n_entries = file_size / sizeof(entry);
-    auto span = std::span<const entry>(reinterpret_cast<const entry*>(memblock), n_entries);
-    auto sorted = std::vector<entry>(span.begin(), span.end());
-    std::ranges::sort(sorted, std::ranges::less(), [] (const auto &x) {return std::make_pair(x.query(), x.ts);});
-#if 0
-    for (const auto &x : sorted) {
-        fmt::print("{:016x} {}\n", x.query(), x) ;
+    if (follow && shards.size() != 1) {
+        throw std::runtime_error("--follow takes a single trace file");
     }
-#endif
 
-    struct query {
-        std::chrono::duration<double> latency;
-        uint64_t id;
-        std::chrono::duration<double> cputime;
-        std::chrono::duration<double> iotime;
-        std::chrono::duration<double> starvetime;
+    // Attribution assumes a single CPU timeline, so every shard is analysed on its own. The
+    // shards run in parallel, sharing the threads, and in the background unless headless:
+    // the window opens at once, with how far each shard has got, and a shard's table shows
+    // as soon as its latencies are known, before it is attributed.
+    struct shard_progress {
+        std::atomic<const char*> stage = "queued";
+        progress done = 0;
     };
-    std::vector<query> queries;
-    {
-        size_t i = 0;
-        while (i < sorted.size()) {
-            while (sorted[i].event != 1 && i < sorted.size()) {
-                ++i;
-            }
-            if (i == sorted.size()) {
-                break;
+    auto progresses = std::vector<shard_progress>(shards.size());
+    // Every shard's results and their merged table, as of one publish. The UI only ever takes
+    // a whole snapshot, so it never sees a table half merged.
+    struct snapshot {
+        std::vector<trace_analysis> shards;
+        std::vector<query> queries;
+    };
+    auto results_mutex = std::mutex();
+    auto results = std::vector<trace_analysis>(shards.size());
+    auto tables = std::vector<std::vector<query>>(shards.size());
+    auto pending_mutex = std::mutex();
+    auto pending = std::unique_ptr<snapshot>();
+    auto publish = [&] (uint32_t s, const trace_analysis& r, std::vector<query> table) {
+        auto lock = std::lock_guard(results_mutex);
+        results[s] = r;
+        tables[s] = std::move(table);
+        auto next = std::make_unique<snapshot>();
+        next->shards = results;
+        next->queries = merge_tables(tables);
+        auto pending_lock = std::lock_guard(pending_mutex);
+        pending = std::move(next);
+    };
+    // How long every stage of every shard took, for the "Stats" window and --stats.
+    struct stage_time {
+        uint32_t shard;
+        const char* stage;
+        double seconds;
+        size_t entries;
+    };
+    auto stage_times_mutex = std::mutex();
+    auto stage_times = std::vector<stage_time>();
+    // Shows each stage as the shard's current one. Only the "Blame" and "IO latency" windows
+    // need the analysis' details, and only the graph a preview.
+    auto analyse = [&] (uint32_t s, unsigned n_threads) {
+        auto& p = progresses[s];
+        auto options = analysis_options{n_threads, use_cache, streaming, memory_cap, preview && !headless, !headless};
+        auto hooks = analysis_hooks();
+        hooks.begin_stage = [&] (const char* name) {
+            p.stage = name;
+            p.done = 0;
+        };
+        hooks.end_stage = [&] (const char* name, double seconds, size_t entries) {
+            auto lock = std::lock_guard(stage_times_mutex);
+            stage_times.push_back(stage_time{s, name, seconds, entries});
+        };
+        hooks.publish = [&] (const trace_analysis& r, std::vector<query> table) {
+            publish(s, r, std::move(table));
+        };
+        hooks.done = &p.done;
+        analyse_trace(shards[s], options, hooks);
+        p.stage = "done";
+        p.done = 1;
+    };
+    auto analysis_done = std::atomic<bool>(false);
+    auto run_analysis = [&] (bool background) {
+        unsigned shard_threads = std::max<size_t>(1, n_threads / shards.size());
+        parallel_tasks(shards.size(), n_threads, [&] (size_t s) {
+            if (!background) {
+                analyse(s, shard_threads);
+                return;
             }
-            auto current_query = sorted[i].query();
-            auto start = sorted[i].ts;
-            while (i + 1 < sorted.size() && sorted[i + 1].query() == current_query) {
-                ++i;
+            try {
+                analyse(s, shard_threads);
+            } catch (const std::exception& e) {
+                fmt::print(stderr, "{}: {}\n", shards[s].path, e.what());
+                progresses[s].stage = "failed";
             }
-            auto end = sorted[i].ts;
-            auto time = std::chrono::duration<double, std::nano>(double(end - start) * MULTIPLIER);
-            queries.push_back(query{time, current_query});
-            ++i;
+        });
+        tables = std::vector<std::vector<query>>();
+        analysis_done = true;
+    };
+    auto take_pending = [&] {
+        auto lock = std::lock_guard(pending_mutex);
+        return std::move(pending);
+    };
+
+    std::vector<query> queries;
+    // Takes over the tables and indexes of a snapshot.
+    auto install = [&] (snapshot& snap) {
+        queries = std::move(snap.queries);
+        for (size_t s = 0; s < shards.size(); ++s) {
+            static_cast<trace_analysis&>(shards[s]) = snap.shards[s];
+        }
+    };
+    auto live = std::unique_ptr<live_trace>();
+    auto analysis = std::thread();
+    if (follow) {
+        // The trace may not even have its first query yet.
+        auto head = columnar_header{};
+        if (pread(shards[0].fd, &head, sizeof(head), 0) == sizeof(head) && is_columnar(std::span<const char>(reinterpret_cast<const char*>(&head), sizeof(head)))) {
+            throw std::runtime_error("--follow takes a raw trace");
+        }
+        live = std::make_unique<live_trace>(shards[0].fd);
+        live->update(queries);
+        while (queries.empty()) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(200));
+            live->update(queries);
         }
+        shards[0].span = live->span();
+        analysis_done = true;
+    } else if (headless) {
+        run_analysis(false);
+        install(*take_pending());
+    } else {
+        analysis = std::thread(run_analysis, true);
+    }
+    auto spans = std::vector<std::span<const entry>>();
+    for (const auto& sh : shards) {
+        spans.push_back(sh.span);
     }
-    std::ranges::sort(queries, std::ranges::less(), [] (const auto &x) {return x.latency;});
 #if 0
     for (const auto &x : queries) {
         fmt::print("{} {}\n", x.latency.count(), x.id) ;
     }
 #endif
 
-    {
-        for (auto &x : queries) {
-            auto id = x.id;
-            auto sorted_range = std::ranges::equal_range(sorted, id, std::ranges::less(), [] (const auto& e) {return e.query();});
-            //fmt::print("tsrange: {} {}\n", sorted_range.front().ts, sorted_range.back().ts);
-            auto span_range = std::ranges::equal_range(span, 1, std::ranges::less(), [&sorted_range] (const auto& e) {return (e.ts >= sorted_range.front().ts) + (e.ts > sorted_range.back().ts);});
-
-            uint64_t iostack = 0;
-            bool cpu = true;
-            uint64_t prev_ts = sorted_range.begin()->ts;
-            uint64_t cputime = 0;
-            uint64_t starvetime = 0;
-            uint64_t iotime = 0;
-            size_t i;
-            //fmt::print("range: {} {}\n", span_range.begin() - span.begin(), span_range.end() - span.begin());
-            for (i = span_range.begin() - span.begin(); i < size_t(span_range.end() - span.begin()); ++i) {
-                //fmt::print("looping: {}\n", i);
-                uint64_t dt = span[i].ts - prev_ts;
-                if (iostack == 0 && !cpu) {
-                    starvetime += dt;
-                }
-                if (cpu) {
-                    cputime += dt;
-                }
-                if (iostack) {
-                    iotime += dt;
-                }
-                if (span[i].query() == id) {
-                    if (span[i].event != 0x5) {
-                        cpu = true;
-                    }
-                    if (span[i].event == 0x4) {
-                        iostack += 1;
-                    } else if (span[i].event == 0x5) {
-                        iostack -= 1;
-                    }
-                } else {
-                    cpu = false;
-                }
-                prev_ts = span[i].ts;
+    // The predicate of the "Filter" window, if any, and the index it is evaluated on, which
+    // is rebuilt on first use after the table changes.
+    auto active_filter = std::optional<filter>();
+    auto query_filter_index = filter_index();
+    uint64_t table_version = 0;
+    uint64_t filter_index_version = -1;
+    size_t n_matching = 0;
+
+    // Self-profiling: the stage times above, what the latest frames cost and each window in
+    // them, and how much memory the trace and its indexes take.
+    auto recent_frames = std::deque<double>();
+    auto window_ms = std::map<std::string, double>();
+    auto frame_window_seconds = std::map<std::string, double>();
+    auto write_stats = [&] (FILE* f) {
+        fmt::print(f, "{} threads, {}\n", n_threads, simd_name(simd()));
+        fmt::print(f, "{:>5s} {:10s} {:>12s} {:>12s}\n", "shard", "stage", "ms", "Mentries/s");
+        {
+            auto lock = std::lock_guard(stage_times_mutex);
+            for (const auto& t : stage_times) {
+                fmt::print(f, "{:5d} {:10s} {:12.3f} {:12.2f}\n", t.shard, t.stage, t.seconds * 1e3, t.seconds > 0 ? t.entries / t.seconds / 1e6 : 0.0);
             }
-            auto conv = [] (uint64_t ticks) {
-                return std::chrono::duration<double, std::nano>(ticks * MULTIPLIER);
-            };
-            x.iotime = conv(iotime);
-            x.starvetime = conv(starvetime);
-            x.cputime = conv(cputime);
-            //fmt::print("cputime: {}", cputime);
         }
+        fmt::print(f, "rss {:.1f} MiB, {} queries, table {:.1f} MiB\n", resident_bytes() / 1048576.0, queries.size(), queries.size() * sizeof(query) / 1048576.0);
+        for (size_t s = 0; s < shards.size(); ++s) {
+            const auto& ix = shards[s].index;
+            size_t index_bytes = ix.ids.size_bytes() + ix.offsets.size_bytes() + ix.positions_lo.size_bytes() + ix.positions_hi.size_bytes() + ix.buckets.size_bytes();
+            size_t columns_bytes = shards[s].columns.size() * (sizeof(uint8_t) + 3 * sizeof(int64_t));
+            size_t n_ios = shards[s].ios ? shards[s].ios->size() : 0;
+            fmt::print(f, "shard {}: {} entries, index {:.1f} MiB, columns {:.1f} MiB, {} IOs {:.1f} MiB\n", s, shards[s].n_entries(), index_bytes / 1048576.0, columns_bytes / 1048576.0,
+                n_ios, n_ios * sizeof(io_request) / 1048576.0);
+        }
+        if (!recent_frames.empty()) {
+            auto sorted = std::vector<double>(recent_frames.begin(), recent_frames.end());
+            std::ranges::sort(sorted);
+            fmt::print(f, "last {} frames: mean {:.3f} ms, median {:.3f} ms, p99 {:.3f} ms, max {:.3f} ms\n", sorted.size(),
+                std::accumulate(sorted.begin(), sorted.end(), 0.0) / sorted.size(),
+                sorted[sorted.size() / 2], sorted[sorted.size() * 99 / 100], sorted.back());
+        }
+        if (filter_index_version == table_version) {
+            fmt::print(f, "filter index {:.1f} MiB\n", query_filter_index.bytes() / 1048576.0);
+        }
+        for (const auto& [name, ms] : window_ms) {
+            fmt::print(f, "window {:16s} {:9.3f} ms\n", name, ms);
+        }
+    };
+    auto dump_stats = [&] (const char* path) {
+        FILE* f = fopen(path, "w");
+        if (!f) {
+            throw std::system_error(errno, std::generic_category(), path);
+        }
+        write_stats(f);
+        fclose(f);
+    };
+
+    if (headless) {
+        write_report(stdout, queries, format, top_n);
+        if (stats_path) {
+            dump_stats(stats_path);
+        }
+        return 0;
     }
 
-    std::vector<double> xx;
-    std::vector<double> yy;
-    if (queries.size()) {
-        for (int i = 0; i <= 1000; ++i) {
-            double x = pow(100000.0, i/1000.0);
-            size_t w = queries.size() - size_t(1.0 / x * queries.size());
-            xx.push_back(x);
-            yy.push_back(queries[std::clamp(w, size_t(0), queries.size() - 1)].latency.count());
+    // The extent in its trace of every query of a shard without a full index.
+    auto query_windows = std::vector<std::unordered_map<uint64_t, std::pair<int64_t, int64_t>>>(shards.size());
+    auto update_query_windows = [&] {
+        for (auto& windows : query_windows) {
+            windows.clear();
+        }
+        for (const auto& q : queries) {
+            if (!shards[q.shard].indexed) {
+                query_windows[q.shard].emplace(q.id, std::pair(q.first_ts, q.end_ts));
+            }
+        }
+    };
+    update_query_windows();
+
+    // The start times selected in the "Heatmap" window, if any.
+    auto start_range = std::optional<std::pair<int64_t, int64_t>>();
+
+    // The queries of the shards ticked in the "Shards" window that match the filter and
+    // started in the heatmap selection, in latency order: all of them, unless some shards
+    // are unticked or there is a filter or a selection. That may leave none, which the
+    // windows showing them say rather than show another set.
+    auto shard_shown = std::vector<uint8_t>(shards.size(), 1);
+    auto filtered = std::vector<query>();
+    auto shown = std::span<const query>(queries);
+    // Bumped whenever shown changes.
+    uint64_t shown_version = 0;
+    auto selecting = [&] {
+        return active_filter || start_range || std::ranges::find(shard_shown, 0) != shard_shown.end();
+    };
+    auto in_selection = [&] (const query& q) {
+        return shard_shown[q.shard] && (!start_range || (q.start_ts >= start_range->first && q.start_ts < start_range->second));
+    };
+    auto update_shown = [&] {
+        ++shown_version;
+        shown = queries;
+        auto matches = std::vector<uint64_t>();
+        if (active_filter) {
+            if (filter_index_version != table_version) {
+                query_filter_index = make_filter_index(queries, n_threads);
+                filter_index_version = table_version;
+            }
+            matches = evaluate(*active_filter, query_filter_index);
         }
-        for (size_t i = 0; i < xx.size(); ++i) {
-            //fmt::print("{} {}\n", xx[i], yy[i]);
+        if (selecting()) {
+            filtered.clear();
+            for (size_t i = 0; i < queries.size(); ++i) {
+                if (in_selection(queries[i]) && (!active_filter || (matches[i / 64] >> (i % 64)) & 1)) {
+                    filtered.push_back(queries[i]);
+                }
+            }
+            n_matching = filtered.size();
+            shown = filtered;
         }
+    };
+
+    // While any ticked shard shows a preview, the pooled figures of their samples.
+    struct preview_totals {
+        size_t n_sampled = 0;
+        size_t n_censored = 0;
+        size_t n_swept = 0;
+        size_t n_entries = 0;
+        double estimated_queries = 0;
+    };
+    auto previewing = std::optional<preview_totals>();
+    // The curves are read off histograms of the shown queries, at 1001 points of x, which
+    // is 1 / (1 - p) for the fraction p of queries below the point.
+    auto xx = std::vector<double>();
+    auto curve_ps = std::vector<double>();
+    for (int i = 0; i <= 1000; ++i) {
+        xx.push_back(pow(100000.0, i/1000.0));
+        curve_ps.push_back(1 - 1 / xx.back());
     }
+    auto curve_histograms = time_histograms(hdr_digits);
+    std::vector<double> yy;
+    // The cputime, iotime and starvetime curves, for the "Components" checkbox.
+    auto component_yy = std::array<std::vector<double>, 3>();
+    bool components = false;
+    // The 95% confidence band of the curve while previewing, from the order statistics
+    // around every point's rank: censored queries could be anywhere above their latency
+    // so far, which widens the band by their number below. Where it runs past the largest
+    // complete query, the band is open above: drawn past the top of the plot.
+    std::vector<double> low_yy;
+    std::vector<double> high_yy;
+    // Reads the curves off curve_histograms, which hold the shown queries.
+    auto read_curve = [&] {
+        yy.clear();
+        for (auto& c : component_yy) {
+            c.clear();
+        }
+        low_yy.clear();
+        high_yy.clear();
+        previewing.reset();
+        for (size_t s = 0; s < shards.size(); ++s) {
+            if (shard_shown[s] && shards[s].sample) {
+                const auto& sample = *shards[s].sample;
+                auto& totals = previewing ? *previewing : previewing.emplace();
+                totals.n_sampled += sample.n_found - sample.n_censored;
+                totals.n_censored += sample.n_censored;
+                totals.n_swept += sample.n_swept;
+                totals.n_entries += shards[s].span.size();
+                totals.estimated_queries += sample.estimated_queries(shards[s].span.size());
+            }
+        }
+        if (shown.empty()) {
+            return;
+        }
+        yy = curve_histograms.latency.seconds_at(curve_ps);
+        component_yy = {curve_histograms.cputime.seconds_at(curve_ps), curve_histograms.iotime.seconds_at(curve_ps), curve_histograms.starvetime.seconds_at(curve_ps)};
+        if (previewing) {
+            // The fractions of the shown queries at the ranks bounding the band.
+            auto low_ps = std::vector<double>();
+            auto high_ps = std::vector<double>();
+            auto open = std::vector<uint8_t>();
+            double n = shown.size() + previewing->n_censored;
+            auto fraction = [&] (double r) {return std::floor(std::clamp(r, 0.0, double(shown.size() - 1))) / shown.size();};
+            for (double x : xx) {
+                double rank = n - n / x;
+                double p = rank / n;
+                double d = 1.96 * sqrt(n * p * (1 - p)) + 1;
+                low_ps.push_back(fraction(rank - d - previewing->n_censored));
+                open.push_back(rank + d >= shown.size());
+                high_ps.push_back(fraction(rank + d));
+            }
+            low_yy = curve_histograms.latency.seconds_at(low_ps);
+            high_yy = curve_histograms.latency.seconds_at(high_ps);
+            for (size_t i = 0; i < xx.size(); ++i) {
+                if (open[i]) {
+                    high_yy[i] = 10 * shown.back().latency.count();
+                }
+            }
+        }
+    };
+    auto update_curve = [&] {
+        curve_histograms = make_time_histograms(shown, n_threads, hdr_digits);
+        read_curve();
+    };
+    update_curve();
+
+    // The index "TimeDist" reads the shown queries through, as of dist_index_version; a
+    // stale one is made again when the window next looks.
+    auto dist_index = time_dist_index();
+    uint64_t dist_index_version = -1;
+    // Folds a change that follow mode made to queries into shown, the curve and the
+    // TimeDist index, rather than making them again from the whole table: the shown rows
+    // that went are taken out, the rows added that are selected are merged in, and the same
+    // rows come off and go into the histograms and the index.
+    auto follow_shown = [&] (const table_change& change) {
+        // The filter counts start times from the earliest start when it was indexed, which
+        // added rows only keep if they start no earlier; a preview reads more than the
+        // histograms. Either takes a rebuild.
+        bool earlier = active_filter && std::ranges::any_of(change.added, [&] (const query& q) {
+            return query_filter_index.size == 0 || q.start_ts < query_filter_index.first_start_ts;
+        });
+        if (earlier || previewing) {
+            update_shown();
+            update_curve();
+            return;
+        }
+        auto selected_change = table_change();
+        const auto* shown_change = &change;
+        if (selecting()) {
+            // filtered is still the selection from the table before: its rows that went
+            // are found by latency, then id.
+            auto removed_at = std::vector<size_t>();
+            for (const auto& q : change.removed) {
+                auto same_latency = std::ranges::equal_range(filtered, q.latency, std::ranges::less(), &query::latency);
+                auto it = std::ranges::find_if(same_latency, [&] (const query& x) {return x.id == q.id && x.shard == q.shard;});
+                if (it != same_latency.end()) {
+                    removed_at.push_back(it - filtered.begin());
+                }
+            }
+            std::ranges::sort(removed_at);
+            auto added = std::vector<query>();
+            for (const auto& q : change.added) {
+                if (in_selection(q) && (!active_filter || matches(*active_filter, q, query_filter_index.first_start_ts))) {
+                    added.push_back(q);
+                }
+            }
+            selected_change = change_table(filtered, std::move(removed_at), std::move(added));
+            n_matching = filtered.size();
+            shown = filtered;
+            shown_change = &selected_change;
+        } else {
+            shown = queries;
+        }
+        bool index_current = dist_index_version == shown_version;
+        ++shown_version;
+        if (index_current) {
+            update_time_dist_index(dist_index, shown, *shown_change, n_threads);
+            dist_index_version = shown_version;
+        }
+        for (const auto& q : shown_change->removed) {
+            curve_histograms.remove(q);
+        }
+        for (const auto& q : shown_change->added) {
+            curve_histograms.record(q);
+        }
+        read_curve();
+    };
+    // The curve of every shard on its own, to compare them.
+    auto shard_yy = std::vector<std::vector<double>>(shards.size());
+    auto update_shard_curves = [&] {
+        if (shards.size() <= 1) {
+            return;
+        }
+        auto latencies = std::vector<hdr_histogram>(shards.size(), hdr_histogram(hdr_digits));
+        for (const auto& q : queries) {
+            latencies[q.shard].record(q.latency);
+        }
+        for (size_t s = 0; s < shards.size(); ++s) {
+            shard_yy[s].clear();
+            if (latencies[s].total) {
+                shard_yy[s] = latencies[s].seconds_at(curve_ps);
+            }
+        }
+    };
+    update_shard_curves();
+    bool compare = false;
+    // Bumped whenever the query table or the selection from it changes under the windows,
+    // except for follow mode's growth, which they take piece by piece.
+    uint64_t generation = 0;
+    // Takes over the latest snapshot of the background analysis, if there is a new one.
+    auto adopt = [&] {
+        auto snap = take_pending();
+        if (!snap) {
+            return;
+        }
+        install(*snap);
+        for (size_t s = 0; s < shards.size(); ++s) {
+            spans[s] = shards[s].span;
+        }
+        ++table_version;
+        update_query_windows();
+        update_shown();
+        update_curve();
+        update_shard_curves();
+        ++generation;
+    };
 
 #if 0
     {
@@ -218,7 +589,7 @@ int main(int argc, char** argv) {
     if (window == nullptr)
         return 1;
     glfwMakeContextCurrent(window);
-    glfwSwapInterval(1); // Enable vsync
+    glfwSwapInterval(bench_frames ? 0 : 1); // Enable vsync, unless timing frames
 
     // Setup Dear ImGui context
     IMGUI_CHECKVERSION();
@@ -257,9 +628,71 @@ int main(int argc, char** argv) {
     bool show_demo_window = true;
     ImVec4 clear_color = ImVec4(0.45f, 0.55f, 0.60f, 1.00f);
 
+    // With --frames, the CPU time of building and submitting each frame is recorded, and the
+    // program exits after that many frames with a summary.
+    auto frame_times = std::vector<double>();
+
+    auto last_poll = std::chrono::steady_clock::now();
+
+    auto finish_frame = [&] (std::chrono::steady_clock::time_point frame_start) {
+        // Rendering
+        ImGui::Render();
+        int display_w, display_h;
+        glfwGetFramebufferSize(window, &display_w, &display_h);
+        glViewport(0, 0, display_w, display_h);
+        glClearColor(clear_color.x * clear_color.w, clear_color.y * clear_color.w, clear_color.z * clear_color.w, clear_color.w);
+        glClear(GL_COLOR_BUFFER_BIT);
+        ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
+
+        // Keep the last 1000 frames, and a moving average of every window's cost.
+        recent_frames.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - frame_start).count());
+        if (recent_frames.size() > 1000) {
+            recent_frames.pop_front();
+        }
+        for (auto& [name, seconds] : frame_window_seconds) {
+            auto [it, added] = window_ms.emplace(name, seconds * 1e3);
+            if (!added) {
+                it->second = it->second * 0.95 + seconds * 1e3 * 0.05;
+            }
+            seconds = 0;
+        }
+
+        // Frames drawn while the analysis runs say nothing of the cost of the windows.
+        if (bench_frames && analysis_done) {
+            frame_times.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - frame_start).count());
+            if (frame_times.size() == bench_frames) {
+                std::ranges::sort(frame_times);
+                fmt::print("{} frames: mean {:.3f} ms, median {:.3f} ms, p99 {:.3f} ms, max {:.3f} ms\n", frame_times.size(),
+                    std::accumulate(frame_times.begin(), frame_times.end(), 0.0) / frame_times.size(),
+                    frame_times[frame_times.size() / 2], frame_times[frame_times.size() * 99 / 100], frame_times.back());
+                glfwSetWindowShouldClose(window, 1);
+            }
+        }
+
+        glfwSwapBuffers(window);
+    };
+
     // Main loop
     while (!glfwWindowShouldClose(window))
     {
+        auto frame_start = std::chrono::steady_clock::now();
+        adopt();
+        // In follow mode, fold in whatever was appended to the trace, a few times a second.
+        if (live && frame_start - last_poll > std::chrono::milliseconds(250)) {
+            last_poll = frame_start;
+            size_t old_entries = spans[0].size();
+            auto change = live->update(queries);
+            shards[0].span = spans[0] = live->span();
+            for (const auto& q : change.added) {
+                query_windows[0][q.id] = std::pair(q.first_ts, q.end_ts);
+            }
+            // No generation bump: the windows reading the table take the change piece by
+            // piece, or check their own inputs.
+            if (spans[0].size() != old_entries) {
+                ++table_version;
+                follow_shown(change);
+            }
+        }
         // Poll and handle events (inputs, window resize, etc.)
         // You can read the io.WantCaptureMouse, io.WantCaptureKeyboard flags to tell if dear imgui wants to use your inputs.
         // - When io.WantCaptureMouse is true, do not dispatch mouse input data to your main application, or clear/overwrite your copy of the mouse data.
@@ -396,33 +829,169 @@ int main(int argc, char** argv) {
         }
 #endif
 
+        static bool analysing = !analysis_done;
+        if (analysing) {
+            analysing = !analysis_done;
+            ImGui::Begin("Analysis");
+            for (size_t s = 0; s < shards.size(); ++s) {
+                const char* stage = progresses[s].stage;
+                double done = progresses[s].done;
+                ImGui::ProgressBar(done, ImVec2(-1, 0), fmt::format("{}: {} {:.0f}%", shards[s].path, stage, done * 100).c_str());
+            }
+            ImGui::End();
+        }
+        {
+            auto timer = scoped_timer{frame_window_seconds["Stats"]};
+            ImGui::Begin("Stats");
+            if (ImGui::BeginTable("stages", 4, ImGuiTableFlags_Borders | ImGuiTableFlags_SizingFixedFit)) {
+                for (const char* heading : {"shard", "stage", "ms", "Mentries/s"}) {
+                    ImGui::TableSetupColumn(heading);
+                }
+                ImGui::TableHeadersRow();
+                auto lock = std::lock_guard(stage_times_mutex);
+                for (const auto& t : stage_times) {
+                    ImGui::TableNextRow();
+                    ImGui::TableNextColumn();
+                    ImGui::Text("%u", t.shard);
+                    ImGui::TableNextColumn();
+                    ImGui::TextUnformatted(t.stage);
+                    ImGui::TableNextColumn();
+                    ImGui::Text("%.3f", t.seconds * 1e3);
+                    ImGui::TableNextColumn();
+                    ImGui::Text("%.2f", t.seconds > 0 ? t.entries / t.seconds / 1e6 : 0.0);
+                }
+                ImGui::EndTable();
+            }
+            ImGui::Text("%s", fmt::format("rss {:.1f} MiB, {} queries", resident_bytes() / 1048576.0, queries.size()).c_str());
+            if (!recent_frames.empty() && ImPlot::BeginPlot("Frame times", ImVec2(-1, 150))) {
+                ImPlot::SetupAxes("ms", "frames", ImPlotAxisFlags_AutoFit, ImPlotAxisFlags_AutoFit);
+                auto frames = std::vector<double>(recent_frames.begin(), recent_frames.end());
+                ImPlot::PlotHistogram("Frame time", frames.data(), int(frames.size()), 50);
+                ImPlot::EndPlot();
+            }
+            for (const auto& [name, ms] : window_ms) {
+                ImGui::Text("%s", fmt::format("{:16s} {:9.3f} ms", name, ms).c_str());
+            }
+            static char dump_path[256] = "latency-stats.txt";
+            ImGui::InputText("##dump", dump_path, sizeof(dump_path));
+            ImGui::SameLine();
+            if (ImGui::Button("Dump")) {
+                try {
+                    dump_stats(dump_path);
+                } catch (const std::exception& e) {
+                    fmt::print(stderr, "{}\n", e.what());
+                }
+            }
+            ImGui::End();
+        }
+        // The other windows all need a query to show.
+        if (queries.empty()) {
+            finish_frame(frame_start);
+            continue;
+        }
+
         static size_t chosen_one = -1;
         static bool just_chosen = true;
         static size_t chosen_unfull = -1;
         static bool just_chosen_unfull = true;
         static uint64_t id_log = queries[0].id;
+        static uint32_t shard_log = queries[0].shard;
+        if (shards.size() > 1) {
+            auto timer = scoped_timer{frame_window_seconds["Shards"]};
+            ImGui::Begin("Shards");
+            ImGui::Checkbox("Compare", &compare);
+            bool changed = false;
+            for (size_t s = 0; s < shards.size(); ++s) {
+                bool on = shard_shown[s];
+                if (ImGui::Checkbox(fmt::format("{}: {}", s, shards[s].path).c_str(), &on)) {
+                    shard_shown[s] = on;
+                    changed = true;
+                }
+            }
+            if (changed) {
+                update_shown();
+                update_curve();
+                ++generation;
+            }
+            ImGui::End();
+        }
+        {
+            auto timer = scoped_timer{frame_window_seconds["Filter"]};
+            ImGui::Begin("Filter");
+            static char filter_text[512] = "";
+            static std::string filter_error;
+            bool apply = ImGui::InputText("##filter", filter_text, sizeof(filter_text), ImGuiInputTextFlags_EnterReturnsTrue);
+            ImGui::SameLine();
+            apply |= ImGui::Button("Apply");
+            if (apply) {
+                try {
+                    active_filter = filter_text[0] ? std::optional(parse_filter(filter_text)) : std::nullopt;
+                    filter_error.clear();
+                    update_shown();
+                    update_curve();
+                    ++generation;
+                } catch (const std::exception& e) {
+                    filter_error = e.what();
+                }
+            }
+            if (!filter_error.empty()) {
+                ImGui::TextColored(ImVec4(1.0f, 0.4f, 0.4f, 1.0f), "%s", filter_error.c_str());
+            } else if (active_filter && n_matching == 0) {
+                ImGui::Text("No query matches");
+            } else if (active_filter) {
+                ImGui::Text("%s", fmt::format("{} of {} queries match", n_matching, queries.size()).c_str());
+            }
+            ImGui::TextDisabled("rcs=N, io or start (ms) <, <=, =, >=, > N, permit, es; not, and, or, ()");
+            ImGui::End();
+        }
         {
+            auto graph_timer = scoped_timer{frame_window_seconds["Graph"]};
             ImGui::Begin("Graph");
-            ImPlot::BeginPlot("HdrHistogram", ImVec2(-1,0));
+            if (previewing) {
+                ImGui::Text("%s", fmt::format("Preview: {} of ~{:.0f} queries, {} censored, from {:.1f}% of the entries; refining",
+                    previewing->n_sampled, previewing->estimated_queries, previewing->n_censored, 100.0 * previewing->n_swept / std::max<size_t>(previewing->n_entries, 1)).c_str());
+            }
+            ImGui::Checkbox("Components", &components);
+            // The plots keep their ids, and the whole run's scale, when nothing matches.
+            const char* no_match = shown.empty() ? ": no matching queries" : "";
+            ImPlot::BeginPlot(fmt::format("HdrHistogram{}###HdrHistogram", no_match).c_str(), ImVec2(-1,0));
             ImPlot::SetupAxes(nullptr, nullptr, ImPlotAxisFlags_Lock, ImPlotAxisFlags_Lock);
             ImPlot::SetupAxisScale(ImAxis_X1, ImPlotScale_Log10);
             ImPlot::SetupAxisScale(ImAxis_Y1, ImPlotScale_Log10);
-            ImPlot::SetupAxesLimits(1, 100000, 0.0001, queries.back().latency.count());
+            ImPlot::SetupAxesLimits(1, 100000, 0.0001, (shown.empty() ? queries : shown).back().latency.count());
             if (ImPlot::IsPlotSelected()) {
                 static ImPlotRect limits, select;
                 select = ImPlot::GetPlotSelection();
             }
-            ImPlot::PlotLine("Latency", xx.data(), yy.data(), 1001);
+            if (!low_yy.empty()) {
+                ImPlot::PlotShaded("95%", xx.data(), low_yy.data(), high_yy.data(), int(low_yy.size()));
+            }
+            ImPlot::PlotLine("Latency", xx.data(), yy.data(), int(yy.size()));
+            if (components && !yy.empty()) {
+                const char* names[] = {"cputime", "iotime", "starvetime"};
+                for (size_t c = 0; c < component_yy.size(); ++c) {
+                    ImPlot::PlotLine(names[c], xx.data(), component_yy[c].data(), int(component_yy[c].size()));
+                }
+            }
+            for (size_t s = 0; compare && s < shards.size(); ++s) {
+                if (shard_shown[s] && !shard_yy[s].empty()) {
+                    ImPlot::PlotLine(fmt::format("Shard {}", s).c_str(), xx.data(), shard_yy[s].data(), int(shard_yy[s].size()));
+                }
+            }
             static double line_x;
             static size_t w = 0;
             static uint64_t id_full_log = id_log;
+            static uint32_t shard_full_log = shard_log;
+            w = std::min(w, std::max<size_t>(shown.size(), 1) - 1);
 
-            if (ImPlot::IsPlotHovered() && ImGui::IsMouseDown(0)) {
+            if (ImPlot::IsPlotHovered() && ImGui::IsMouseDown(0) && !shown.empty()) {
                 ImPlotPoint pt = ImPlot::GetPlotMousePos();
                 line_x = std::clamp(pt.x, 1.0, 100000.0);
-                w = std::clamp(queries.size() - size_t(1.0 / line_x * queries.size()), size_t(0), size_t(queries.size() - 1));
-                id_log = queries[w].id;
+                w = std::clamp(shown.size() - size_t(1.0 / line_x * shown.size()), size_t(0), size_t(shown.size() - 1));
+                id_log = shown[w].id;
+                shard_log = shown[w].shard;
                 id_full_log = id_log;
+                shard_full_log = shard_log;
             }
             ImPlotDragToolFlags flags = ImPlotDragToolFlags_NoCursors | ImPlotDragToolFlags_NoFit | ImPlotDragToolFlags_NoInputs;
             ImPlot::DragLineX(0, &line_x, ImVec4(1,1,1,1), 1, flags);
@@ -435,14 +1004,17 @@ int main(int argc, char** argv) {
             ImPlot::EndPlot();
 
             ImGui::End();
+            graph_timer.stop();
 
+            auto time_dist_timer = scoped_timer{frame_window_seconds["TimeDist"]};
             ImGui::Begin("TimeDist");
             {
                 static size_t w1g = -1;
                 static size_t w2g = -1;
-                size_t w1 = std::clamp(queries.size() - size_t(1.0 / rect[0] * queries.size()), size_t(0), size_t(queries.size() - 1));
-                size_t w2 = std::clamp(queries.size() - size_t(1.0 / rect[2] * queries.size()), size_t(0), size_t(queries.size() - 1));
-                using t = std::chrono::duration<double>;
+                static uint64_t shown_version_g = -1;
+                size_t last = std::max<size_t>(shown.size(), 1) - 1;
+                size_t w1 = std::clamp(shown.size() - size_t(1.0 / rect[0] * shown.size()), size_t(0), last);
+                size_t w2 = std::clamp(shown.size() - size_t(1.0 / rect[2] * shown.size()), size_t(0), last);
                 static std::vector<double> plot_x = std::invoke([&] {
                     std::vector<double> v;
                     for (int i = 0; i < 1024; ++i) {
@@ -450,269 +1022,639 @@ int main(int argc, char** argv) {
                     }
                     return v;
                 });
-                static std::vector<double> iotimes_y, cputimes_y, latencies_y, starvetimes_y;
-                static t avgiotime, avgcputime, avgstarvetime, avglatency;
+                static time_dist dist;
+                static std::optional<std::array<double, 4>> half_widths;
 
-                if (w1 != w1g || w2 != w2g) {
+                if (w1 != w1g || w2 != w2g || shown_version != shown_version_g) {
+                    if (dist_index_version != shown_version) {
+                        dist_index = make_time_dist_index(shown, n_threads);
+                        dist_index_version = shown_version;
+                    }
                     w1g = w1;
                     w2g = w2;
-                    avgiotime = avgcputime = avglatency = avgstarvetime = t::zero();
-                    std::vector<t> iotimes, cputimes, latencies, starvetimes;
-                    for (size_t i = w1; i <= w2; ++i) {
-                        avgiotime += queries[i].iotime / (w2 - w1 + 1);
-                        avgcputime += queries[i].cputime / (w2 - w1 + 1);
-                        avgstarvetime += queries[i].starvetime / (w2 - w1 + 1);
-                        avglatency += queries[i].latency / (w2 - w1 + 1);
-
-                        iotimes.push_back(queries[i].iotime);
-                        cputimes.push_back(queries[i].cputime);
-                        starvetimes.push_back(queries[i].starvetime);
-                        latencies.push_back(queries[i].latency);
-                    }
-                    std::ranges::sort(iotimes);
-                    std::ranges::sort(cputimes);
-                    std::ranges::sort(starvetimes);
-                    std::ranges::sort(latencies);
-
-                    auto sample = [&] (std::vector<t>& vec) {
-                        auto res = std::vector<double>();
-                        if (vec.empty()) {
-                            return res;
+                    shown_version_g = shown_version;
+                    // An empty index leaves every average 0 and every distribution empty.
+                    dist = make_time_dist(dist_index, w1, w2, plot_x);
+                    // While previewing, the 95% confidence half-width of every average: the
+                    // sample is small enough to sweep.
+                    half_widths.reset();
+                    if (previewing && !shown.empty()) {
+                        auto& h = half_widths.emplace();
+                        size_t lo = std::min(w1, w2);
+                        size_t n = std::max(w1, w2) - lo + 1;
+                        auto times = [] (const query& q) {return std::array{q.cputime.count(), q.starvetime.count(), q.iotime.count(), q.latency.count()};};
+                        auto sums = std::array<double, 4>();
+                        auto squares = std::array<double, 4>();
+                        for (const auto& q : shown.subspan(lo, n)) {
+                            auto t = times(q);
+                            for (size_t k = 0; k < t.size(); ++k) {
+                                sums[k] += t[k];
+                                squares[k] += t[k] * t[k];
+                            }
                         }
-                        for (const auto& p : plot_x) {
-                            size_t ww = (vec.size() - 1) * p;
-                            res.push_back(std::chrono::duration<double, std::milli>(vec[ww]).count());
+                        for (size_t k = 0; k < h.size(); ++k) {
+                            double mean = sums[k] / n;
+                            double variance = n > 1 ? std::max(0.0, squares[k] / n - mean * mean) * n / (n - 1) : 0;
+                            h[k] = 1.96 * sqrt(variance / n) * 1e3;
                         }
-                        return res;
-                    };
-                    iotimes_y = sample(iotimes);
-                    starvetimes_y = sample(starvetimes);
-                    cputimes_y = sample(cputimes);
-                    latencies_y = sample(latencies);
+                    }
                 }
 
-                ImGui::Text("%s", fmt::format("{:10s} {:12.9f}", "CPU", std::chrono::duration<double, std::milli>(avgcputime).count()).c_str());
-                ImGui::Text("%s", fmt::format("{:10s} {:12.9f}", "STARVE", std::chrono::duration<double, std::milli>(avgstarvetime).count()).c_str());
-                ImGui::Text("%s", fmt::format("{:10s} {:12.9f}", "IO", std::chrono::duration<double, std::milli>(avgiotime).count()).c_str());
-                ImGui::Text("%s", fmt::format("{:10s} {:12.9f}", "TOTAL", std::chrono::duration<double, std::milli>(avglatency).count()).c_str());
+                auto plus_minus = [&] (size_t k) {
+                    return half_widths ? fmt::format(" +- {:.6f}", (*half_widths)[k]) : std::string();
+                };
+                ImGui::Text("%s", fmt::format("{:10s} {:12.9f}{}", "CPU", std::chrono::duration<double, std::milli>(dist.avgcputime).count(), plus_minus(0)).c_str());
+                ImGui::Text("%s", fmt::format("{:10s} {:12.9f}{}", "STARVE", std::chrono::duration<double, std::milli>(dist.avgstarvetime).count(), plus_minus(1)).c_str());
+                ImGui::Text("%s", fmt::format("{:10s} {:12.9f}{}", "IO", std::chrono::duration<double, std::milli>(dist.avgiotime).count(), plus_minus(2)).c_str());
+                ImGui::Text("%s", fmt::format("{:10s} {:12.9f}{}", "TOTAL", std::chrono::duration<double, std::milli>(dist.avglatency).count(), plus_minus(3)).c_str());
 
                 if (ImPlot::BeginSubplots("My Subplot",2,2,ImVec2(-1, -1))) {
-                    if (ImPlot::BeginPlot("iotime cdf", ImVec2(-1,0))) {
+                    if (ImPlot::BeginPlot(fmt::format("iotime cdf{}###iotime cdf", no_match).c_str(), ImVec2(-1,0))) {
                         ImPlot::SetupAxes(NULL,NULL,0,ImPlotAxisFlags_AutoFit|ImPlotAxisFlags_RangeFit);
-                        ImPlot::PlotLine("iotime cdf", plot_x.data(), iotimes_y.data(), iotimes_y.size());
+                        ImPlot::PlotLine("iotime cdf", plot_x.data(), dist.iotimes_y.data(), dist.iotimes_y.size());
                         ImPlot::EndPlot();
                     }
-                    if (ImPlot::BeginPlot("starvetime cdf", ImVec2(-1,0))) {
+                    if (ImPlot::BeginPlot(fmt::format("starvetime cdf{}###starvetime cdf", no_match).c_str(), ImVec2(-1,0))) {
                         ImPlot::SetupAxes(NULL,NULL,0,ImPlotAxisFlags_AutoFit|ImPlotAxisFlags_RangeFit);
-                        ImPlot::PlotLine("starvetime cdf", plot_x.data(), starvetimes_y.data(), starvetimes_y.size());
+                        ImPlot::PlotLine("starvetime cdf", plot_x.data(), dist.starvetimes_y.data(), dist.starvetimes_y.size());
                         ImPlot::EndPlot();
                     }
-                    if (ImPlot::BeginPlot("cputime cdf", ImVec2(-1,0))) {
+                    if (ImPlot::BeginPlot(fmt::format("cputime cdf{}###cputime cdf", no_match).c_str(), ImVec2(-1,0))) {
                         ImPlot::SetupAxes(NULL,NULL,0,ImPlotAxisFlags_AutoFit|ImPlotAxisFlags_RangeFit);
-                        ImPlot::PlotLine("cputime cdf", plot_x.data(), cputimes_y.data(), cputimes_y.size());
+                        ImPlot::PlotLine("cputime cdf", plot_x.data(), dist.cputimes_y.data(), dist.cputimes_y.size());
                         ImPlot::EndPlot();
                     }
-                    if (ImPlot::BeginPlot("latency cdf", ImVec2(-1,0))) {
+                    if (ImPlot::BeginPlot(fmt::format("latency cdf{}###latency cdf", no_match).c_str(), ImVec2(-1,0))) {
                         ImPlot::SetupAxes(NULL,NULL,0,ImPlotAxisFlags_AutoFit|ImPlotAxisFlags_RangeFit);
-                        ImPlot::PlotLine("latency cdf", plot_x.data(), latencies_y.data(), latencies_y.size());
+                        ImPlot::PlotLine("latency cdf", plot_x.data(), dist.latencies_y.data(), dist.latencies_y.size());
                         ImPlot::EndPlot();
                     }
                     ImPlot::EndSubplots();
                 }
             }
             ImGui::End();
+            time_dist_timer.stop();
 
+            // Queries by start time and latency, across the whole trace or any part of it.
+            // Selecting a span of time (right-drag) restricts the other views to the queries
+            // that started in it.
             {
-                ImGui::Begin("Log");
-                ImGui::Text("%s", fmt::format("{:10s} {:12.9f}", "CPU", std::chrono::duration<double, std::milli>(queries[w].cputime).count()).c_str());
-                ImGui::Text("%s", fmt::format("{:10s} {:12.9f}", "STARVE", std::chrono::duration<double, std::milli>(queries[w].starvetime).count()).c_str());
-                ImGui::Text("%s", fmt::format("{:10s} {:12.9f}", "IO", std::chrono::duration<double, std::milli>(queries[w].iotime).count()).c_str());
-                ImGui::Text("%s", fmt::format("{:10s} {:12.9f}", "TOTAL", std::chrono::duration<double, std::milli>(queries[w].latency).count()).c_str());
-                uint64_t start = std::ranges::lower_bound(sorted, id_log, std::ranges::less(), [] (const auto& e) {return e.query();}) - sorted.begin();
-                uint64_t end = std::ranges::upper_bound(sorted, id_log, std::ranges::less(), [] (const auto& e) {return e.query();}) - sorted.begin() - 1;
-                uint64_t start_ts = sorted[start].ts;
-                //uint64_t end_ts = sorted[end].ts;
-                static size_t selected = 0;
-                for (size_t i = start; i <= end; ++i) {
-                    auto dt_nano = std::chrono::duration<double, std::nano>(double(sorted[i].ts - start_ts) * MULTIPLIER);
-                    auto dt = std::chrono::duration<double, std::milli>(dt_nano);
-                    auto message = std::invoke([&] () -> std::string {
-                        const auto e = sorted[i];
-                        switch (e.event) {
-                        case 0: return fmt::format("{:10s}", "SWITCH");
-                        case 1: return "START";
-                        case 0xa: return "PERMIT";
-                        case 0xb: return "ES";
-                        case 0x3: {
-                        const char* rcs_status[] = {
-                        "admitted immediately",
-                        "queued because of non-empty ready",
-                        "queued because of used permits",
-                        "queued because of memory resources",
-                        "queued because of count resources",
-                        };
-                        return fmt::format("{:10s} {}", "RCS", rcs_status[e.arg]);
+                auto timer = scoped_timer{frame_window_seconds["Heatmap"]};
+                ImGui::Begin("Heatmap");
+                static latency_pyramid pyramid;
+                static uint64_t pyramid_version = -1;
+                if (pyramid_version != table_version) {
+                    pyramid = make_latency_pyramid(queries, n_threads);
+                    pyramid_version = table_version;
+                }
+                auto to_s = [&] (int64_t ts) {return double(ts - pyramid.first_ts) * MULTIPLIER / 1e9;};
+                auto to_ts = [&] (double s) {return pyramid.first_ts + int64_t(s * 1e9 / MULTIPLIER);};
+                double trace_s = to_s(pyramid.first_ts + pyramid.bucket_ticks * int64_t(pyramid.n_buckets(0)));
+                double lowest = log10(latency_pyramid::bin_latency(0) * 1e3);
+                double highest = log10(latency_pyramid::bin_latency(latency_pyramid::n_bins) * 1e3);
+                static size_t level = 0;
+                if (ImPlot::BeginPlot("##heatmap", ImVec2(-1, -ImGui::GetFrameHeightWithSpacing()))) {
+                    ImPlot::SetupAxes("start (s)", "log10 latency (ms)", 0, ImPlotAxisFlags_Lock);
+                    ImPlot::SetupAxesLimits(0, trace_s, lowest, highest, ImPlotCond_Once);
+                    ImPlot::SetupAxisLimitsConstraints(ImAxis_X1, 0, trace_s);
+                    ImPlotRect limits = ImPlot::GetPlotLimits();
+                    int n_columns = std::clamp(int(ImPlot::GetPlotSize().x), 1, 4096);
+                    static std::vector<double> cells;
+                    static double max_cell = 1;
+                    static std::tuple<double, double, int, uint64_t> cells_key;
+                    auto key = std::tuple(limits.X.Min, limits.X.Max, n_columns, pyramid_version);
+                    if (key != cells_key) {
+                        cells_key = key;
+                        cells = pyramid.view(to_ts(limits.X.Min), to_ts(limits.X.Max), n_columns, level);
+                        max_cell = 1;
+                        for (auto& c : cells) {
+                            c = log1p(c);
+                            max_cell = std::max(max_cell, c);
                         }
-                        case 0x4: return fmt::format("{:10s} {:16x}", "IO_BEGIN", e.arg);
-                        case 0x5: return fmt::format("{:10s} {:16x}", "IO_END", e.arg);
-                        default: return fmt::format("UNKNOWN ({})", e.event);
+                    }
+                    ImPlot::PushColormap(ImPlotColormap_Viridis);
+                    ImPlot::PlotHeatmap("queries", cells.data(), latency_pyramid::n_bins, n_columns, 0, max_cell, nullptr,
+                        ImPlotPoint(limits.X.Min, lowest), ImPlotPoint(limits.X.Max, highest));
+                    ImPlot::PopColormap();
+                    if (ImPlot::IsPlotSelected()) {
+                        ImPlotRect selection = ImPlot::GetPlotSelection();
+                        auto range = std::pair(to_ts(selection.X.Min), to_ts(selection.X.Max));
+                        if (range != start_range) {
+                            start_range = range;
+                            update_shown();
+                            update_curve();
+                            ++generation;
                         }
-                    });
-                    bool highlighted = (selected >= start && selected <= end) && (sorted[i].event == 0x4 || sorted[i].event == 0x5) && (sorted[i].arg == sorted[selected].arg);
-                    auto s = fmt::format("{:12.9f}: {}", dt.count(), message);
-                    if (i == chosen_unfull) {
-                        if (just_chosen_unfull) {
-                            just_chosen_unfull = false;
-                            ImGui::SetScrollHereY();
+                    }
+                    ImPlot::EndPlot();
+                }
+                ImGui::Text("%s", fmt::format("{:.3f} ms buckets (level {})", (pyramid.bucket_ticks << level) * MULTIPLIER / 1e6, level).c_str());
+                if (start_range) {
+                    ImGui::SameLine();
+                    ImGui::Text("%s", fmt::format("| started {:.3f} s to {:.3f} s", to_s(start_range->first), to_s(start_range->second)).c_str());
+                    ImGui::SameLine();
+                    if (ImGui::Button("Clear")) {
+                        start_range.reset();
+                        ImPlot::CancelPlotSelection();
+                        update_shown();
+                        update_curve();
+                        ++generation;
+                    }
+                }
+                ImGui::End();
+            }
+
+            // The latency of every IO of the indexed shards, on the axes of the query curve,
+            // split by how many other IOs of the same query were in flight: a slow disk shows
+            // at every depth, a query queueing behind its own IOs only at the deeper ones.
+            {
+                auto timer = scoped_timer{frame_window_seconds["IO latency"]};
+                ImGui::Begin("IO latency");
+                struct io_ref {
+                    double latency;
+                    uint32_t shard;
+                    const io_request* io;
+                };
+                static std::vector<io_ref> slowest;
+                static std::vector<std::vector<double>> by_depth;
+                static std::vector<double> io_yy;
+                static size_t n_ios = 0;
+                // The IOs of every shard by latency, sorted once per table; the ticked shards'
+                // are merged from them.
+                static std::vector<std::vector<io_ref>> shard_ios;
+                static uint64_t ios_version = -1;
+                static std::vector<uint8_t> ios_shown;
+                if (table_version != ios_version) {
+                    ios_version = table_version;
+                    ios_shown.clear();
+                    shard_ios.assign(shards.size(), {});
+                    for (uint32_t s = 0; s < shards.size(); ++s) {
+                        if (!shards[s].ios) {
+                            continue;
+                        }
+                        for (const auto& io : *shards[s].ios) {
+                            shard_ios[s].push_back(io_ref{io.latency().count(), s, &io});
+                        }
+                        std::ranges::sort(shard_ios[s], std::ranges::less(), &io_ref::latency);
+                    }
+                }
+                if (shard_shown != ios_shown) {
+                    ios_shown = shard_shown;
+                    auto all = std::vector<io_ref>();
+                    for (uint32_t s = 0; s < shards.size(); ++s) {
+                        if (shard_shown[s]) {
+                            size_t mid = all.size();
+                            all.insert(all.end(), shard_ios[s].begin(), shard_ios[s].end());
+                            std::inplace_merge(all.begin(), all.begin() + mid, all.end(), [] (const io_ref& a, const io_ref& b) {return a.latency < b.latency;});
                         }
-                        ImGui::PushStyleColor(ImGuiCol_Text, ImVec4(1.f, 0.f, 0.0f, 1.f));
                     }
-                    if (ImGui::Selectable(s.c_str(), highlighted)) {
-                        if (highlighted) {
-                            selected = -1;
-                        } else {
-                            selected = i;
+                    n_ios = all.size();
+                    by_depth.clear();
+                    for (const auto& x : all) {
+                        by_depth.resize(std::max<size_t>(by_depth.size(), x.io->depth + 1));
+                        by_depth[x.io->depth].push_back(x.latency);
+                    }
+                    io_yy.clear();
+                    for (size_t i = 0; i < xx.size() && !all.empty(); ++i) {
+                        size_t w = all.size() - size_t(1.0 / xx[i] * all.size());
+                        io_yy.push_back(all[std::clamp(w, size_t(0), all.size() - 1)].latency);
+                    }
+                    slowest.assign(all.end() - std::min<size_t>(all.size(), 100), all.end());
+                    std::ranges::reverse(slowest);
+                }
+                if (n_ios == 0) {
+                    ImGui::Text("No IOs: they are paired only for shards with a full index, and shown for the ticked ones");
+                } else {
+                    if (ImPlot::BeginPlot("IO latency", ImVec2(-1, 0))) {
+                        ImPlot::SetupAxes(nullptr, nullptr, ImPlotAxisFlags_Lock, ImPlotAxisFlags_AutoFit);
+                        ImPlot::SetupAxisScale(ImAxis_X1, ImPlotScale_Log10);
+                        ImPlot::SetupAxisScale(ImAxis_Y1, ImPlotScale_Log10);
+                        ImPlot::SetupAxisLimits(ImAxis_X1, 1, 100000);
+                        ImPlot::PlotLine("IO", xx.data(), io_yy.data(), int(io_yy.size()));
+                        ImPlot::EndPlot();
+                    }
+                    auto ms = [] (double seconds) {return seconds * 1e3;};
+                    if (ImGui::BeginTable("depths", 6, ImGuiTableFlags_Borders | ImGuiTableFlags_SizingFixedFit)) {
+                        for (const char* heading : {"depth", "IOs", "p50 ms", "p90 ms", "p99 ms", "max ms"}) {
+                            ImGui::TableSetupColumn(heading);
+                        }
+                        ImGui::TableHeadersRow();
+                        for (size_t d = 0; d < by_depth.size(); ++d) {
+                            const auto& l = by_depth[d];
+                            if (l.empty()) {
+                                continue;
+                            }
+                            ImGui::TableNextRow();
+                            ImGui::TableNextColumn();
+                            ImGui::Text("%zu", d);
+                            ImGui::TableNextColumn();
+                            ImGui::Text("%zu", l.size());
+                            for (double p : {0.5, 0.9, 0.99}) {
+                                ImGui::TableNextColumn();
+                                ImGui::Text("%.3f", ms(l[quantile_index(l.size(), p)]));
+                            }
+                            ImGui::TableNextColumn();
+                            ImGui::Text("%.3f", ms(l.back()));
                         }
+                        ImGui::EndTable();
                     }
-                    if (i == chosen_unfull) {
-                        ImGui::PopStyleColor();
+                    // Clicking one of the slowest IOs shows its query in the logs.
+                    ImGui::Text("Slowest IOs");
+                    if (ImGui::BeginTable("slowest", 5, ImGuiTableFlags_Borders | ImGuiTableFlags_ScrollY | ImGuiTableFlags_SizingFixedFit, ImVec2(0, 200))) {
+                        for (const char* heading : {"ms", "depth", "shard", "query", "io"}) {
+                            ImGui::TableSetupColumn(heading);
+                        }
+                        ImGui::TableSetupScrollFreeze(0, 1);
+                        ImGui::TableHeadersRow();
+                        for (size_t k = 0; k < slowest.size(); ++k) {
+                            const auto& x = slowest[k];
+                            ImGui::TableNextRow();
+                            ImGui::TableNextColumn();
+                            bool is_shown = x.shard == shard_log && x.io->query == id_log;
+                            if (ImGui::Selectable(fmt::format("{:.3f}##io{}", ms(x.latency), k).c_str(), is_shown, ImGuiSelectableFlags_SpanAllColumns)) {
+                                id_log = id_full_log = x.io->query;
+                                shard_log = shard_full_log = x.shard;
+                            }
+                            ImGui::TableNextColumn();
+                            ImGui::Text("%u", x.io->depth);
+                            ImGui::TableNextColumn();
+                            ImGui::Text("%u", x.shard);
+                            ImGui::TableNextColumn();
+                            ImGui::Text("%s", fmt::format("{:x}", x.io->query).c_str());
+                            ImGui::TableNextColumn();
+                            ImGui::Text("%s", fmt::format("{:x}", x.io->id).c_str());
+                        }
+                        ImGui::EndTable();
                     }
                 }
                 ImGui::End();
             }
-#if 1
+
+            // Who held the reactor while queries were starved: the worst offenders over the
+            // ticked shards, and those of the query in the log. Clicking a query shows it
+            // in the logs.
             {
-                ImGui::Begin("Full log");
-                uint64_t start = std::ranges::lower_bound(sorted, id_full_log, std::ranges::less(), [] (const auto& e) {return e.query();}) - sorted.begin();
-                uint64_t end = std::ranges::upper_bound(sorted, id_full_log, std::ranges::less(), [] (const auto& e) {return e.query();}) - sorted.begin() - 1;
-                uint64_t start_ts = sorted[start].ts;
-                uint64_t end_ts = sorted[end].ts;
-                start = std::ranges::lower_bound(span, start_ts, std::ranges::less(), [] (const auto& e) {return e.ts;}) - span.begin();
-                end = std::ranges::lower_bound(span, end_ts, std::ranges::less(), [] (const auto& e) {return e.ts;}) - span.begin() - 1;
-                static size_t selected = 0;
-                for (size_t i = start; i <= end; ++i) {
-                    auto dt_nano = std::chrono::duration<double, std::nano>(double(span[i].ts - start_ts) * MULTIPLIER);
-                    auto dt = std::chrono::duration<double, std::milli>(dt_nano);
-                    auto message = std::invoke([&] () -> std::string {
-                        const auto e = span[i];
-                        switch (e.event) {
-                        case 0: return fmt::format("{:10s}", "SWITCH");
-                        case 1: return "START";
-                        case 0xa: return "PERMIT";
-                        case 0xb: return "ES";
-                        case 0x3: {
-                        const char* rcs_status[] = {
-                        "admitted immediately",
-                        "queued because of non-empty ready",
-                        "queued because of used permits",
-                        "queued because of memory resources",
-                        "queued because of count resources",
-                        };
-                        return fmt::format("{:10s} {}", "RCS", rcs_status[e.arg]);
+                auto timer = scoped_timer{frame_window_seconds["Blame"]};
+                ImGui::Begin("Blame");
+                struct offender_ref {
+                    uint32_t shard;
+                    const blame_matrix::offender* offender;
+                };
+                static std::vector<offender_ref> worst;
+                static size_t n_cells = 0;
+                static size_t matrix_bytes = 0;
+                static uint64_t blame_generation = -1;
+                if (generation != blame_generation) {
+                    blame_generation = generation;
+                    worst.clear();
+                    n_cells = matrix_bytes = 0;
+                    for (uint32_t s = 0; s < shards.size(); ++s) {
+                        if (!shards[s].blame || !shard_shown[s]) {
+                            continue;
                         }
-                        case 0x4: return fmt::format("{:10s} {:16x}", "IO_BEGIN", e.arg);
-                        case 0x5: return fmt::format("{:10s} {:16x}", "IO_END", e.arg);
-                        default: return fmt::format("UNKNOWN ({})", e.event);
+                        const auto& offenders = shards[s].blame->offenders;
+                        for (size_t k = 0; k < std::min<size_t>(offenders.size(), 100); ++k) {
+                            worst.push_back(offender_ref{s, &offenders[k]});
                         }
-                    });
-                    //bool highlighted = (selected >= start && selected <= end) && (span[i].event == 0x4 || span[i].event == 0x5) && (span[i].arg == span[selected].arg);
-                    bool highlighted = (selected >= start && selected <= end) && (span[i].query() == id_log);
-                    auto s = fmt::format("{:12.9f}: {:16x}: {}", dt.count(), span[i].query(), message);
-                    bool is_active = span[i].query() == id_full_log;
-                    if (is_active) {
-                        ImGui::PushStyleColor(ImGuiCol_Text, ImVec4(0.f, 1.f, 0.24f, 1.f));
+                        n_cells += shards[s].blame->cells.size();
+                        matrix_bytes += shards[s].blame->bytes();
+                    }
+                    std::ranges::sort(worst, std::ranges::greater(), [] (const auto& x) {return x.offender->starved;});
+                    worst.resize(std::min<size_t>(worst.size(), 100));
+                }
+                auto ms = [] (std::chrono::duration<double> d) {return d.count() * 1e3;};
+                // A row per culprit: clicking one that is a query shows it in the logs.
+                auto culprit_row = [&] (size_t k, uint32_t shard, uint64_t culprit, bool task) {
+                    ImGui::TableNextColumn();
+                    auto label = fmt::format("{:x}{}##culprit{}", culprit, task ? " (task)" : "", k);
+                    if (task) {
+                        ImGui::TextDisabled("%s", label.substr(0, label.find("##")).c_str());
+                    } else if (ImGui::Selectable(label.c_str(), shard == shard_log && culprit == id_log, ImGuiSelectableFlags_SpanAllColumns)) {
+                        id_log = id_full_log = culprit;
+                        shard_log = shard_full_log = shard;
                     }
-                    if (i == chosen_one) {
-                        if (just_chosen) {
-                            just_chosen = false;
-                            ImGui::SetScrollHereY();
+                };
+                if (worst.empty()) {
+                    ImGui::Text("No blame: it is computed only for shards with a full index");
+                } else {
+                    ImGui::Text("%s", fmt::format("{} cells, {:.1f} MiB", n_cells, matrix_bytes / 1048576.0).c_str());
+                    ImGui::Text("Worst offenders");
+                    if (ImGui::BeginTable("offenders", 4, ImGuiTableFlags_Borders | ImGuiTableFlags_ScrollY | ImGuiTableFlags_SizingFixedFit, ImVec2(0, 200))) {
+                        for (const char* heading : {"culprit", "shard", "starved ms", "victims"}) {
+                            ImGui::TableSetupColumn(heading);
                         }
-                        ImGui::PushStyleColor(ImGuiCol_Text, ImVec4(1.f, 0.f, 0.0f, 1.f));
+                        ImGui::TableSetupScrollFreeze(0, 1);
+                        ImGui::TableHeadersRow();
+                        for (size_t k = 0; k < worst.size(); ++k) {
+                            const auto& x = worst[k];
+                            ImGui::TableNextRow();
+                            culprit_row(k, x.shard, x.offender->culprit, x.offender->task);
+                            ImGui::TableNextColumn();
+                            ImGui::Text("%u", x.shard);
+                            ImGui::TableNextColumn();
+                            ImGui::Text("%.3f", ms(x.offender->starved));
+                            ImGui::TableNextColumn();
+                            ImGui::Text("%s", fmt::format("{}", x.offender->n_victims).c_str());
+                        }
+                        ImGui::EndTable();
+                    }
+                    auto victim = std::span<const blame_matrix::cell>();
+                    if (shard_log < shards.size() && shards[shard_log].blame) {
+                        victim = shards[shard_log].blame->of(id_log);
                     }
-                    if (ImGui::Selectable(s.c_str(), highlighted)) {
-                        auto x = span[i].query();
-                        if (x) {
-                            id_log = x;
+                    ImGui::Text("%s", fmt::format("Starving {:x}", id_log).c_str());
+                    if (ImGui::BeginTable("victim", 2, ImGuiTableFlags_Borders | ImGuiTableFlags_ScrollY | ImGuiTableFlags_SizingFixedFit, ImVec2(0, 200))) {
+                        for (const char* heading : {"culprit", "starved ms"}) {
+                            ImGui::TableSetupColumn(heading);
                         }
-                        if (highlighted) {
-                            selected = -1;
-                        } else {
-                            selected = i;
+                        ImGui::TableSetupScrollFreeze(0, 1);
+                        ImGui::TableHeadersRow();
+                        for (size_t k = 0; k < std::min<size_t>(victim.size(), 100); ++k) {
+                            ImGui::TableNextRow();
+                            culprit_row(worst.size() + k, shard_log, victim[k].culprit, victim[k].task);
+                            ImGui::TableNextColumn();
+                            ImGui::Text("%.3f", ms(victim[k].starved));
                         }
+                        ImGui::EndTable();
                     }
-                    if (i == chosen_one) {
-                        ImGui::PopStyleColor();
+                }
+                ImGui::End();
+            }
+
+            // Shards without a full index get one covering just the shown queries, over just
+            // the blocks of it decoded if the trace was left encoded.
+            auto indexing_timer = scoped_timer{frame_window_seconds["(log indexes)"]};
+            static query_index log_window;
+            static query_index full_window;
+            static trace_columns full_window_columns;
+            static loaded_trace log_window_entries;
+            static loaded_trace full_window_entries;
+            static std::pair<uint32_t, uint64_t> indexed_log = {-1, -1};
+            static std::pair<uint32_t, uint64_t> indexed_full_log = {-1, -1};
+            static uint64_t indexed_generation = -1;
+            auto extent = [&] (uint32_t s, uint64_t id) -> std::optional<std::pair<int64_t, int64_t>> {
+                if (shards[s].indexed) {
+                    auto [begin, end] = shards[s].index.slots(id);
+                    if (begin == end) {
+                        return std::nullopt;
+                    }
+                    return std::pair(shards[s].index.event(begin).ts, shards[s].index.event(end - 1).ts);
+                }
+                if (auto it = query_windows[s].find(id); it != query_windows[s].end()) {
+                    return it->second;
+                }
+                return std::nullopt;
+            };
+            // In follow mode the queries shown can still be running, and the trace's mapping
+            // can move as it grows; either leaves a window index stale.
+            auto window_inputs = std::tuple(extent(shard_log, id_log), extent(shard_full_log, id_full_log), shards[shard_log].span.data(), shards[shard_full_log].span.data());
+            static decltype(window_inputs) indexed_inputs;
+            if (std::pair(shard_log, id_log) != indexed_log || std::pair(shard_full_log, id_full_log) != indexed_full_log || generation != indexed_generation
+                || window_inputs != indexed_inputs) {
+                indexed_log = std::pair(shard_log, id_log);
+                indexed_full_log = std::pair(shard_full_log, id_full_log);
+                indexed_generation = generation;
+                indexed_inputs = window_inputs;
+                // The window of the full-log query, stretched to the log query's if it is one.
+                auto window_index = [&] (uint32_t s, uint64_t id, trace_columns& columns, loaded_trace& entries) {
+                    auto [lo_ts, hi_ts] = *extent(shard_full_log, id_full_log);
+                    if (auto x = extent(s, id)) {
+                        lo_ts = std::min(lo_ts, x->first);
+                        hi_ts = std::max(hi_ts, x->second);
+                    }
+                    entries = shards[s].encoded ? decode_window(*shards[s].encoded, lo_ts, hi_ts, n_threads) : loaded_trace{shards[s].span};
+                    auto span = entries.span;
+                    size_t lo = std::ranges::lower_bound(span, lo_ts, std::ranges::less(), [] (const auto& e) {return e.ts;}) - span.begin();
+                    size_t hi = std::ranges::upper_bound(span, hi_ts, std::ranges::less(), [] (const auto& e) {return e.ts;}) - span.begin();
+                    auto window = span.subspan(lo, hi - lo);
+                    columns = make_columns(window, n_threads);
+                    return build_index(window, columns, n_threads);
+                };
+                if (!shards[shard_log].indexed) {
+                    auto columns = trace_columns();
+                    log_window = window_index(shard_log, id_log, columns, log_window_entries);
+                }
+                if (!shards[shard_full_log].indexed) {
+                    full_window = window_index(shard_full_log, id_full_log, full_window_columns, full_window_entries);
+                }
+            }
+            const auto& log_index = shards[shard_log].indexed ? shards[shard_log].index : log_window;
+            const auto& full_index = shards[shard_full_log].indexed ? shards[shard_full_log].index : full_window;
+            const auto& full_columns = shards[shard_full_log].indexed ? shards[shard_full_log].columns : full_window_columns;
+
+            // The rows of "Full log": the events of every shard during the full-log query.
+            static std::vector<shard_event> rows;
+            static std::pair<int64_t, int64_t> rows_window = {-1, -1};
+            static uint64_t rows_generation = -1;
+            // The rows' entries of the shards left encoded, which are all spans has of them.
+            static auto rows_entries = std::vector<loaded_trace>(shards.size());
+            {
+                auto [first_slot, end_slot] = full_index.slots(id_full_log);
+                auto window = std::pair(full_index.event(first_slot).ts, full_index.event(end_slot - 1).ts);
+                if (window != rows_window || generation != rows_generation) {
+                    rows_window = window;
+                    rows_generation = generation;
+                    for (size_t s = 0; s < shards.size(); ++s) {
+                        if (shards[s].encoded) {
+                            rows_entries[s] = decode_window(*shards[s].encoded, window.first, window.second, n_threads);
+                            spans[s] = rows_entries[s].span;
+                        }
+                    }
+                    rows = merge_shards(spans, window.first, window.second);
+                }
+            }
+
+            indexing_timer.stop();
+            {
+                auto timer = scoped_timer{frame_window_seconds["Log"]};
+                ImGui::Begin("Log");
+                if (shown.empty()) {
+                    ImGui::Text("No matching queries");
+                } else {
+                    ImGui::Text("%s", fmt::format("{:10s} {:12.9f}", "CPU", std::chrono::duration<double, std::milli>(shown[w].cputime).count()).c_str());
+                    ImGui::Text("%s", fmt::format("{:10s} {:12.9f}", "STARVE", std::chrono::duration<double, std::milli>(shown[w].starvetime).count()).c_str());
+                    ImGui::Text("%s", fmt::format("{:10s} {:12.9f}", "IO", std::chrono::duration<double, std::milli>(shown[w].iotime).count()).c_str());
+                    ImGui::Text("%s", fmt::format("{:10s} {:12.9f}", "TOTAL", std::chrono::duration<double, std::milli>(shown[w].latency).count()).c_str());
+                }
+                auto [start, end_slot] = log_index.slots(id_log);
+                uint64_t end = end_slot - 1;
+                uint64_t start_ts = log_index.event(start).ts;
+                //uint64_t end_ts = log_index.event(end).ts;
+                static size_t selected = 0;
+                // Only the visible rows (and the chosen one, to scroll to it) are formatted.
+                ImGuiListClipper clipper;
+                clipper.Begin(end - start + 1);
+                if (just_chosen_unfull && chosen_unfull >= start && chosen_unfull <= end) {
+                    clipper.IncludeItemByIndex(chosen_unfull - start);
+                }
+                while (clipper.Step()) {
+                    for (size_t i = start + clipper.DisplayStart; i < start + clipper.DisplayEnd; ++i) {
+                        auto dt_nano = std::chrono::duration<double, std::nano>(double(log_index.event(i).ts - start_ts) * MULTIPLIER);
+                        auto dt = std::chrono::duration<double, std::milli>(dt_nano);
+                        bool highlighted = (selected >= start && selected <= end) && (log_index.event(i).event == 0x4 || log_index.event(i).event == 0x5) && (log_index.event(i).arg == log_index.event(selected).arg);
+                        auto s = fmt::format("{:12.9f}: {}", dt.count(), describe(log_index.event(i)));
+                        if (i == chosen_unfull) {
+                            if (just_chosen_unfull) {
+                                just_chosen_unfull = false;
+                                ImGui::SetScrollHereY();
+                            }
+                            ImGui::PushStyleColor(ImGuiCol_Text, ImVec4(1.f, 0.f, 0.0f, 1.f));
+                        }
+                        if (ImGui::Selectable(s.c_str(), highlighted)) {
+                            if (highlighted) {
+                                selected = -1;
+                            } else {
+                                selected = i;
+                            }
+                        }
+                        if (i == chosen_unfull) {
+                            ImGui::PopStyleColor();
+                        }
                     }
-                    if (is_active) {
-                        ImGui::PopStyleColor();
+                }
+                ImGui::End();
+            }
+#if 1
+            {
+                auto timer = scoped_timer{frame_window_seconds["Full log"]};
+                ImGui::Begin("Full log");
+                int64_t start_ts = rows_window.first;
+                static size_t selected = 0;
+                ImGuiListClipper clipper;
+                clipper.Begin(rows.size());
+                if (just_chosen && chosen_one < rows.size()) {
+                    clipper.IncludeItemByIndex(chosen_one);
+                }
+                while (clipper.Step()) {
+                    for (size_t i = clipper.DisplayStart; i < size_t(clipper.DisplayEnd); ++i) {
+                        const auto& row = rows[i];
+                        const auto& e = spans[row.shard][row.position];
+                        auto dt_nano = std::chrono::duration<double, std::nano>(double(e.ts - start_ts) * MULTIPLIER);
+                        auto dt = std::chrono::duration<double, std::milli>(dt_nano);
+                        bool highlighted = selected < rows.size() && row.shard == shard_log && e.query() == id_log;
+                        auto s = shards.size() > 1
+                            ? fmt::format("{:12.9f}: {:3d}: {:16x}: {}", dt.count(), row.shard, e.query(), describe(e))
+                            : fmt::format("{:12.9f}: {:16x}: {}", dt.count(), e.query(), describe(e));
+                        bool is_active = row.shard == shard_full_log && e.query() == id_full_log;
+                        if (is_active) {
+                            ImGui::PushStyleColor(ImGuiCol_Text, ImVec4(0.f, 1.f, 0.24f, 1.f));
+                        }
+                        if (i == chosen_one) {
+                            if (just_chosen) {
+                                just_chosen = false;
+                                ImGui::SetScrollHereY();
+                            }
+                            ImGui::PushStyleColor(ImGuiCol_Text, ImVec4(1.f, 0.f, 0.0f, 1.f));
+                        }
+                        if (ImGui::Selectable(s.c_str(), highlighted)) {
+                            auto x = e.query();
+                            if (x) {
+                                id_log = x;
+                                shard_log = row.shard;
+                            }
+                            if (highlighted) {
+                                selected = -1;
+                            } else {
+                                selected = i;
+                            }
+                        }
+                        if (i == chosen_one) {
+                            ImGui::PopStyleColor();
+                        }
+                        if (is_active) {
+                            ImGui::PopStyleColor();
+                        }
                     }
                 }
                 ImGui::End();
             }
 #endif
             {
+                auto timer = scoped_timer{frame_window_seconds["Full log plot"]};
                 ImGui::Begin("Full log plot");
                 if (ImPlot::BeginPlot("Full log plot", ImVec2(-1, 100), ImPlotFlags_NoTitle)) {
                     static uint64_t prev_id;
                     auto flag = prev_id == id_full_log ? ImPlotCond_Once : ImPlotCond_Always;
                     prev_id = id_full_log;
 
-                    auto sorted_range = std::ranges::equal_range(sorted, id_full_log, std::ranges::less(), [] (const auto& e) {return e.query();});
-                    auto span_range = std::ranges::equal_range(span, 1, std::ranges::less(), [&sorted_range] (const auto& e) {return (e.ts >= sorted_range.front().ts) + (e.ts > sorted_range.back().ts);});
-
-                    uint64_t start_ts = sorted_range.front().ts;
-                    uint64_t end_ts = sorted_range.back().ts;
+                    // Timelines only go stale when the table does, or the trace grows under it.
+                    static timeline_cache timelines;
+                    static uint64_t timelines_version = -1;
+                    if (table_version != timelines_version) {
+                        timelines.clear();
+                        timelines_version = table_version;
+                    }
+                    auto tl_cached = timelines.get(shard_full_log, id_full_log, [&] {
+                        auto [first_slot, end_slot] = full_index.slots(id_full_log);
+                        return build_timeline(full_columns, id_full_log, full_index.event(first_slot).ts, full_index.event(end_slot - 1).ts);
+                    });
+                    const auto& tl = *tl_cached;
+                    uint64_t start_ts = tl.start_ts;
+                    uint64_t end_ts = tl.end_ts;
                     ImPlot::SetupAxes(nullptr, nullptr, ImPlotAxisFlags_NoGridLines, ImPlotAxisFlags_Lock | ImPlotAxisFlags_NoDecorations);
                     ImPlot::SetupAxisLimitsConstraints(ImAxis_X1, 0, double(end_ts - start_ts)*MULTIPLIER/1e6);
                     ImPlot::SetupAxesLimits(0, double(end_ts - start_ts)*MULTIPLIER/1e6, 0, 1, flag);
                     ImPlot::PushPlotClipRect();
 
-                    uint64_t prev_ts = start_ts;
-                    bool cpu = true;
-                    uint64_t iostack = 0;
-                    uint64_t iostart = 0;
-                    for (const auto& x : span_range) {
-                            ImVec2 rmin = ImPlot::PlotToPixels(ImPlotPoint(double(prev_ts - start_ts)*MULTIPLIER/1e6, 1.f));
-                            ImVec2 rmax = ImPlot::PlotToPixels(ImPlotPoint(double(x.ts - start_ts)*MULTIPLIER/1e6, 0.f));
-                            ImVec2 rmin_low = ImPlot::PlotToPixels(ImPlotPoint(double(prev_ts - start_ts)*MULTIPLIER/1e6, 0.f));
-                        if (cpu) {
-                            ImPlot::GetPlotDrawList()->AddLine(rmin, rmin_low, IM_COL32(0,128,0,255));
-                            ImPlot::GetPlotDrawList()->AddRectFilled(rmin, rmax, IM_COL32(0,128,0,255));
-                        } else {
-                            ImPlot::GetPlotDrawList()->AddRectFilled(rmin, rmax, IM_COL32(0,0,128,32));
+                    auto to_x = [&] (int64_t ts) {return double(ts - int64_t(start_ts))*MULTIPLIER/1e6;};
+                    auto to_ts = [&] (double x) {return int64_t(start_ts) + int64_t(x * 1e6 / MULTIPLIER);};
+                    auto* draw_list = ImPlot::GetPlotDrawList();
+                    ImPlotRect limits = ImPlot::GetPlotLimits();
+                    int columns = std::max(1, int(ImPlot::GetPlotSize().x));
+                    int64_t view_begin = std::max(to_ts(limits.X.Min), int64_t(start_ts));
+                    int64_t view_end = std::min(to_ts(limits.X.Max) + 1, int64_t(end_ts));
+                    auto cpu_shown = tl.cpu.overlapping(view_begin, view_end);
+                    auto io_shown = tl.io.overlapping(view_begin, view_end);
+                    draw_list->AddRectFilled(ImPlot::PlotToPixels(ImPlotPoint(to_x(view_begin), 1.f)), ImPlot::PlotToPixels(ImPlotPoint(to_x(view_end), 0.f)), IM_COL32(0,0,128,32));
+                    if (cpu_shown.size() + io_shown.size() <= size_t(columns)) {
+                        // Zoomed in far enough to draw every interval.
+                        for (const auto& x : cpu_shown) {
+                            ImVec2 rmin = ImPlot::PlotToPixels(ImPlotPoint(to_x(x.begin), 1.f));
+                            ImVec2 rmax = ImPlot::PlotToPixels(ImPlotPoint(to_x(x.end), 0.f));
+                            ImVec2 rmin_low = ImPlot::PlotToPixels(ImPlotPoint(to_x(x.begin), 0.f));
+                            draw_list->AddLine(rmin, rmin_low, IM_COL32(0,128,0,255));
+                            draw_list->AddRectFilled(rmin, rmax, IM_COL32(0,128,0,255));
+                        }
+                        for (const auto& x : io_shown) {
+                            ImVec2 rmin = ImPlot::PlotToPixels(ImPlotPoint(to_x(x.begin), 1.f));
+                            ImVec2 rmax = ImPlot::PlotToPixels(ImPlotPoint(to_x(x.end), 0.f));
+                            draw_list->AddRectFilled(rmin, rmax, IM_COL32(255,255,255,32));
                         }
-                        if (x.query() == id_full_log) {
-                            if (x.event != 0x5) {
-                                cpu = true;
+                    } else {
+                        // One column per pixel, shaded by the share of it spent on CPU and in IO.
+                        for (int c = 0; c < columns; ++c) {
+                            double x0 = limits.X.Min + (limits.X.Max - limits.X.Min) * c / columns;
+                            double x1 = limits.X.Min + (limits.X.Max - limits.X.Min) * (c + 1) / columns;
+                            int64_t t0 = std::max(to_ts(x0), int64_t(start_ts));
+                            int64_t t1 = std::min(to_ts(x1), int64_t(end_ts));
+                            if (t1 <= t0) {
+                                continue;
                             }
-                            if (x.event == 0x4) {
-                                if (iostack == 0) {
-                                    iostart = x.ts;
-                                }
-                                iostack += 1;
-                            } else if (x.event == 0x5) {
-                                iostack -= 1;
-                                if (iostack == 0) {
-                                    ImVec2 rmin = ImPlot::PlotToPixels(ImPlotPoint(double(iostart - start_ts)*MULTIPLIER/1e6, 1.f));
-                                    ImVec2 rmax = ImPlot::PlotToPixels(ImPlotPoint(double(x.ts - start_ts)*MULTIPLIER/1e6, 0.f));
-                                    ImPlot::GetPlotDrawList()->AddRectFilled(rmin, rmax, IM_COL32(255,255,255,32));
-                                }
+                            double cpu_share = double(tl.cpu.covered(t1) - tl.cpu.covered(t0)) / (t1 - t0);
+                            double io_share = double(tl.io.covered(t1) - tl.io.covered(t0)) / (t1 - t0);
+                            ImVec2 rmin = ImPlot::PlotToPixels(ImPlotPoint(x0, 1.f));
+                            ImVec2 rmax = ImPlot::PlotToPixels(ImPlotPoint(x1, 0.f));
+                            if (cpu_share > 0) {
+                                draw_list->AddRectFilled(rmin, rmax, IM_COL32(0,128,0,std::max(48, int(255 * cpu_share))));
+                            }
+                            if (io_share > 0) {
+                                draw_list->AddRectFilled(rmin, rmax, IM_COL32(255,255,255,std::max(8, int(32 * io_share))));
                             }
-                        } else {
-                            cpu = false;
                         }
-                        prev_ts = x.ts;
                     }
                     ImPlot::PopPlotClipRect();
 
                     if (ImPlot::IsPlotHovered() && ImGui::IsMouseDown(0)) {
                         ImPlotPoint pt = ImPlot::GetPlotMousePos();
                         uint64_t ts = start_ts + pt.x * 1e6 / MULTIPLIER;
-                        chosen_one = std::ranges::lower_bound(span, ts, std::ranges::less(), [] (const auto& e) {return e.ts;}) - span.begin() - 1;
-                        chosen_one = std::clamp(chosen_one, size_t(0), span.size() - 1);
+                        auto row_ts = [&] (const shard_event& row) {return uint64_t(spans[row.shard][row.position].ts);};
+                        chosen_one = std::ranges::lower_bound(rows, ts, std::ranges::less(), row_ts) - rows.begin() - 1;
+                        chosen_one = std::clamp(chosen_one, size_t(0), rows.size() - 1);
                         just_chosen = true;
-                        chosen_unfull = std::ranges::lower_bound(sorted, std::make_pair<uint64_t, uint64_t>(uint64_t(id_log), uint64_t(ts)), std::ranges::less(), [] (const auto& e) {return std::make_pair<uint64_t, uint64_t>(e.query(), e.ts);}) - sorted.begin() - 1;
-                        chosen_unfull = std::clamp(chosen_unfull, size_t(0), sorted.size() - 1);
+                        auto [log_begin, log_end] = log_index.slots(id_log);
+                        auto log_slots = std::views::iota(log_begin, log_end);
+                        chosen_unfull = log_begin + (std::ranges::lower_bound(log_slots, ts, std::ranges::less(), [&] (uint64_t slot) {return uint64_t(log_index.event(slot).ts);}) - log_slots.begin()) - 1;
+                        chosen_unfull = std::clamp(chosen_unfull, size_t(0), log_index.size() - 1);
                         just_chosen_unfull = true;
                     }
                     ImPlot::EndPlot();
@@ -722,16 +1664,7 @@ int main(int argc, char** argv) {
 
         }
 
-        // Rendering
-        ImGui::Render();
-        int display_w, display_h;
-        glfwGetFramebufferSize(window, &display_w, &display_h);
-        glViewport(0, 0, display_w, display_h);
-        glClearColor(clear_color.x * clear_color.w, clear_color.y * clear_color.w, clear_color.z * clear_color.w, clear_color.w);
-        glClear(GL_COLOR_BUFFER_BIT);
-        ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
-
-        glfwSwapBuffers(window);
+        finish_frame(frame_start);
     }
 
     // Cleanup
@@ -743,5 +1676,15 @@ int main(int argc, char** argv) {
     glfwDestroyWindow(window);
     glfwTerminate();
 
+    if (stats_path) {
+        dump_stats(stats_path);
+    }
+    // An analysis still running is of no use any more: leave without waiting for it.
+    if (!analysis_done) {
+        std::quick_exit(0);
+    }
+    if (analysis.joinable()) {
+        analysis.join();
+    }
     return 0;
 }
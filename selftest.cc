@@ -0,0 +1,350 @@
+#include "trace.hh"
+#include "columnar.hh"
+#include "filter.hh"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string_view>
+#include <functional>
+#include <optional>
+#include <cerrno>
+#include <stdexcept>
+#include <system_error>
+
+// Checks the vector kernels, the columnar encoding and the HdrHistogram against plain
+// versions of them on a trace, and exits non-zero on any mismatch. The kernels and the
+// columnar decoder are those TRACE_SIMD picks, so `make check` runs it at every level.
+int main(int argc, char** argv) {
+    const char* path = nullptr;
+    unsigned n_threads = std::max(1u, std::thread::hardware_concurrency());
+    for (int i = 1; i < argc; ++i) {
+        auto arg = std::string_view(argv[i]);
+        if ((arg == "-j" || arg == "--threads") && i + 1 < argc) {
+            n_threads = std::max(1, std::atoi(argv[++i]));
+        } else {
+            path = argv[i];
+        }
+    }
+    if (!path) {
+        throw std::runtime_error("USAGE: ./selftest [-j THREADS] FILE");
+    }
+    int fd = open(path, O_RDONLY);
+    struct stat sb;
+    if (fd < 0 || fstat(fd, &sb)) {
+        throw std::system_error(errno, std::generic_category(), path);
+    }
+    auto trace = load_trace(fd, sb.st_size, n_threads);
+    auto span = trace.span;
+    fmt::print("{}: {} entries, {} threads, {}\n", path, span.size(), n_threads, simd_name(simd()));
+
+    size_t n_failed = 0;
+    auto fail = [&] (std::string what) {
+        fmt::print("FAILED: {}\n", what);
+        ++n_failed;
+    };
+
+    // Entries the trace may lack: every event that takes its query from arg, codes too wide
+    // for a byte, and ids, args and timestamps of all 64 bits.
+    auto odd = std::vector<entry>(67);
+    for (uint64_t i = 0; i < odd.size(); ++i) {
+        uint64_t events[] = {0, 1, 2, 3, 0xa, 0xb, 0xc, 0xff, 0x100, ~uint64_t(0)};
+        odd[i] = entry{events[i % std::size(events)], mix(i), mix(~i), int64_t(mix(i ^ 0x5555))};
+    }
+
+    // split, through make_columns: all of the trace, and short runs at every alignment, for
+    // the partial vectors.
+    auto check_split = [&] (std::span<const entry> in, std::string_view what) {
+        auto c = make_columns(in, n_threads);
+        for (size_t i = 0; i < in.size(); ++i) {
+            const auto& e = in[i];
+            if (c.event[i] != std::min<uint64_t>(e.event, 0xff) || c.ts[i] != e.ts || c.query[i] != e.query() || c.arg[i] != e.arg) {
+                fail(fmt::format("split of {} entries of {}: entry {} {} is {:x} {:x} {:x} {:x}", in.size(), what, i, e, c.event[i], c.ts[i], c.query[i], c.arg[i]));
+                return;
+            }
+        }
+    };
+    check_split(span, "the trace");
+    for (size_t offset = 0; offset < 8; ++offset) {
+        for (size_t n = 0; offset + n <= odd.size() && n <= 40; ++n) {
+            check_split(std::span<const entry>(odd).subspan(offset, n), "odd entries");
+        }
+    }
+
+    // count_below, through lower_bound, which hands runs of at most 64 timestamps straight
+    // to it: runs of every length, from many alignments, with keys around every timestamp
+    // of them.
+    auto columns = make_columns(span, n_threads);
+    auto check_count_below = [&] (const trace_columns& c, std::string_view what) {
+        for (size_t lo = 0, step = std::max<size_t>(1, c.ts.size() / 509); lo < c.ts.size(); lo += step) {
+            for (size_t n = 0; n <= 64 && lo + n <= c.ts.size(); ++n) {
+                auto run = c;
+                run.ts = c.ts.subspan(lo, n);
+                auto keys = std::vector<int64_t>{std::numeric_limits<int64_t>::min(), std::numeric_limits<int64_t>::max()};
+                for (int64_t t : run.ts) {
+                    keys.insert(keys.end(), {t - 1, t, t + 1});
+                }
+                for (int64_t key : keys) {
+                    size_t expected = std::ranges::count_if(run.ts, [&] (int64_t t) {return t < key;});
+                    if (run.lower_bound(key) != expected) {
+                        fail(fmt::format("count_below of {} timestamps of {} from {}, below {}: {}, not {}", n, what, lo, key, run.lower_bound(key), expected));
+                        return;
+                    }
+                }
+            }
+        }
+    };
+    check_count_below(columns, "the trace");
+    check_count_below(make_columns(odd, 1), "odd entries");
+    // And the search around it, on the whole (sorted) trace.
+    if (std::ranges::is_sorted(columns.ts)) {
+        for (size_t i = 0, step = std::max<size_t>(1, span.size() / 4099); i < span.size(); i += step) {
+            for (int64_t key : {columns.ts[i] - 1, columns.ts[i], columns.ts[i] + 1}) {
+                size_t lower = std::ranges::lower_bound(columns.ts, key) - columns.ts.begin();
+                size_t upper = std::ranges::upper_bound(columns.ts, key) - columns.ts.begin();
+                if (columns.lower_bound(key) != lower || columns.upper_bound(key) != upper) {
+                    fail(fmt::format("bounds of {}: [{}, {}), not [{}, {})", key, columns.lower_bound(key), columns.upper_bound(key), lower, upper));
+                    break;
+                }
+            }
+        }
+    }
+
+    // find_event, the third kernel: positions in strides over the trace, and the first of
+    // each event code among them, or none.
+    for (size_t lo = 0, step = std::max<size_t>(1, span.size() / 257); lo < span.size(); lo += step) {
+        auto positions = std::vector<uint32_t>();
+        for (size_t p = lo; p < span.size() && p < size_t(std::numeric_limits<uint32_t>::max()) && positions.size() < 70; p += 3) {
+            positions.push_back(p);
+        }
+        for (size_t n = 0; n <= positions.size(); ++n) {
+            auto some = std::span<const uint32_t>(positions).first(n);
+            for (int code = 0; code <= 0xff; code += code < 0x10 ? 1 : 0x11) {
+                size_t expected = std::ranges::find_if(some, [&] (uint32_t p) {return columns.event[p] == code;}) - some.begin();
+                if (columns.find_event(some, code) != expected) {
+                    fail(fmt::format("find_event of {:x} in {} positions from {}: {}, not {}", code, n, lo, columns.find_event(some, code), expected));
+                    lo = span.size();
+                    break;
+                }
+            }
+        }
+    }
+
+    // Columnar round trips: the trace encoded into a temporary file, and decoded block by
+    // block and as load_trace does. Returns how many exception deltas the blocks had.
+    auto check_columnar = [&] (std::span<const entry> in, std::string_view what) -> uint64_t {
+        FILE* f = tmpfile();
+        if (!f) {
+            throw std::system_error(errno, std::generic_category(), "tmpfile");
+        }
+        write_columnar(in, f, n_threads);
+        struct stat out_sb;
+        if (fflush(f) || fstat(fileno(f), &out_sb)) {
+            throw std::system_error(errno, std::generic_category(), "columnar round trip");
+        }
+        // 8-byte aligned, as a mapping would be.
+        auto file = std::vector<uint64_t>((out_sb.st_size + 7) / 8);
+        if (pread(fileno(f), file.data(), out_sb.st_size, 0) != out_sb.st_size) {
+            throw std::system_error(errno, std::generic_category(), "columnar round trip");
+        }
+        auto loaded = load_trace(fileno(f), out_sb.st_size, n_threads);
+        fclose(f);
+        auto bytes = std::span<const char>(reinterpret_cast<const char*>(file.data()), out_sb.st_size);
+        if (!is_columnar(bytes)) {
+            fail(fmt::format("{} entries of {}: not columnar once written", in.size(), what));
+            return 0;
+        }
+        auto columnar = open_columnar(bytes);
+        uint64_t n_exceptions = 0;
+        auto block = std::vector<entry>(columnar.header->block_size);
+        for (size_t b = 0; b < columnar.blocks.size(); ++b) {
+            n_exceptions += reinterpret_cast<const block_header*>(columnar.base + columnar.blocks[b].offset)->n_exceptions;
+            size_t first = b * columnar.header->block_size;
+            size_t n = columnar.decode(b, block.data());
+            if (n != std::min<size_t>(columnar.header->block_size, in.size() - first)) {
+                fail(fmt::format("{} entries of {}: block {} has {} entries", in.size(), what, b, n));
+                return n_exceptions;
+            }
+            for (size_t i = 0; i < n; ++i) {
+                if (memcmp(&block[i], &in[first + i], sizeof(entry))) {
+                    fail(fmt::format("{} entries of {}: entry {} decodes as {}, not {}", in.size(), what, first + i, block[i], in[first + i]));
+                    return n_exceptions;
+                }
+            }
+        }
+        if (columnar.size() != in.size() || loaded.span.size() != in.size() || memcmp(loaded.span.data(), in.data(), in.size_bytes())) {
+            fail(fmt::format("{} entries of {}: load_trace decodes {} entries, differently", in.size(), what, loaded.span.size()));
+        }
+        return n_exceptions;
+    };
+    // Whole blocks and tail blocks of every kind: one entry, one short of a block, one over.
+    size_t block_size = columnar_block_size;
+    check_columnar(span, "the trace");
+    for (size_t n : {size_t(1), size_t(2), block_size - 1, block_size, block_size + 1, 2 * block_size + 7}) {
+        if (n <= span.size()) {
+            check_columnar(span.first(n), "the trace");
+        }
+    }
+    // Those of the odd entries the format takes, whose codes fit a byte.
+    auto narrow = odd;
+    for (auto& e : narrow) {
+        e.event &= 0xff;
+    }
+    check_columnar(narrow, "odd entries");
+    // Jumps too wide for the deltas around them, few enough to be exceptions, in every
+    // block, the first delta of one and the last delta of the tail one among them.
+    auto jumpy = std::vector<entry>(span.begin(), span.begin() + std::min(span.size(), 3 * block_size + 1000));
+    if (!jumpy.empty()) {
+        for (size_t i = 1; i < jumpy.size(); i += 257) {
+            jumpy[i].ts += int64_t(1) << 40;
+        }
+        if (jumpy.size() > block_size + 1) {
+            jumpy[block_size + 1].ts -= int64_t(1) << 36;
+        }
+        jumpy.back().ts += int64_t(1) << 40;
+        if (check_columnar(jumpy, "the trace with jumps") == 0) {
+            fail("the trace with jumps: no exception deltas to check");
+        }
+    }
+
+    // HdrHistogram: histograms of uneven parts of the values, serialized back to back,
+    // deserialized and merged, against one of all of them, at every precision. The gaps
+    // between entries include 0 and values above highest.
+    auto queries = segment_queries(build_index(span, columns, n_threads), columns);
+    auto same = [] (const hdr_histogram& a, const hdr_histogram& b) {
+        return a.significant_digits == b.significant_digits && a.highest == b.highest && a.half_bits == b.half_bits
+            && a.counts == b.counts && a.total == b.total && a.min == b.min && a.max == b.max;
+    };
+    auto check_merge = [&] (std::string_view what, int digits, size_t n, std::function<void(hdr_histogram&, size_t)> record) {
+        auto all = hdr_histogram(digits);
+        for (size_t i = 0; i < n; ++i) {
+            record(all, i);
+        }
+        // The parts grow quadratically, and the last is empty.
+        size_t n_parts = 7;
+        auto serialized = std::string();
+        for (size_t p = 0; p <= n_parts; ++p) {
+            auto part = hdr_histogram(digits);
+            for (size_t i = n * p * p / (n_parts * n_parts); i < n * std::min(n_parts, p + 1) * std::min(n_parts, p + 1) / (n_parts * n_parts); ++i) {
+                record(part, i);
+            }
+            serialized += part.serialize();
+        }
+        auto in = std::string_view(serialized);
+        auto merged = hdr_histogram(digits);
+        for (size_t p = 0; p <= n_parts; ++p) {
+            merged.merge(hdr_histogram::deserialize(in));
+        }
+        auto whole = all.serialize();
+        auto whole_in = std::string_view(whole);
+        if (!in.empty() || !same(merged, all) || !same(hdr_histogram::deserialize(whole_in), all) || !whole_in.empty()) {
+            fail(fmt::format("hdr_histogram of {} {} at {} digits: {} values merged, of {}", n, what, digits, merged.total, all.total));
+        }
+    };
+    for (int digits = 1; digits <= 5; ++digits) {
+        check_merge("latencies", digits, queries.size(), [&] (hdr_histogram& h, size_t i) {h.record(queries[i].latency);});
+        check_merge("CPU times", digits, queries.size(), [&] (hdr_histogram& h, size_t i) {h.record(queries[i].cputime);});
+        check_merge("IO times", digits, queries.size(), [&] (hdr_histogram& h, size_t i) {h.record(queries[i].iotime);});
+        check_merge("starved times", digits, queries.size(), [&] (hdr_histogram& h, size_t i) {h.record(queries[i].starvetime);});
+        check_merge("entry gaps", digits, span.size(), [&] (hdr_histogram& h, size_t i) {
+            h.record(i == 0 ? uint64_t(span[i].ts) : uint64_t(span[i].ts - span[i - 1].ts) << (i % 64 == 0 ? 32 : 0));
+        });
+        auto all = time_histograms(digits);
+        for (const auto& q : queries) {
+            all.record(q);
+        }
+        auto parallel = make_time_histograms(queries, n_threads, digits);
+        if (!same(parallel.latency, all.latency) || !same(parallel.cputime, all.cputime) || !same(parallel.iotime, all.iotime) || !same(parallel.starvetime, all.starvetime)) {
+            fail(fmt::format("make_time_histograms at {} digits", digits));
+        }
+    }
+
+    // Follow mode: the trace appended to a temporary file in growing parts, and after each,
+    // what the change live_trace reports makes of the TimeDist index, the histograms and a
+    // filtered table, against ones made afresh from the whole table.
+    {
+        FILE* f = tmpfile();
+        if (!f) {
+            throw std::system_error(errno, std::generic_category(), "tmpfile");
+        }
+        auto live = live_trace(fileno(f));
+        auto followed = std::vector<query>();
+        auto dist_index = make_time_dist_index(followed, n_threads);
+        auto histograms = time_histograms();
+        auto filter_text = "rcs=1 or io>3 and not es";
+        auto followed_filter = parse_filter(filter_text);
+        auto selection = std::vector<query>();
+        // Start times count from the first part's earliest, as the viewer's index would.
+        auto first_start_ts = std::optional<int64_t>();
+        auto same_metric = [] (const time_dist_index::metric& a, const time_dist_index::metric& b) {
+            return a.sorted == b.sorted && a.positions == b.positions && a.prefix == b.prefix;
+        };
+        size_t n_parts = 7;
+        for (size_t p = 1; p <= n_parts; ++p) {
+            size_t from = span.size() * (p - 1) * (p - 1) / (n_parts * n_parts);
+            size_t to = span.size() * p * p / (n_parts * n_parts);
+            if (fwrite(span.data() + from, sizeof(entry), to - from, f) != to - from || fflush(f)) {
+                throw std::system_error(errno, std::generic_category(), "follow");
+            }
+            auto change = live.update(followed);
+            update_time_dist_index(dist_index, followed, change, n_threads);
+            for (const auto& q : change.removed) {
+                histograms.remove(q);
+            }
+            for (const auto& q : change.added) {
+                histograms.record(q);
+            }
+            auto fresh = make_time_dist_index(followed, n_threads);
+            if (!same_metric(dist_index.cputime, fresh.cputime) || !same_metric(dist_index.iotime, fresh.iotime) || !same_metric(dist_index.starvetime, fresh.starvetime)
+                || dist_index.latency != fresh.latency || dist_index.latency_prefix != fresh.latency_prefix) {
+                fail(fmt::format("update_time_dist_index after {} of {} entries", to, span.size()));
+            }
+            auto all = make_time_histograms(followed, n_threads);
+            if (histograms.latency.counts != all.latency.counts || histograms.cputime.counts != all.cputime.counts || histograms.iotime.counts != all.iotime.counts
+                || histograms.starvetime.counts != all.starvetime.counts || histograms.latency.total != all.latency.total) {
+                fail(fmt::format("time_histograms::remove after {} of {} entries", to, span.size()));
+            }
+            // The selection takes the change as the viewer's does: rows found by latency
+            // and id, and the added ones that match.
+            if (!first_start_ts && !followed.empty()) {
+                first_start_ts = make_filter_index(followed, n_threads).first_start_ts;
+            }
+            auto removed_at = std::vector<size_t>();
+            for (const auto& q : change.removed) {
+                auto same_latency = std::ranges::equal_range(selection, q.latency, std::ranges::less(), &query::latency);
+                auto it = std::ranges::find(same_latency, q.id, &query::id);
+                if (it != same_latency.end()) {
+                    removed_at.push_back(it - selection.begin());
+                }
+            }
+            std::ranges::sort(removed_at);
+            auto added = std::vector<query>();
+            for (const auto& q : change.added) {
+                if (matches(followed_filter, q, first_start_ts.value_or(0))) {
+                    added.push_back(q);
+                }
+            }
+            change_table(selection, std::move(removed_at), std::move(added));
+            auto index = make_filter_index(followed, n_threads);
+            auto words = evaluate(followed_filter, index);
+            auto expected = std::vector<query>();
+            for (size_t i = 0; i < followed.size(); ++i) {
+                if ((words[i / 64] >> (i % 64)) & 1) {
+                    expected.push_back(followed[i]);
+                }
+            }
+            if (index.first_start_ts == first_start_ts && !std::ranges::equal(selection, expected, {}, &query::id, &query::id)) {
+                fail(fmt::format("\"{}\" on the followed table after {} of {} entries: {} queries, not {}", filter_text, to, span.size(), selection.size(), expected.size()));
+            }
+        }
+        fclose(f);
+    }
+
+    if (n_failed) {
+        fmt::print("{} checks FAILED\n", n_failed);
+        return 1;
+    }
+    fmt::print("all checks passed\n");
+}
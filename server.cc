@@ -0,0 +1,321 @@
+#include "engine.hh"
+#include "filter.hh"
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <charconv>
+#include <string_view>
+#include <cerrno>
+#include <stdexcept>
+#include <system_error>
+#include <fmt/ranges.h>
+
+// Keeps a run analysed in memory and answers queries about it over a Unix domain socket,
+// so that scripts and dashboards pay for loading and indexing once. Every request is one
+// line and gets one line of JSON back, or {"error": "..."}:
+//
+//     info                          the traces and the size of the table
+//     table OFFSET COUNT [FILTER]   rows of the latency-sorted table, of those matching FILTER
+//     events SHARD ID               the events of query ID (in hex) of a shard
+//     percentiles P...              the query at every fraction P of the table
+//     breakdown P1 P2               the average times of the queries between two fractions,
+//                                   and their distribution
+//     histogram METRIC              the serialized histogram (hdr_histogram::serialize(), in
+//                                   hex) of latency, cputime, iotime or starvetime, to merge
+//                                   with those of other servers
+//
+// for example: echo "percentiles 0.5 0.99" | socat - UNIX-CONNECT:/tmp/trace.sock
+//
+// A client that sends a line longer than max_line_bytes gets an error and is hung up on,
+// and one that connects while --max-clients others are is turned away the same way.
+
+namespace {
+
+constexpr size_t max_line_bytes = 64 << 10;
+
+struct server_state {
+    analysed_run run;
+    filter_index filters;
+    time_dist_index dist;
+    time_histograms histograms;
+};
+
+// s as a JSON string.
+std::string quoted(std::string_view s) {
+    auto out = std::string("\"");
+    for (char c : s) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        } else if (static_cast<unsigned char>(c) < 0x20) {
+            out += fmt::format("\\u{:04x}", int(c));
+        } else {
+            out += c;
+        }
+    }
+    return out + "\"";
+}
+
+std::string row(const query& q) {
+    using ms = std::chrono::duration<double, std::milli>;
+    return fmt::format("{{\"shard\": {}, \"id\": \"{:016x}\", \"latency_ms\": {:.9f}, \"cpu_ms\": {:.9f}, \"io_ms\": {:.9f}, \"starve_ms\": {:.9f}, \"n_io\": {}}}",
+        q.shard, q.id, ms(q.latency).count(), ms(q.cputime).count(), ms(q.iotime).count(), ms(q.starvetime).count(), q.traits.n_io);
+}
+
+// The next space-separated word of line, removed from it.
+std::string_view next_word(std::string_view& line) {
+    size_t begin = line.find_first_not_of(' ');
+    if (begin == line.npos) {
+        line = {};
+        return {};
+    }
+    size_t end = std::min(line.find(' ', begin), line.size());
+    auto word = line.substr(begin, end - begin);
+    line.remove_prefix(end);
+    return word;
+}
+
+template <typename T>
+T number(std::string_view word, int base = 10) {
+    T value{};
+    auto [end, ec] = std::from_chars(word.data(), word.data() + word.size(), value, base);
+    if (ec != std::errc() || end != word.data() + word.size()) {
+        throw std::runtime_error(fmt::format("expected a number, not \"{}\"", word));
+    }
+    return value;
+}
+
+template <>
+double number<double>(std::string_view word, int) {
+    double value{};
+    auto [end, ec] = std::from_chars(word.data(), word.data() + word.size(), value);
+    if (ec != std::errc() || end != word.data() + word.size() || value < 0 || value > 1) {
+        throw std::runtime_error(fmt::format("expected a fraction, not \"{}\"", word));
+    }
+    return value;
+}
+
+std::string answer(const server_state& state, std::string_view line) {
+    const auto& queries = state.run.queries;
+    auto command = next_word(line);
+    if (command == "info") {
+        auto shards = std::vector<std::string>();
+        for (size_t s = 0; s < state.run.files.size(); ++s) {
+            shards.push_back(fmt::format("{{\"path\": {}, \"entries\": {}}}", quoted(state.run.files[s].path), state.run.shards[s].n_entries()));
+        }
+        return fmt::format("{{\"api\": {}, \"queries\": {}, \"shards\": [{}]}}", engine_api_version, queries.size(), fmt::join(shards, ", "));
+    }
+    if (command == "table") {
+        size_t offset = number<size_t>(next_word(line));
+        size_t count = number<size_t>(next_word(line));
+        auto rows = std::vector<std::string>();
+        size_t n_matching = queries.size();
+        if (line.find_first_not_of(' ') == line.npos) {
+            offset = std::min(offset, queries.size());
+            count = std::min(count, queries.size() - offset);
+            for (size_t i = offset; i < offset + count; ++i) {
+                rows.push_back(row(queries[i]));
+            }
+        } else {
+            auto words = evaluate(parse_filter(line), state.filters);
+            n_matching = 0;
+            for (size_t w = 0; w < words.size(); ++w) {
+                for (uint64_t bits = words[w]; bits; bits &= bits - 1) {
+                    if (n_matching >= offset && n_matching - offset < count) {
+                        rows.push_back(row(queries[w * 64 + std::countr_zero(bits)]));
+                    }
+                    ++n_matching;
+                }
+            }
+        }
+        return fmt::format("{{\"matching\": {}, \"rows\": [{}]}}", n_matching, fmt::join(rows, ", "));
+    }
+    if (command == "events") {
+        size_t s = number<size_t>(next_word(line));
+        uint64_t id = number<uint64_t>(next_word(line), 16);
+        if (s >= state.run.shards.size()) {
+            throw std::runtime_error(fmt::format("no shard {}", s));
+        }
+        auto events = std::vector<std::string>();
+        for (const auto& e : query_events(state.run.shards[s], id)) {
+            events.push_back(fmt::format("{{\"ts\": {}, \"event\": {}, \"text\": {}}}", e.ts, e.event, quoted(describe(e))));
+        }
+        return fmt::format("{{\"events\": [{}]}}", fmt::join(events, ", "));
+    }
+    if (command == "percentiles") {
+        auto rows = std::vector<std::string>();
+        for (auto word = next_word(line); !word.empty(); word = next_word(line)) {
+            double p = number<double>(word);
+            if (!queries.empty()) {
+                rows.push_back(fmt::format("{{\"p\": {}, \"query\": {}}}", p, row(queries[quantile_index(queries.size(), p)])));
+            }
+        }
+        return fmt::format("{{\"percentiles\": [{}]}}", fmt::join(rows, ", "));
+    }
+    if (command == "breakdown") {
+        double p1 = number<double>(next_word(line));
+        double p2 = number<double>(next_word(line));
+        if (queries.empty() || p2 < p1) {
+            throw std::runtime_error("nothing between those fractions");
+        }
+        const double plot_x[] = {0, 0.5, 0.9, 0.99, 1};
+        auto d = make_time_dist(state.dist, quantile_index(queries.size(), p1), quantile_index(queries.size(), p2), plot_x);
+        using ms = std::chrono::duration<double, std::milli>;
+        return fmt::format("{{\"avg_latency_ms\": {:.9f}, \"avg_cpu_ms\": {:.9f}, \"avg_io_ms\": {:.9f}, \"avg_starve_ms\": {:.9f}, "
+            "\"at\": [{}], \"latency_ms\": [{}], \"cpu_ms\": [{}], \"io_ms\": [{}], \"starve_ms\": [{}]}}",
+            ms(d.avglatency).count(), ms(d.avgcputime).count(), ms(d.avgiotime).count(), ms(d.avgstarvetime).count(),
+            fmt::join(plot_x, ", "), fmt::join(d.latencies_y, ", "), fmt::join(d.cputimes_y, ", "), fmt::join(d.iotimes_y, ", "), fmt::join(d.starvetimes_y, ", "));
+    }
+    if (command == "histogram") {
+        auto metric = next_word(line);
+        const hdr_histogram* h = metric == "latency" ? &state.histograms.latency : metric == "cputime" ? &state.histograms.cputime
+            : metric == "iotime" ? &state.histograms.iotime : metric == "starvetime" ? &state.histograms.starvetime : nullptr;
+        if (!h) {
+            throw std::runtime_error(fmt::format("no metric \"{}\"", metric));
+        }
+        auto hex = std::string();
+        for (char c : h->serialize()) {
+            hex += fmt::format("{:02x}", uint8_t(c));
+        }
+        return fmt::format("{{\"significant_digits\": {}, \"total\": {}, \"histogram\": \"{}\"}}", h->significant_digits, h->total, hex);
+    }
+    throw std::runtime_error(fmt::format("unknown request \"{}\"", command));
+}
+
+// Sends the whole of reply; false if the client is gone.
+bool send_all(int fd, std::string_view reply) {
+    for (size_t sent = 0; sent < reply.size(); ) {
+        ssize_t k = send(fd, reply.data() + sent, reply.size() - sent, MSG_NOSIGNAL);
+        if (k <= 0) {
+            return false;
+        }
+        sent += k;
+    }
+    return true;
+}
+
+std::string error_reply(std::string_view what) {
+    return fmt::format("{{\"error\": {}}}\n", quoted(what));
+}
+
+// Closes the connection after a last reply. What the client sent since is read (for a
+// second at most) first, as closing with it unread would reset the connection and could
+// lose the reply.
+void hang_up(int fd) {
+    shutdown(fd, SHUT_WR);
+    auto timeout = timeval{1, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    char buf[4096];
+    for (size_t drained = 0; drained < max_line_bytes; ) {
+        ssize_t n = recv(fd, buf, sizeof(buf), 0);
+        if (n <= 0) {
+            break;
+        }
+        drained += n;
+    }
+    close(fd);
+}
+
+// Answers the requests of one client until it hangs up, or sends a line too long to be a
+// request.
+void serve(const server_state& state, int fd) {
+    auto pending = std::string();
+    char buf[4096];
+    for (ssize_t n; (n = recv(fd, buf, sizeof(buf), 0)) > 0; ) {
+        pending.append(buf, n);
+        size_t end;
+        for (; (end = pending.find('\n')) != pending.npos; pending.erase(0, end + 1)) {
+            auto line = std::string_view(pending).substr(0, end);
+            if (line.ends_with('\r')) {
+                line.remove_suffix(1);
+            }
+            auto reply = std::string();
+            try {
+                reply = answer(state, line) + '\n';
+            } catch (const std::exception& e) {
+                reply = error_reply(e.what());
+            }
+            if (!send_all(fd, reply)) {
+                close(fd);
+                return;
+            }
+        }
+        if (pending.size() > max_line_bytes) {
+            send_all(fd, error_reply("line too long"));
+            hang_up(fd);
+            return;
+        }
+    }
+    close(fd);
+}
+
+}
+
+int main(int argc, char** argv) {
+    auto paths = std::vector<std::string>();
+    const char* socket_path = nullptr;
+    unsigned max_clients = 64;
+    auto options = analysis_options();
+    options.n_threads = std::max(1u, std::thread::hardware_concurrency());
+    options.details = false;
+    for (int i = 1; i < argc; ++i) {
+        auto arg = std::string_view(argv[i]);
+        if ((arg == "-j" || arg == "--threads") && i + 1 < argc) {
+            options.n_threads = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--no-cache") {
+            options.use_cache = false;
+        } else if (arg == "--max-clients" && i + 1 < argc) {
+            max_clients = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--socket" && i + 1 < argc) {
+            socket_path = argv[++i];
+        } else {
+            paths.push_back(argv[i]);
+        }
+    }
+    if (paths.empty() || !socket_path) {
+        throw std::runtime_error("USAGE: ./server [-j THREADS] [--no-cache] [--max-clients N] --socket PATH FILE|DIR...");
+    }
+    auto addr = sockaddr_un{AF_UNIX};
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        throw std::runtime_error(fmt::format("{}: socket path too long", socket_path));
+    }
+    strcpy(addr.sun_path, socket_path);
+
+    auto state = server_state();
+    state.run = analyse_run(paths, options);
+    state.filters = make_filter_index(state.run.queries, options.n_threads);
+    state.dist = make_time_dist_index(state.run.queries, options.n_threads);
+    state.histograms = make_time_histograms(state.run.queries, options.n_threads);
+
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(socket_path);
+    if (listener < 0 || bind(listener, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) || listen(listener, 16)) {
+        throw std::system_error(errno, std::generic_category(), socket_path);
+    }
+    fmt::print(stderr, "{} queries, serving on {}\n", state.run.queries.size(), socket_path);
+    auto n_clients = std::atomic<unsigned>(0);
+    while (true) {
+        int fd = accept(listener, nullptr, nullptr);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            throw std::system_error(errno, std::generic_category(), "accept");
+        }
+        if (n_clients >= max_clients) {
+            // Not hang_up(): the accept loop mustn't wait on anyone. A client turned away
+            // just after connecting has rarely sent anything yet.
+            send_all(fd, error_reply("too many clients"));
+            close(fd);
+            continue;
+        }
+        ++n_clients;
+        std::thread([&state, &n_clients, fd] {
+            serve(state, fd);
+            --n_clients;
+        }).detach();
+    }
+}
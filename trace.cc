@@ -0,0 +1,1867 @@
+#include "trace.hh"
+#include "columnar.hh"
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <ranges>
+#include <array>
+#include <bit>
+#include <unordered_map>
+#include <unordered_set>
+#include <string_view>
+#include <cerrno>
+#include <atomic>
+#include <stdexcept>
+#include <system_error>
+#include <limits>
+#include <cmath>
+#include <numeric>
+
+std::string describe(const entry& e) {
+    switch (e.event) {
+    case 0: return fmt::format("{:10s}", "SWITCH");
+    case 1: return "START";
+    case 0xa: return "PERMIT";
+    case 0xb: return "ES";
+    case 0x3: {
+    const char* rcs_status[] = {
+    "admitted immediately",
+    "queued because of non-empty ready",
+    "queued because of used permits",
+    "queued because of memory resources",
+    "queued because of count resources",
+    };
+    return fmt::format("{:10s} {}", "RCS", rcs_status[e.arg]);
+    }
+    case 0x4: return fmt::format("{:10s} {:16x}", "IO_BEGIN", e.arg);
+    case 0x5: return fmt::format("{:10s} {:16x}", "IO_END", e.arg);
+    default: return fmt::format("UNKNOWN ({})", e.event);
+    }
+}
+
+// Lays out the id lookup table of query_index: a power of two at least twice the number
+// of ids, linear probing.
+std::vector<uint32_t> make_buckets(std::span<const uint64_t> ids) {
+    size_t n_buckets = 2;
+    while (n_buckets < ids.size() * 2) {
+        n_buckets *= 2;
+    }
+    auto buckets = std::vector<uint32_t>(n_buckets);
+    for (size_t o = 0; o < ids.size(); ++o) {
+        size_t b = mix(ids[o]) & (n_buckets - 1);
+        while (buckets[b]) {
+            b = (b + 1) & (n_buckets - 1);
+        }
+        buckets[b] = o + 1;
+    }
+    return buckets;
+}
+
+query_index build_index(std::span<const entry> span, const trace_columns& columns, unsigned n_threads, progress* done) {
+    struct item {
+        uint64_t key;
+        uint64_t pos;
+    };
+    constexpr int digit_bits = 8;
+    constexpr size_t n_digits = size_t(1) << digit_bits;
+    n_threads = std::max(1u, n_threads);
+    auto items = std::vector<item>(span.size());
+    auto ors = std::vector<uint64_t>(n_threads, 0);
+    auto ands = std::vector<uint64_t>(n_threads, -1);
+    parallel_for(span.size(), n_threads, [&] (size_t begin, size_t end, unsigned t) {
+        for (size_t i = begin; i < end; ++i) {
+            items[i] = item{columns.query[i], i};
+            ors[t] |= items[i].key;
+            ands[t] &= items[i].key;
+        }
+    });
+    uint64_t all_or = 0;
+    uint64_t all_and = -1;
+    for (unsigned t = 0; t < n_threads; ++t) {
+        all_or |= ors[t];
+        all_and &= ands[t];
+    }
+    uint64_t varying = all_or ^ all_and;
+
+    // Progress counts the radix passes, and the layout of the index as one more.
+    int n_passes = 0;
+    for (int shift = 0; shift < 64; shift += digit_bits) {
+        n_passes += ((varying >> shift) & (n_digits - 1)) != 0;
+    }
+    int passes_done = 0;
+    {
+        auto scratch = std::vector<item>(varying ? span.size() : 0);
+        auto counts = std::vector<uint64_t>(n_threads * n_digits);
+        for (int shift = 0; shift < 64; shift += digit_bits) {
+            if (((varying >> shift) & (n_digits - 1)) == 0) {
+                continue;
+            }
+            std::ranges::fill(counts, 0);
+            parallel_for(items.size(), n_threads, [&] (size_t begin, size_t end, unsigned t) {
+                for (size_t i = begin; i < end; ++i) {
+                    counts[t * n_digits + ((items[i].key >> shift) & (n_digits - 1))] += 1;
+                }
+            });
+            uint64_t offset = 0;
+            for (size_t d = 0; d < n_digits; ++d) {
+                for (unsigned t = 0; t < n_threads; ++t) {
+                    offset += std::exchange(counts[t * n_digits + d], offset);
+                }
+            }
+            parallel_for(items.size(), n_threads, [&] (size_t begin, size_t end, unsigned t) {
+                for (size_t i = begin; i < end; ++i) {
+                    scratch[counts[t * n_digits + ((items[i].key >> shift) & (n_digits - 1))]++] = items[i];
+                }
+            });
+            std::swap(items, scratch);
+            if (done) {
+                *done = double(++passes_done) / (n_passes + 1);
+            }
+        }
+    }
+
+    // Stability only gives (query, ts) order if the trace itself is ordered by ts.
+    bool ts_ordered = std::ranges::is_sorted(columns.ts);
+    struct arrays {
+        std::vector<uint64_t> ids;
+        std::vector<uint64_t> offsets;
+        std::vector<uint32_t> positions_lo;
+        std::vector<uint8_t> positions_hi;
+        std::vector<uint32_t> buckets;
+    };
+    auto storage = std::make_shared<arrays>();
+    for (size_t i = 0; i < items.size(); ) {
+        size_t j = i + 1;
+        while (j < items.size() && items[j].key == items[i].key) {
+            ++j;
+        }
+        if (!ts_ordered) {
+            std::ranges::sort(items.begin() + i, items.begin() + j, std::ranges::less(), [&columns] (const auto& x) {return std::make_pair(columns.ts[x.pos], x.pos);});
+        }
+        storage->ids.push_back(items[i].key);
+        storage->offsets.push_back(i);
+        i = j;
+    }
+    storage->offsets.push_back(items.size());
+    storage->positions_lo.resize(items.size());
+    if (span.size() > std::numeric_limits<uint32_t>::max()) {
+        storage->positions_hi.resize(items.size());
+    }
+    parallel_for(items.size(), n_threads, [&] (size_t begin, size_t end, unsigned) {
+        for (size_t i = begin; i < end; ++i) {
+            storage->positions_lo[i] = uint32_t(items[i].pos);
+            if (!storage->positions_hi.empty()) {
+                storage->positions_hi[i] = uint8_t(items[i].pos >> 32);
+            }
+        }
+    });
+    storage->buckets = make_buckets(storage->ids);
+    if (done) {
+        *done = 1;
+    }
+    return query_index{span, storage->ids, storage->offsets, storage->positions_lo, storage->positions_hi, storage->buckets, storage};
+}
+
+// An open-addressing hash table from 64-bit keys, for the passes that look up every
+// event: a power of two of buckets at most half full, linear probing, and erasure by
+// shifting the rest of the run back, so that tables of what is in flight stay small.
+template <typename Value>
+struct flat_table {
+    struct bucket {
+        uint64_t key;
+        Value value;
+        bool used;
+    };
+    std::vector<bucket> buckets = std::vector<bucket>(16);
+    size_t n_used = 0;
+
+    Value* find(uint64_t key) {
+        size_t mask = buckets.size() - 1;
+        for (size_t b = mix(key) & mask; buckets[b].used; b = (b + 1) & mask) {
+            if (buckets[b].key == key) {
+                return &buckets[b].value;
+            }
+        }
+        return nullptr;
+    }
+    // The value of key, default-constructed if new.
+    Value& operator[](uint64_t key) {
+        if (auto* v = find(key)) {
+            return *v;
+        }
+        if ((n_used + 1) * 2 > buckets.size()) {
+            auto old = std::exchange(buckets, std::vector<bucket>(buckets.size() * 2));
+            for (auto& o : old) {
+                if (o.used) {
+                    place(o.key) = std::move(o.value);
+                }
+            }
+        }
+        n_used += 1;
+        return place(key);
+    }
+    void erase(uint64_t key) {
+        size_t mask = buckets.size() - 1;
+        size_t hole = mix(key) & mask;
+        while (buckets[hole].used && buckets[hole].key != key) {
+            hole = (hole + 1) & mask;
+        }
+        if (!buckets[hole].used) {
+            return;
+        }
+        // Move back every later entry of the run that may live in the hole.
+        for (size_t b = (hole + 1) & mask; buckets[b].used; b = (b + 1) & mask) {
+            size_t home = mix(buckets[b].key) & mask;
+            if (((b - home) & mask) >= ((b - hole) & mask)) {
+                buckets[hole] = std::move(buckets[b]);
+                hole = b;
+            }
+        }
+        buckets[hole].used = false;
+        n_used -= 1;
+    }
+    template <typename Func>
+    void for_each(Func func) const {
+        for (const auto& b : buckets) {
+            if (b.used) {
+                func(b.key, b.value);
+            }
+        }
+    }
+
+private:
+    Value& place(uint64_t key) {
+        size_t b = mix(key) & (buckets.size() - 1);
+        while (buckets[b].used) {
+            b = (b + 1) & (buckets.size() - 1);
+        }
+        buckets[b] = bucket{key, Value(), true};
+        return buckets[b].value;
+    }
+};
+
+// What a query is doing between two events of the trace, the state machine behind both
+// attribute and build_timeline: it is on CPU from any of its own events but IO_END until
+// the next foreign one, and in IO while it has any in flight.
+struct activity {
+    uint64_t iostack = 0;
+    bool cpu = true;
+
+    void own(uint8_t event) {
+        if (event != 0x5) {
+            cpu = true;
+        }
+        if (event == 0x4) {
+            iostack += 1;
+        } else if (event == 0x5) {
+            iostack -= 1;
+        }
+    }
+    void preempt() {
+        cpu = false;
+    }
+};
+
+void attribute(const trace_columns& columns, const query_index& index, std::vector<query>& queries, unsigned n_threads, progress* done, blame_matrix* blame) {
+    constexpr size_t none = -1;
+    auto slot_of = std::vector<size_t>(index.ids.size(), none);
+    auto n_events = std::vector<uint64_t>(queries.size());
+    for (size_t q = 0; q < queries.size(); ++q) {
+        auto [begin, end] = index.slots(queries[q].id);
+        n_events[q] = end - begin;
+        slot_of[index.ordinal(queries[q].id)] = q;
+    }
+    // The owner of every entry, scattered from the index, so that the passes below read it
+    // in order instead of looking up every event's id. Pass 1 replaces it with the owner's
+    // slot among the queries its segment touches.
+    auto owners = std::vector<uint32_t>(columns.size());
+    parallel_for(index.ids.size(), n_threads, [&] (size_t begin, size_t end, unsigned) {
+        for (size_t o = begin; o < end; ++o) {
+            for (uint64_t slot = index.offsets[o]; slot < index.offsets[o + 1]; ++slot) {
+                owners[index.position(slot)] = uint32_t(slot_of[o]);
+            }
+        }
+    });
+    auto owner_of = [&] (size_t i) -> size_t {
+        return owners[i] == uint32_t(none) ? none : owners[i];
+    };
+
+    n_threads = std::max(1u, n_threads);
+    size_t n_segments = n_threads == 1 ? 1 : std::clamp<size_t>(columns.size() / 65536, 1, n_threads * 8);
+    auto segment_begin = [&] (size_t s) {
+        return columns.size() * s / n_segments;
+    };
+    // Progress counts the entries swept by both passes, 2^16 at a time.
+    constexpr size_t progress_step = 0x10000;
+    auto swept = std::atomic<uint64_t>(0);
+    auto advance = [&] (uint64_t n) {
+        if (done) {
+            *done = double(swept += n) / (2 * std::max<size_t>(columns.size(), 1));
+        }
+    };
+    auto before_owner = std::vector<size_t>(n_segments, none);
+    for (size_t s = 1; s < n_segments; ++s) {
+        before_owner[s] = owner_of(segment_begin(s) - 1);
+    }
+
+    // Pass 1: which queries each segment touches, their net IO depth change and event
+    // count, and whether the owner of the segment's last event leaves it on CPU. For blame,
+    // also the last event each was preempted by, or resumed after: the culprit of its next
+    // starvation, if it has no other by then.
+    struct touch {
+        size_t q;
+        uint64_t iodelta = 0;
+        uint64_t n_events = 0;
+        uint64_t culprit = none;
+    };
+    enum class tail_cpu { off, on, inherit };
+    struct segment {
+        std::vector<touch> touched;
+        size_t tail_owner = none;
+        tail_cpu tail = tail_cpu::off;
+        // The slots in touched of the tail owner and of the previous segment's.
+        size_t tail_slot = none;
+        size_t before_slot = none;
+    };
+    auto segments = std::vector<segment>(n_segments);
+    parallel_tasks(n_segments, n_threads, [&] (size_t s) {
+        auto& seg = segments[s];
+        size_t a = segment_begin(s);
+        size_t b = segment_begin(s + 1);
+        seg.tail_owner = a < b ? owner_of(b - 1) : none;
+        auto slot = std::vector<uint32_t>(queries.size(), uint32_t(none));
+        size_t prev_q = before_owner[s];
+        for (size_t i = a; i < b; ++i) {
+            if ((i - a) % progress_step == progress_step - 1) {
+                advance(progress_step);
+            }
+            size_t q = owner_of(i);
+            bool switched = q != prev_q;
+            if (blame && switched && prev_q != none && slot[prev_q] != uint32_t(none)) {
+                seg.touched[slot[prev_q]].culprit = i;
+            }
+            prev_q = q;
+            if (q == none) {
+                continue;
+            }
+            if (slot[q] == uint32_t(none)) {
+                slot[q] = seg.touched.size();
+                seg.touched.push_back(touch{q});
+            }
+            owners[i] = slot[q];
+            auto& t = seg.touched[slot[q]];
+            t.n_events += 1;
+            if (blame && switched && i > 0) {
+                t.culprit = i - 1;
+            }
+            if (columns.event[i] == 0x4) {
+                t.iodelta += 1;
+            } else if (columns.event[i] == 0x5) {
+                t.iodelta -= 1;
+            }
+        }
+        advance((b - a) % progress_step);
+        if (before_owner[s] != none && slot[before_owner[s]] != uint32_t(none)) {
+            seg.before_slot = slot[before_owner[s]];
+        }
+        if (seg.tail_owner == none) {
+            return;
+        }
+        seg.tail_slot = slot[seg.tail_owner];
+        // Distinct queries have distinct owners, so the owner's last events are those of its
+        // query.
+        seg.tail = tail_cpu::inherit;
+        for (size_t i = b; i-- > a; ) {
+            if (columns.query[i] != columns.query[b - 1]) {
+                seg.tail = tail_cpu::off;
+                break;
+            } else if (columns.event[i] != 0x5) {
+                seg.tail = tail_cpu::on;
+                break;
+            }
+        }
+    });
+
+    // Sequentially carry every touched query's state across segment boundaries.
+    struct state {
+        uint64_t prev_ts = 0;
+        activity act;
+        uint64_t remaining = 0;
+        uint64_t cputime = 0;
+        uint64_t iotime = 0;
+        uint64_t starvetime = 0;
+        bool started = false;
+        query_traits traits;
+        // The event whose owner the starvation from here on is charged to.
+        uint64_t culprit = none;
+    };
+    auto entry_states = std::vector<std::vector<state>>(n_segments);
+    {
+        auto carried = std::vector<state>(queries.size());
+        for (size_t q = 0; q < queries.size(); ++q) {
+            carried[q].remaining = n_events[q];
+        }
+        bool prev_tail_cpu = false;
+        for (size_t s = 0; s < n_segments; ++s) {
+            auto& seg = segments[s];
+            size_t a = segment_begin(s);
+            size_t b = segment_begin(s + 1);
+            size_t prev_tail_owner = s > 0 ? segments[s - 1].tail_owner : none;
+            auto& entries = entry_states[s];
+            entries.reserve(seg.touched.size());
+            for (const auto& t : seg.touched) {
+                auto& c = carried[t.q];
+                entries.push_back(c);
+                entries.back().act.cpu = c.started && t.q == prev_tail_owner && prev_tail_cpu;
+                c.started = true;
+                c.act.iostack += t.iodelta;
+                c.remaining -= t.n_events;
+                c.prev_ts = b < columns.size() ? columns.ts[b] : 0;
+                if (t.culprit != none) {
+                    c.culprit = t.culprit;
+                }
+            }
+            // The previous segment's tail owner, when it has no event here, is preempted by
+            // this segment's first one.
+            if (a < b && before_owner[s] != none && seg.before_slot == none) {
+                carried[before_owner[s]].culprit = a;
+            }
+            if (seg.tail == tail_cpu::inherit) {
+                const auto& e = entries[seg.tail_slot];
+                prev_tail_cpu = e.started ? e.act.cpu : !(a > 0 && columns.ts[a - 1] == columns.ts[a]);
+            } else {
+                prev_tail_cpu = seg.tail == tail_cpu::on;
+            }
+        }
+    }
+
+    // Pass 2: sweep every segment from its entry states. Blame charges are appended as they
+    // come, by victim slot and culprit ordinal; few repeat a pair.
+    struct charge {
+        uint32_t victim;
+        uint32_t culprit;
+        uint64_t ticks;
+    };
+    auto charges = std::vector<std::vector<charge>>(blame ? n_segments : 0);
+    parallel_tasks(n_segments, n_threads, [&] (size_t s) {
+        auto& seg = segments[s];
+        auto& states = entry_states[s];
+        size_t a = segment_begin(s);
+        size_t b = segment_begin(s + 1);
+        auto settle = [&] (state& st, uint64_t ts) {
+            uint64_t dt = ts - st.prev_ts;
+            if (st.act.iostack == 0 && !st.act.cpu) {
+                st.starvetime += dt;
+                if (blame && dt && st.culprit != none) {
+                    uint32_t victim = seg.touched[&st - states.data()].q;
+                    charges[s].push_back(charge{victim, index.ordinal(columns.query[st.culprit]), dt});
+                }
+            }
+            if (st.act.cpu) {
+                st.cputime += dt;
+            }
+            if (st.act.iostack) {
+                st.iotime += dt;
+            }
+            st.prev_ts = ts;
+        };
+        state* prev_owner = seg.before_slot == none ? nullptr : &states[seg.before_slot];
+        for (size_t i = a; i < b; ++i) {
+            if ((i - a) % progress_step == progress_step - 1) {
+                advance(progress_step);
+            }
+            int64_t ts = columns.ts[i];
+            uint8_t event = columns.event[i];
+            state* owner = owners[i] == uint32_t(none) ? nullptr : &states[owners[i]];
+            bool switched = prev_owner != owner;
+            if (prev_owner && switched && prev_owner->started && prev_owner->remaining) {
+                settle(*prev_owner, ts);
+                prev_owner->act.preempt();
+                prev_owner->culprit = i;
+            }
+            prev_owner = owner;
+            if (!owner) {
+                continue;
+            }
+            auto& st = *owner;
+            if (!st.started) {
+                // Foreign events sharing the first timestamp already count as preempting the query.
+                st.started = true;
+                st.prev_ts = ts;
+                st.act.cpu = !(i > 0 && columns.ts[i - 1] == ts);
+            }
+            settle(st, ts);
+            st.act.own(event);
+            st.traits.add(event, columns.arg[i]);
+            st.remaining -= 1;
+            if (switched && i > 0) {
+                st.culprit = i - 1;
+            }
+        }
+        advance((b - a) % progress_step);
+        for (auto& st : states) {
+            if (st.remaining && b < columns.size()) {
+                settle(st, columns.ts[b]);
+            }
+        }
+    });
+
+    auto totals = std::vector<state>(queries.size());
+    for (size_t s = 0; s < n_segments; ++s) {
+        for (size_t k = 0; k < segments[s].touched.size(); ++k) {
+            auto& total = totals[segments[s].touched[k].q];
+            const auto& st = entry_states[s][k];
+            total.cputime += st.cputime;
+            total.iotime += st.iotime;
+            total.starvetime += st.starvetime;
+            total.traits.merge(st.traits);
+        }
+    }
+    auto conv = [] (uint64_t ticks) {
+        return std::chrono::duration<double, std::nano>(ticks * MULTIPLIER);
+    };
+    for (size_t q = 0; q < queries.size(); ++q) {
+        queries[q].iotime = conv(totals[q].iotime);
+        queries[q].starvetime = conv(totals[q].starvetime);
+        queries[q].cputime = conv(totals[q].cputime);
+        queries[q].traits = totals[q].traits;
+    }
+    if (!blame) {
+        return;
+    }
+
+    // Lay the charges out in rows by victim, in id order (the index's), then combine those
+    // of the same culprit within each row.
+    auto row_begin = std::vector<uint64_t>(queries.size() + 1);
+    for (const auto& c : charges) {
+        for (const auto& ch : c) {
+            row_begin[ch.victim] += 1;
+        }
+    }
+    uint64_t at = 0;
+    for (size_t o = 0; o < index.ids.size(); ++o) {
+        if (slot_of[o] != none) {
+            at += std::exchange(row_begin[slot_of[o]], at);
+        }
+    }
+    auto row_end = row_begin;
+    auto rows = std::vector<charge>(at);
+    for (auto& c : charges) {
+        for (const auto& ch : c) {
+            rows[row_end[ch.victim]++] = ch;
+        }
+        c = std::vector<charge>();
+    }
+    auto row_size = std::vector<uint64_t>(queries.size());
+    parallel_for(queries.size(), n_threads, [&] (size_t begin, size_t end, unsigned) {
+        // Where in the row being combined every culprit already is.
+        auto seen = std::vector<uint32_t>(index.ids.size(), uint32_t(none));
+        for (size_t q = begin; q < end; ++q) {
+            auto row = std::span(rows).subspan(row_begin[q], row_end[q] - row_begin[q]);
+            size_t n = 0;
+            for (const auto& ch : row) {
+                if (seen[ch.culprit] != uint32_t(none)) {
+                    row[seen[ch.culprit]].ticks += ch.ticks;
+                } else {
+                    seen[ch.culprit] = n;
+                    row[n++] = ch;
+                }
+            }
+            for (size_t k = 0; k < n; ++k) {
+                seen[row[k].culprit] = uint32_t(none);
+            }
+            std::sort(row.begin(), row.begin() + n, [] (const auto& x, const auto& y) {return x.ticks > y.ticks;});
+            row_size[q] = n;
+        }
+    });
+    auto culprit_ticks = std::vector<uint64_t>(index.ids.size());
+    auto culprit_victims = std::vector<uint64_t>(index.ids.size());
+    blame->cells.clear();
+    blame->cells.reserve(std::reduce(row_size.begin(), row_size.end()));
+    for (size_t o = 0; o < index.ids.size(); ++o) {
+        if (slot_of[o] == none) {
+            continue;
+        }
+        size_t q = slot_of[o];
+        for (size_t k = row_begin[q]; k < row_begin[q] + row_size[q]; ++k) {
+            const auto& ch = rows[k];
+            culprit_ticks[ch.culprit] += ch.ticks;
+            culprit_victims[ch.culprit] += 1;
+            blame->cells.push_back(blame_matrix::cell{queries[q].id, index.ids[ch.culprit], conv(ch.ticks), slot_of[ch.culprit] == none});
+        }
+    }
+    blame->offenders.clear();
+    for (size_t o = 0; o < index.ids.size(); ++o) {
+        if (culprit_victims[o]) {
+            blame->offenders.push_back(blame_matrix::offender{index.ids[o], conv(culprit_ticks[o]), culprit_victims[o], slot_of[o] == none});
+        }
+    }
+    std::ranges::sort(blame->offenders, [] (const auto& x, const auto& y) {return x.starved > y.starved;});
+}
+
+std::span<const blame_matrix::cell> blame_matrix::of(uint64_t victim) const {
+    auto [begin, end] = std::ranges::equal_range(cells, victim, std::ranges::less(), &cell::victim);
+    return std::span<const cell>(begin, end);
+}
+
+timeline build_timeline(const trace_columns& columns, uint64_t id, int64_t start_ts, int64_t end_ts) {
+    auto t = timeline{id, start_ts, end_ts};
+    int64_t prev_ts = start_ts;
+    auto act = activity();
+    int64_t iostart = 0;
+    for (size_t i = columns.lower_bound(start_ts), end = columns.upper_bound(end_ts); i < end; ++i) {
+        int64_t ts = columns.ts[i];
+        if (act.cpu) {
+            t.cpu.add(prev_ts, ts);
+        }
+        if (columns.query[i] == id) {
+            bool in_io = act.iostack;
+            act.own(columns.event[i]);
+            if (!in_io && act.iostack) {
+                iostart = ts;
+            } else if (in_io && !act.iostack) {
+                t.io.add(iostart, ts);
+            }
+        } else {
+            act.preempt();
+        }
+        prev_ts = ts;
+    }
+    return t;
+}
+
+std::shared_ptr<const timeline> timeline_cache::get(uint32_t shard, uint64_t id, const std::function<timeline()>& build) {
+    auto it = std::ranges::find_if(entries, [&] (const auto& e) {return e.first == shard && e.second->id == id;});
+    if (it != entries.end()) {
+        std::rotate(it, it + 1, entries.end());
+        return entries.back().second;
+    }
+    if (entries.size() >= capacity) {
+        entries.erase(entries.begin());
+    }
+    entries.emplace_back(shard, std::make_shared<const timeline>(build()));
+    return entries.back().second;
+}
+
+std::vector<io_request> pair_ios(const trace_columns& columns, unsigned n_threads) {
+    n_threads = std::max(1u, n_threads);
+    size_t n_segments = n_threads == 1 ? 1 : std::clamp<size_t>(columns.size() / 65536, 1, n_threads * 8);
+    auto segment_begin = [&] (size_t s) {
+        return columns.size() * s / n_segments;
+    };
+    // Adds delta to the depth of a query, keeping only the non-zero ones.
+    auto add_depth = [] (flat_table<int64_t>& depths, uint64_t query, int64_t delta) {
+        if ((depths[query] += delta) == 0) {
+            depths.erase(query);
+        }
+    };
+
+    // An IO is known by the ordinal of its begin among the segment's, and its depth is
+    // relative to its query's at the segment start until that is known.
+    struct pending {
+        uint64_t ordinal;
+        int64_t depth;
+    };
+    struct pair {
+        uint64_t ordinal;
+        uint64_t end;
+        int64_t depth;
+    };
+    struct segment {
+        std::vector<uint64_t> begins;
+        std::vector<uint64_t> unmatched_ends;
+        std::vector<pair> pairs;
+        flat_table<pending> open;
+        flat_table<int64_t> depths;
+        // The depths at the segment start, and where its begins go in the trace's.
+        flat_table<int64_t> base;
+        uint64_t first_ordinal = 0;
+    };
+    auto segments = std::vector<segment>(n_segments);
+    parallel_tasks(n_segments, n_threads, [&] (size_t s) {
+        auto& seg = segments[s];
+        for (size_t i = segment_begin(s), end = segment_begin(s + 1); i < end; ++i) {
+            uint8_t event = columns.event[i];
+            if (event == 0x4) {
+                auto* depth = seg.depths.find(columns.query[i]);
+                seg.open[columns.arg[i]] = pending{seg.begins.size(), depth ? *depth : 0};
+                seg.begins.push_back(i);
+                add_depth(seg.depths, columns.query[i], 1);
+            } else if (event == 0x5) {
+                add_depth(seg.depths, columns.query[i], -1);
+                if (auto* p = seg.open.find(columns.arg[i])) {
+                    seg.pairs.push_back(pair{p->ordinal, i, p->depth});
+                    seg.open.erase(columns.arg[i]);
+                } else {
+                    seg.unmatched_ends.push_back(i);
+                }
+            }
+        }
+    });
+
+    // In trace order: close the IOs left open by earlier segments, and carry the depths
+    // over. A begin replaces an open IO of the same id, so the begins and unmatched ends
+    // of a segment are replayed in order.
+    auto open = flat_table<pending>();
+    auto depths = flat_table<int64_t>();
+    auto stitched = std::vector<pair>();
+    uint64_t n_begins = 0;
+    for (auto& seg : segments) {
+        seg.base = depths;
+        seg.first_ordinal = n_begins;
+        n_begins += seg.begins.size();
+        auto b = seg.begins.begin();
+        for (uint64_t i : seg.unmatched_ends) {
+            for (; b != seg.begins.end() && *b < i; ++b) {
+                open.erase(columns.arg[*b]);
+            }
+            if (auto* p = open.find(columns.arg[i])) {
+                stitched.push_back(pair{p->ordinal, i, p->depth});
+                open.erase(columns.arg[i]);
+            }
+        }
+        for (; b != seg.begins.end(); ++b) {
+            open.erase(columns.arg[*b]);
+        }
+        seg.open.for_each([&] (uint64_t id, const pending& p) {
+            auto* base = seg.base.find(columns.query[seg.begins[p.ordinal]]);
+            open[id] = pending{seg.first_ordinal + p.ordinal, p.depth + (base ? *base : 0)};
+        });
+        seg.depths.for_each([&] (uint64_t query, int64_t delta) {
+            add_depth(depths, query, delta);
+        });
+    }
+
+    // Every IO goes where its begin is in the trace; begins never closed leave holes.
+    auto ios = std::vector<io_request>(n_begins);
+    auto closed = std::vector<uint8_t>(n_begins);
+    auto fill = [&] (const pair& p, uint64_t begin, int64_t depth) {
+        ios[p.ordinal] = io_request{columns.arg[begin], columns.query[begin], columns.ts[begin], columns.ts[p.end], uint32_t(std::max<int64_t>(depth, 0))};
+        closed[p.ordinal] = 1;
+    };
+    parallel_tasks(n_segments, n_threads, [&] (size_t s) {
+        auto& seg = segments[s];
+        for (auto p : seg.pairs) {
+            uint64_t begin = seg.begins[p.ordinal];
+            auto* base = seg.base.find(columns.query[begin]);
+            p.ordinal += seg.first_ordinal;
+            fill(p, begin, p.depth + (base ? *base : 0));
+        }
+    });
+    for (const auto& p : stitched) {
+        auto s = std::ranges::upper_bound(segments, p.ordinal, std::ranges::less(), &segment::first_ordinal) - segments.begin() - 1;
+        fill(p, segments[s].begins[p.ordinal - segments[s].first_ordinal], p.depth);
+    }
+    size_t n_closed = 0;
+    for (size_t k = 0; k < n_begins; ++k) {
+        if (closed[k]) {
+            ios[n_closed++] = ios[k];
+        }
+    }
+    ios.resize(n_closed);
+    return ios;
+}
+
+std::vector<query> segment_queries(const query_index& index, const trace_columns& columns) {
+    std::vector<query> queries;
+    for (size_t o = 0; o < index.ids.size(); ++o) {
+        size_t i = index.offsets[o];
+        size_t end = index.offsets[o + 1];
+        if (index.positions_hi.empty()) {
+            i += columns.find_event(index.positions_lo.subspan(i, end - i), 1);
+        } else {
+            while (i < end && columns.event[index.position(i)] != 1) {
+                ++i;
+            }
+        }
+        if (i == end) {
+            continue;
+        }
+        auto start = columns.ts[index.position(i)];
+        auto last = columns.ts[index.position(end - 1)];
+        auto time = std::chrono::duration<double, std::nano>(double(last - start) * MULTIPLIER);
+        queries.push_back(query{time, index.ids[o]});
+        queries.back().first_ts = columns.ts[index.position(index.offsets[o])];
+        queries.back().start_ts = start;
+        queries.back().end_ts = last;
+    }
+    return queries;
+}
+
+query query_sweep::state::as_query() const {
+    auto conv = [] (uint64_t ticks) {
+        return std::chrono::duration<double, std::nano>(ticks * MULTIPLIER);
+    };
+    auto time = std::chrono::duration<double, std::nano>(double(last_ts - start_ts) * MULTIPLIER);
+    return query{time, id, conv(cputime), conv(iotime), conv(starvetime), first_ts, start_ts, last_ts, 0, traits};
+}
+
+query_sweep::state& query_sweep::step(const entry& e) {
+    auto add = [] (state& s, uint64_t dt, bool cpu) {
+        if (s.iostack == 0 && !cpu) {
+            s.starvetime += dt;
+        }
+        if (cpu) {
+            s.cputime += dt;
+        }
+        if (s.iostack) {
+            s.iotime += dt;
+        }
+    };
+
+    uint64_t id = e.query();
+    if (have_prev && prev_id != id) {
+        if (auto it = states.find(prev_id); it != states.end() && !it->second.preempted) {
+            it->second.preempted = true;
+            it->second.preempt_ts = e.ts;
+        }
+    }
+    auto it = states.find(id);
+    if (it == states.end()) {
+        auto s = state{id, e.ts, 0, e.ts, 0, 0, 0, 0, 0, !(have_prev && prev_ts == e.ts), false, false};
+        if (restore) {
+            restore(s);
+        }
+        it = states.emplace(id, s).first;
+    }
+    auto& s = it->second;
+    if (s.preempted) {
+        add(s, s.preempt_ts - s.last_ts, s.cpu);
+        add(s, e.ts - s.preempt_ts, false);
+        s.cpu = false;
+        s.preempted = false;
+    } else {
+        add(s, e.ts - s.last_ts, s.cpu);
+    }
+    if (e.event != 0x5) {
+        s.cpu = true;
+    }
+    if (e.event == 0x4) {
+        s.iostack += 1;
+    } else if (e.event == 0x5) {
+        s.iostack -= 1;
+    } else if (e.event == 1 && !s.started) {
+        s.started = true;
+        s.start_ts = e.ts;
+    }
+    s.traits.add(e.event, e.arg);
+    s.last_ts = e.ts;
+    have_prev = true;
+    prev_id = id;
+    prev_ts = e.ts;
+    return s;
+}
+
+std::vector<query> stream_queries(int fd, size_t file_size, size_t memory_cap, progress* done) {
+    using state = query_sweep::state;
+    constexpr size_t state_cost = sizeof(std::pair<const uint64_t, state>) + 4 * sizeof(void*);
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    size_t window_size = std::max(memory_cap / 4 / page_size, size_t(1)) * page_size;
+    size_t max_states = std::max(memory_cap / 2 / state_cost, size_t(1024));
+
+    FILE* spill = std::tmpfile();
+    if (!spill) {
+        throw std::system_error(errno, std::generic_category(), "spill file");
+    }
+    int spill_fd = fileno(spill);
+    auto spilled = std::unordered_map<uint64_t, uint64_t>();
+    auto write_state = [&] (const state& s) {
+        auto [it, inserted] = spilled.emplace(s.id, spilled.size());
+        if (pwrite(spill_fd, &s, sizeof(s), it->second * sizeof(s)) != sizeof(s)) {
+            throw std::system_error(errno, std::generic_category(), "spill file");
+        }
+    };
+
+    auto sweep = query_sweep();
+    auto& states = sweep.states;
+    sweep.restore = [&] (state& s) {
+        if (auto sp = spilled.find(s.id); sp != spilled.end()) {
+            if (pread(spill_fd, &s, sizeof(s), sp->second * sizeof(s)) != sizeof(s)) {
+                throw std::system_error(errno, std::generic_category(), "spill file");
+            }
+        }
+    };
+    auto evict = [&] {
+        auto ages = std::vector<int64_t>();
+        ages.reserve(states.size());
+        for (const auto& [id, s] : states) {
+            ages.push_back(s.last_ts);
+        }
+        auto median = ages.begin() + ages.size() / 2;
+        std::ranges::nth_element(ages, median);
+        std::erase_if(states, [&] (const auto& kv) {
+            if (kv.second.last_ts >= *median) {
+                return false;
+            }
+            write_state(kv.second);
+            return true;
+        });
+    };
+
+    auto sweep_entries = [&] (std::span<const entry> entries) {
+        for (const auto& e : entries) {
+            sweep.step(e);
+            if (states.size() > max_states) {
+                evict();
+            }
+        }
+    };
+    auto head = columnar_header{};
+    if (pread(fd, &head, sizeof(head), 0) == sizeof(head) && is_columnar(std::span<const char>(reinterpret_cast<const char*>(&head), sizeof(head)))) {
+        // A columnar trace is decoded a block at a time; the encoded file is small enough to
+        // map whole, and each block is dropped from memory once decoded.
+        void* mapping = mmap(nullptr, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapping == MAP_FAILED) {
+            throw std::system_error(errno, std::generic_category(), "mmap");
+        }
+        auto unmap = std::shared_ptr<void>(mapping, [file_size] (void* p) {munmap(p, file_size);});
+        madvise(mapping, file_size, MADV_SEQUENTIAL);
+        auto trace = open_columnar(std::span<const char>(static_cast<const char*>(mapping), file_size));
+        auto block = std::unique_ptr<entry[]>(new entry[trace.header->block_size]);
+        for (size_t b = 0; b < trace.blocks.size(); ++b) {
+            sweep_entries(std::span<const entry>(block.get(), trace.decode(b, block.get())));
+            size_t begin = trace.blocks[b].offset / page_size * page_size;
+            madvise(static_cast<char*>(mapping) + begin, trace.blocks[b].offset + trace.blocks[b].size - begin, MADV_DONTNEED);
+            if (done) {
+                *done = double(b + 1) / trace.blocks.size();
+            }
+        }
+    } else {
+        size_t usable_size = file_size / sizeof(entry) * sizeof(entry);
+        for (size_t offset = 0; offset < usable_size; offset += window_size) {
+            size_t len = std::min(window_size, usable_size - offset);
+            void* window = mmap(nullptr, len, PROT_READ, MAP_PRIVATE, fd, offset);
+            if (window == MAP_FAILED) {
+                throw std::system_error(errno, std::generic_category(), "mmap");
+            }
+            madvise(window, len, MADV_SEQUENTIAL);
+            sweep_entries(std::span<const entry>(reinterpret_cast<const entry*>(window), len / sizeof(entry)));
+            madvise(window, len, MADV_DONTNEED);
+            munmap(window, len);
+            posix_fadvise(fd, offset, len, POSIX_FADV_DONTNEED);
+            if (done) {
+                *done = double(offset + len) / usable_size;
+            }
+        }
+    }
+    for (const auto& [id, s] : states) {
+        write_state(s);
+    }
+    states.clear();
+
+    std::vector<query> queries;
+    auto batch = std::vector<state>(std::max(window_size / sizeof(state), size_t(1)));
+    for (uint64_t n = 0; n < spilled.size(); ) {
+        size_t count = std::min<uint64_t>(batch.size(), spilled.size() - n);
+        if (pread(spill_fd, batch.data(), count * sizeof(state), n * sizeof(state)) != ssize_t(count * sizeof(state))) {
+            throw std::system_error(errno, std::generic_category(), "spill file");
+        }
+        for (const auto& s : std::span(batch).first(count)) {
+            if (s.started) {
+                queries.push_back(s.as_query());
+            }
+        }
+        n += count;
+    }
+    fclose(spill);
+    return queries;
+}
+
+trace_sample sample_queries(std::span<const entry> trace, size_t n_strata, uint64_t seed, unsigned n_threads) {
+    constexpr size_t n_seed = trace_sample::seed_entries;
+    n_strata = std::clamp<size_t>(trace.size() / n_seed, 1, std::max<size_t>(n_strata, 1));
+    size_t stratum = trace.size() / n_strata;
+    auto strata = std::vector<trace_sample>(n_strata);
+    parallel_tasks(n_strata, n_threads, [&] (size_t k) {
+        auto& sample = strata[k];
+        size_t begin = k * stratum + mix(mix(seed) + k) % std::max<size_t>(stratum - std::min(stratum, n_seed), 1);
+        size_t seed_end = std::min(trace.size(), begin + n_seed);
+        sample.n_seeded = seed_end - begin;
+        auto seeded = std::unordered_set<uint64_t>();
+        for (size_t i = begin; i < seed_end; ++i) {
+            if (trace[i].event == 1) {
+                seeded.insert(trace[i].query());
+            }
+        }
+        if (seeded.empty()) {
+            return;
+        }
+        for (size_t follow = trace_sample::min_window; ; follow *= 2) {
+            size_t end = std::min(trace.size(), seed_end + follow);
+            auto window = trace.subspan(begin, end - begin);
+            auto columns = make_columns(window, 1);
+            auto index = build_index(window, columns, 1);
+            auto table = segment_queries(index, columns);
+            std::erase_if(table, [&] (const query& q) {return !seeded.contains(q.id);});
+            // Whether a query still had events in the second half of what follows the seed.
+            auto active = [&] (const query& q) {
+                auto [first, last] = index.slots(q.id);
+                return index.position(last - 1) >= (seed_end - begin) + follow / 2;
+            };
+            bool more = end < trace.size();
+            if (more && follow < trace_sample::max_window && std::ranges::any_of(table, active)) {
+                continue;
+            }
+            sample.n_swept = window.size();
+            sample.n_found = table.size();
+            if (more) {
+                sample.n_censored = std::erase_if(table, active);
+            }
+            attribute(columns, index, table, 1);
+            sample.queries = std::move(table);
+            break;
+        }
+    });
+    auto pooled = trace_sample();
+    for (auto& sample : strata) {
+        pooled.n_censored += sample.n_censored;
+        pooled.n_seeded += sample.n_seeded;
+        pooled.n_swept += sample.n_swept;
+        pooled.n_found += sample.n_found;
+        pooled.queries.insert(pooled.queries.end(), sample.queries.begin(), sample.queries.end());
+    }
+    std::ranges::sort(pooled.queries, std::ranges::less(), [] (const auto &x) {return x.latency;});
+    return pooled;
+}
+
+void trace_sample::merge(trace_sample other) {
+    auto ids = std::unordered_set<uint64_t>();
+    for (const auto& q : queries) {
+        ids.insert(q.id);
+    }
+    std::erase_if(other.queries, [&] (const query& q) {return ids.contains(q.id);});
+    size_t mid = queries.size();
+    queries.insert(queries.end(), other.queries.begin(), other.queries.end());
+    std::inplace_merge(queries.begin(), queries.begin() + mid, queries.end(), [] (const query& a, const query& b) {return a.latency < b.latency;});
+    n_censored += other.n_censored;
+    n_seeded += other.n_seeded;
+    n_swept += other.n_swept;
+    n_found += other.n_found;
+}
+
+live_trace::live_trace(int fd) : fd(fd) {
+}
+
+live_trace::~live_trace() {
+    if (data) {
+        munmap(const_cast<entry*>(data), mapped_size);
+    }
+}
+
+table_change change_table(std::vector<query>& table, std::vector<size_t> removed_at, std::vector<query> added) {
+    auto change = table_change();
+    change.removed.reserve(removed_at.size());
+    size_t kept = 0;
+    for (size_t i = 0, r = 0; i < table.size(); ++i) {
+        if (r < removed_at.size() && removed_at[r] == i) {
+            change.removed.push_back(table[i]);
+            ++r;
+        } else {
+            table[kept++] = table[i];
+        }
+    }
+    table.resize(kept);
+    // Every added row lands after the kept rows of no greater latency and the added rows
+    // before it, which is where the stable merge puts it.
+    auto by_latency = [] (const query& a, const query& b) {return a.latency < b.latency;};
+    std::ranges::stable_sort(added, by_latency);
+    for (size_t k = 0; k < added.size(); ++k) {
+        change.added_at.push_back(std::ranges::upper_bound(table, added[k].latency, std::ranges::less(), &query::latency) - table.begin() + k);
+    }
+    table.insert(table.end(), added.begin(), added.end());
+    std::inplace_merge(table.begin(), table.begin() + kept, table.end(), by_latency);
+    change.removed_at = std::move(removed_at);
+    change.added = std::move(added);
+    return change;
+}
+
+table_change live_trace::update(std::vector<query>& queries) {
+    struct stat sb;
+    if (fstat(fd, &sb)) {
+        throw std::system_error(errno, std::generic_category(), "fstat");
+    }
+    size_t n = sb.st_size / sizeof(entry);
+    if (n <= n_entries) {
+        return {};
+    }
+    // Grow the mapping in place if possible; pages already mapped are not read again.
+    size_t size = n * sizeof(entry);
+    void* p = data ? mremap(const_cast<entry*>(data), mapped_size, size, MREMAP_MAYMOVE) : mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p == MAP_FAILED) {
+        throw std::system_error(errno, std::generic_category(), "mmap");
+    }
+    data = static_cast<const entry*>(p);
+    mapped_size = size;
+
+    auto touched = std::unordered_map<uint64_t, bool>();
+    for (const auto& e : span().subspan(n_entries, n - n_entries)) {
+        touched[sweep.step(e).id] = true;
+    }
+    n_entries = n;
+
+    // Only the touched queries move: their old rows go, and the new ones are merged in.
+    auto changed = std::vector<query>();
+    for (const auto& [id, unused] : touched) {
+        if (const auto& s = sweep.states.at(id); s.started) {
+            changed.push_back(s.as_query());
+        }
+    }
+    auto removed_at = std::vector<size_t>();
+    for (size_t i = 0; i < queries.size(); ++i) {
+        if (touched.contains(queries[i].id)) {
+            removed_at.push_back(i);
+        }
+    }
+    return change_table(queries, std::move(removed_at), std::move(changed));
+}
+
+// Identifies the contents of a trace without reading all of it: its size and a hash of
+// its first and last MiB and of 64 blocks spread evenly in between.
+uint64_t trace_fingerprint(std::span<const entry> span) {
+    auto bytes = std::span<const uint64_t>(reinterpret_cast<const uint64_t*>(span.data()), span.size() * sizeof(entry) / sizeof(uint64_t));
+    uint64_t h = mix(bytes.size());
+    auto hash_range = [&] (size_t begin, size_t len) {
+        for (size_t i = begin; i < std::min(begin + len, bytes.size()); ++i) {
+            h = mix(h ^ bytes[i]);
+        }
+    };
+    constexpr size_t mib = (size_t(1) << 20) / sizeof(uint64_t);
+    constexpr size_t block = 4096 / sizeof(uint64_t);
+    hash_range(0, mib);
+    for (size_t k = 1; k <= 64; ++k) {
+        hash_range(bytes.size() / 65 * k, block);
+    }
+    hash_range(bytes.size() - std::min(bytes.size(), mib), mib);
+    return h;
+}
+
+// A sidecar file next to the trace (FILE.idx) caches the analysis of it: the query table
+// in latency order and the query index, laid out so that the index can be used straight
+// from the mapping, and the blame matrix and the IO table if the analysis made them. It
+// is only trusted if the header matches this build and the trace.
+struct sidecar_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t query_size;
+    double multiplier;
+    uint64_t trace_size;
+    int64_t trace_mtime_ns;
+    uint64_t trace_hash;
+    uint64_t n_queries;
+    uint64_t n_ids;
+    uint64_t n_slots;
+    uint64_t n_positions_hi;
+    uint64_t n_buckets;
+    uint64_t n_cells;
+    uint64_t n_offenders;
+    uint64_t n_ios;
+    uint32_t has_blame;
+    uint32_t has_ios;
+};
+constexpr char sidecar_magic[8] = {'T', 'R', 'A', 'C', 'E', 'I', 'D', 'X'};
+constexpr uint32_t sidecar_version = 4;
+
+sidecar_header make_sidecar_header(const struct stat& sb, std::span<const entry> span) {
+    auto h = sidecar_header{};
+    std::ranges::copy(sidecar_magic, h.magic);
+    h.version = sidecar_version;
+    h.query_size = sizeof(query);
+    h.multiplier = MULTIPLIER;
+    h.trace_size = sb.st_size;
+    h.trace_mtime_ns = int64_t(sb.st_mtim.tv_sec) * 1000000000 + sb.st_mtim.tv_nsec;
+    h.trace_hash = trace_fingerprint(span);
+    return h;
+}
+
+// Section offsets in the order they are stored, each aligned to 64 bytes.
+std::array<uint64_t, 10> sidecar_layout(const sidecar_header& h) {
+    auto align = [] (uint64_t x) {return (x + 63) / 64 * 64;};
+    std::array<uint64_t, 10> at;
+    at[0] = align(sizeof(sidecar_header));
+    at[1] = align(at[0] + h.n_queries * sizeof(query));
+    at[2] = align(at[1] + h.n_ids * sizeof(uint64_t));
+    at[3] = align(at[2] + (h.n_ids + 1) * sizeof(uint64_t));
+    at[4] = align(at[3] + h.n_slots * sizeof(uint32_t));
+    at[5] = align(at[4] + h.n_positions_hi * sizeof(uint8_t));
+    at[6] = align(at[5] + h.n_buckets * sizeof(uint32_t));
+    at[7] = align(at[6] + h.n_cells * sizeof(blame_matrix::cell));
+    at[8] = align(at[7] + h.n_offenders * sizeof(blame_matrix::offender));
+    at[9] = at[8] + h.n_ios * sizeof(io_request);
+    return at;
+}
+void save_sidecar(const std::string& sidecar_path, const struct stat& sb, std::span<const entry> span, const query_index& index, const std::vector<query>& queries,
+        const blame_matrix* blame, const std::vector<io_request>* ios) {
+    auto h = make_sidecar_header(sb, span);
+    h.n_queries = queries.size();
+    h.n_ids = index.ids.size();
+    h.n_slots = index.size();
+    h.n_positions_hi = index.positions_hi.size();
+    h.n_buckets = index.buckets.size();
+    h.has_blame = blame != nullptr;
+    h.n_cells = blame ? blame->cells.size() : 0;
+    h.n_offenders = blame ? blame->offenders.size() : 0;
+    h.has_ios = ios != nullptr;
+    h.n_ios = ios ? ios->size() : 0;
+    auto at = sidecar_layout(h);
+    auto tmp_path = sidecar_path + ".tmp";
+    int fd = open(tmp_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        fmt::print(stderr, "Not caching the index: {}: {}\n", tmp_path, strerror(errno));
+        return;
+    }
+    bool ok = true;
+    auto put = [&] (uint64_t offset, const void* data, size_t len) {
+        for (size_t done = 0; ok && done < len; ) {
+            ssize_t n = pwrite(fd, static_cast<const char*>(data) + done, len - done, offset + done);
+            ok = n > 0;
+            done += std::max<ssize_t>(n, 0);
+        }
+    };
+    put(0, &h, sizeof(h));
+    put(at[0], queries.data(), queries.size() * sizeof(query));
+    put(at[1], index.ids.data(), index.ids.size_bytes());
+    put(at[2], index.offsets.data(), index.offsets.size_bytes());
+    put(at[3], index.positions_lo.data(), index.positions_lo.size_bytes());
+    put(at[4], index.positions_hi.data(), index.positions_hi.size_bytes());
+    put(at[5], index.buckets.data(), index.buckets.size_bytes());
+    if (blame) {
+        put(at[6], blame->cells.data(), blame->cells.size() * sizeof(blame_matrix::cell));
+        put(at[7], blame->offenders.data(), blame->offenders.size() * sizeof(blame_matrix::offender));
+    }
+    if (ios) {
+        put(at[8], ios->data(), ios->size() * sizeof(io_request));
+    }
+    ok = ok && ftruncate(fd, at[9]) == 0;
+    close(fd);
+    if (!ok || rename(tmp_path.c_str(), sidecar_path.c_str()) != 0) {
+        fmt::print(stderr, "Not caching the index: {}: {}\n", sidecar_path, strerror(errno));
+        unlink(tmp_path.c_str());
+    }
+}
+
+bool load_sidecar(const std::string& sidecar_path, const struct stat& sb, std::span<const entry> span, query_index& index, std::vector<query>& queries,
+        std::shared_ptr<const blame_matrix>* blame, std::shared_ptr<const std::vector<io_request>>* ios) {
+    int fd = open(sidecar_path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat side_sb;
+    auto h = sidecar_header{};
+    bool ok = fstat(fd, &side_sb) == 0 && pread(fd, &h, sizeof(h), 0) == sizeof(h);
+    auto expected = make_sidecar_header(sb, span);
+    ok = ok && std::ranges::equal(h.magic, expected.magic) && h.version == expected.version && h.query_size == expected.query_size
+        && h.multiplier == expected.multiplier && h.trace_size == expected.trace_size && h.trace_mtime_ns == expected.trace_mtime_ns
+        && h.trace_hash == expected.trace_hash && h.n_buckets && std::has_single_bit(h.n_buckets);
+    auto at = sidecar_layout(h);
+    ok = ok && uint64_t(side_sb.st_size) == at[9];
+    void* mapping = ok ? mmap(nullptr, at[9], PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        return false;
+    }
+    auto base = static_cast<const char*>(mapping);
+    auto section = [&] <typename T> (std::span<const T>& out, int k, uint64_t n) {
+        out = std::span<const T>(reinterpret_cast<const T*>(base + at[k]), n);
+    };
+    auto table = std::span<const query>();
+    section(table, 0, h.n_queries);
+    queries.assign(table.begin(), table.end());
+    index = query_index{span};
+    section(index.ids, 1, h.n_ids);
+    section(index.offsets, 2, h.n_ids + 1);
+    section(index.positions_lo, 3, h.n_slots);
+    section(index.positions_hi, 4, h.n_positions_hi);
+    section(index.buckets, 5, h.n_buckets);
+    if (blame && h.has_blame) {
+        auto cells = std::span<const blame_matrix::cell>();
+        auto offenders = std::span<const blame_matrix::offender>();
+        section(cells, 6, h.n_cells);
+        section(offenders, 7, h.n_offenders);
+        auto b = std::make_shared<blame_matrix>();
+        b->cells.assign(cells.begin(), cells.end());
+        b->offenders.assign(offenders.begin(), offenders.end());
+        *blame = std::move(b);
+    }
+    if (ios && h.has_ios) {
+        auto pairs = std::span<const io_request>();
+        section(pairs, 8, h.n_ios);
+        *ios = std::make_shared<const std::vector<io_request>>(pairs.begin(), pairs.end());
+    }
+    index.storage = std::shared_ptr<const void>(mapping, [size = at[9]] (const void* p) {munmap(const_cast<void*>(p), size);});
+    return true;
+}
+
+std::vector<shard_event> merge_shards(std::span<const std::span<const entry>> traces, int64_t begin_ts, int64_t end_ts) {
+    struct cursor {
+        int64_t ts;
+        uint32_t shard;
+        uint64_t position;
+        uint64_t end;
+    };
+    auto by_ts = [] (const entry& e) {return e.ts;};
+    auto heap = std::vector<cursor>();
+    size_t total = 0;
+    for (uint32_t s = 0; s < traces.size(); ++s) {
+        uint64_t begin = std::ranges::lower_bound(traces[s], begin_ts, std::ranges::less(), by_ts) - traces[s].begin();
+        uint64_t end = std::ranges::lower_bound(traces[s], end_ts, std::ranges::less(), by_ts) - traces[s].begin();
+        if (begin < end) {
+            heap.push_back(cursor{traces[s][begin].ts, s, begin, end});
+            total += end - begin;
+        }
+    }
+    // Pops the earliest head, then the lowest shard among equal timestamps.
+    auto later = [] (const cursor& a, const cursor& b) {return a.ts != b.ts ? a.ts > b.ts : a.shard > b.shard;};
+    std::ranges::make_heap(heap, later);
+    auto events = std::vector<shard_event>();
+    events.reserve(total);
+    while (!heap.empty()) {
+        std::ranges::pop_heap(heap, later);
+        auto& c = heap.back();
+        // Take the whole run that precedes the next head in one go.
+        int64_t limit = heap.size() > 1 ? heap.front().ts : std::numeric_limits<int64_t>::max();
+        uint32_t limit_shard = heap.size() > 1 ? heap.front().shard : 0;
+        const auto& trace = traces[c.shard];
+        do {
+            events.push_back(shard_event{c.shard, c.position++});
+        } while (c.position < c.end && (trace[c.position].ts < limit || (trace[c.position].ts == limit && c.shard < limit_shard)));
+        if (c.position == c.end) {
+            heap.pop_back();
+        } else {
+            c.ts = trace[c.position].ts;
+            std::ranges::push_heap(heap, later);
+        }
+    }
+    return events;
+}
+
+size_t wavelet_matrix::level::rank(size_t i) const {
+    size_t word = i / 64;
+    size_t ones = ones_before[word / 4];
+    for (size_t w = word / 4 * 4; w < word; ++w) {
+        ones += std::popcount(bits[w]);
+    }
+    if (i % 64) {
+        ones += std::popcount(bits[word] & ((uint64_t(1) << (i % 64)) - 1));
+    }
+    return ones;
+}
+
+wavelet_matrix::wavelet_matrix(std::vector<uint64_t> values) {
+    if (values.empty()) {
+        return;
+    }
+    int n_bits = std::max(1, int(std::bit_width(std::ranges::max(values))));
+    auto next = std::vector<uint64_t>(values.size());
+    for (int b = n_bits - 1; b >= 0; --b) {
+        auto& l = levels.emplace_back();
+        // One spare word, so that rank() may look at the word after the last bit.
+        l.bits.resize(values.size() / 64 + 1);
+        for (size_t i = 0; i < values.size(); ++i) {
+            l.bits[i / 64] |= ((values[i] >> b) & 1) << (i % 64);
+        }
+        l.ones_before.resize(l.bits.size() / 4 + 1);
+        for (size_t w = 0, ones = 0; w < l.bits.size(); ++w) {
+            if (w % 4 == 0) {
+                l.ones_before[w / 4] = ones;
+            }
+            ones += std::popcount(l.bits[w]);
+        }
+        l.zeros = values.size() - l.rank(values.size());
+        size_t zeros = 0;
+        size_t ones = l.zeros;
+        for (uint64_t v : values) {
+            uint64_t bit = (v >> b) & 1;
+            next[bit ? ones : zeros] = v;
+            ones += bit;
+            zeros += bit ^ 1;
+        }
+        std::swap(values, next);
+    }
+}
+
+uint64_t wavelet_matrix::kth(size_t begin, size_t end, size_t k) const {
+    uint64_t value = 0;
+    for (const auto& l : levels) {
+        size_t ones_begin = l.rank(begin);
+        size_t ones_end = l.rank(end);
+        size_t zeros = (end - begin) - (ones_end - ones_begin);
+        value <<= 1;
+        if (k < zeros) {
+            begin -= ones_begin;
+            end -= ones_end;
+        } else {
+            k -= zeros;
+            value |= 1;
+            begin = l.zeros + ones_begin;
+            end = l.zeros + ones_end;
+        }
+    }
+    return value;
+}
+
+time_dist_index make_time_dist_index(std::span<const query> queries, unsigned n_threads) {
+    auto index = time_dist_index();
+    auto prefix_sums = [&] (auto time) {
+        auto prefix = std::vector<double>(queries.size() + 1);
+        for (size_t i = 0; i < queries.size(); ++i) {
+            prefix[i + 1] = prefix[i] + time(queries[i]);
+        }
+        return prefix;
+    };
+    auto build = [&] (time_dist_index::metric& m, auto time) {
+        // Ties are ranked by position, which keeps the ranks distinct.
+        auto order = std::vector<std::pair<double, uint64_t>>(queries.size());
+        for (size_t i = 0; i < queries.size(); ++i) {
+            order[i] = std::pair(time(queries[i]), i);
+        }
+        std::ranges::sort(order);
+        auto ranks = std::vector<uint64_t>(queries.size());
+        m.sorted.resize(queries.size());
+        m.positions.resize(queries.size());
+        for (size_t r = 0; r < order.size(); ++r) {
+            ranks[order[r].second] = r;
+            m.sorted[r] = order[r].first;
+            m.positions[r] = order[r].second;
+        }
+        m.ranks = wavelet_matrix(std::move(ranks));
+        m.prefix = prefix_sums(time);
+    };
+    parallel_tasks(4, n_threads, [&] (size_t task) {
+        switch (task) {
+        case 0: build(index.cputime, [] (const query& q) {return q.cputime.count();}); break;
+        case 1: build(index.iotime, [] (const query& q) {return q.iotime.count();}); break;
+        case 2: build(index.starvetime, [] (const query& q) {return q.starvetime.count();}); break;
+        default:
+            for (const auto& q : queries) {
+                index.latency.push_back(q.latency.count());
+            }
+            index.latency_prefix = prefix_sums([] (const query& q) {return q.latency.count();});
+        }
+    });
+    return index;
+}
+
+void update_time_dist_index(time_dist_index& index, std::span<const query> queries, const table_change& change, unsigned n_threads) {
+    size_t old_n = index.latency.size();
+    // Where every row of the table before went, or gone if it was removed.
+    constexpr uint64_t gone = -1;
+    auto moved_to = std::vector<uint64_t>(old_n);
+    for (size_t i = 0, at = 0, r = 0, a = 0; i < old_n; ++i) {
+        if (r < change.removed_at.size() && change.removed_at[r] == i) {
+            moved_to[i] = gone;
+            ++r;
+            continue;
+        }
+        for (; a < change.added_at.size() && change.added_at[a] == at; ++a) {
+            ++at;
+        }
+        moved_to[i] = at++;
+    }
+    size_t first = queries.size();
+    if (!change.removed_at.empty()) {
+        first = std::min(first, change.removed_at.front());
+    }
+    if (!change.added_at.empty()) {
+        first = std::min(first, change.added_at.front());
+    }
+    auto extend_prefix_sums = [&] (std::vector<double>& prefix, auto time) {
+        prefix.resize(queries.size() + 1);
+        for (size_t i = first; i < queries.size(); ++i) {
+            prefix[i + 1] = prefix[i] + time(queries[i]);
+        }
+    };
+    auto update = [&] (time_dist_index::metric& m, auto time) {
+        // The kept rows, in rank order, are still ordered by (time, position) after the
+        // move, and merge with the added ones into the order a sort would give.
+        auto added = std::vector<std::pair<double, uint64_t>>();
+        for (size_t k = 0; k < change.added.size(); ++k) {
+            added.emplace_back(time(change.added[k]), change.added_at[k]);
+        }
+        std::ranges::sort(added);
+        auto ranks = std::vector<uint64_t>(queries.size());
+        auto sorted = std::vector<double>(queries.size());
+        auto positions = std::vector<uint64_t>(queries.size());
+        size_t r = 0;
+        auto take = [&] (std::pair<double, uint64_t> x) {
+            ranks[x.second] = r;
+            positions[r] = x.second;
+            sorted[r++] = x.first;
+        };
+        size_t k = 0;
+        for (size_t old_r = 0; old_r < old_n; ++old_r) {
+            uint64_t at = moved_to[m.positions[old_r]];
+            if (at == gone) {
+                continue;
+            }
+            auto x = std::pair(m.sorted[old_r], at);
+            for (; k < added.size() && added[k] < x; ++k) {
+                take(added[k]);
+            }
+            take(x);
+        }
+        for (; k < added.size(); ++k) {
+            take(added[k]);
+        }
+        m.sorted = std::move(sorted);
+        m.positions = std::move(positions);
+        m.ranks = wavelet_matrix(std::move(ranks));
+        extend_prefix_sums(m.prefix, time);
+    };
+    parallel_tasks(4, n_threads, [&] (size_t task) {
+        switch (task) {
+        case 0: update(index.cputime, [] (const query& q) {return q.cputime.count();}); break;
+        case 1: update(index.iotime, [] (const query& q) {return q.iotime.count();}); break;
+        case 2: update(index.starvetime, [] (const query& q) {return q.starvetime.count();}); break;
+        default:
+            index.latency.resize(queries.size());
+            for (size_t i = first; i < queries.size(); ++i) {
+                index.latency[i] = queries[i].latency.count();
+            }
+            extend_prefix_sums(index.latency_prefix, [] (const query& q) {return q.latency.count();});
+        }
+    });
+}
+
+time_dist make_time_dist(const time_dist_index& index, size_t w1, size_t w2, std::span<const double> plot_x) {
+    using t = std::chrono::duration<double>;
+    auto d = time_dist{t::zero(), t::zero(), t::zero(), t::zero()};
+    if (w2 < w1 || w2 >= index.latency.size()) {
+        return d;
+    }
+    size_t n = w2 - w1 + 1;
+    auto average = [&] (const std::vector<double>& prefix) {
+        return t((prefix[w2 + 1] - prefix[w1]) / n);
+    };
+    d.avgcputime = average(index.cputime.prefix);
+    d.avgiotime = average(index.iotime.prefix);
+    d.avgstarvetime = average(index.starvetime.prefix);
+    d.avglatency = average(index.latency_prefix);
+
+    auto sample = [&] (const time_dist_index::metric& m) {
+        auto res = std::vector<double>();
+        for (const auto& p : plot_x) {
+            size_t ww = (n - 1) * p;
+            res.push_back(std::chrono::duration<double, std::milli>(t(m.sorted[m.ranks.kth(w1, w2 + 1, ww)])).count());
+        }
+        return res;
+    };
+    d.cputimes_y = sample(index.cputime);
+    d.iotimes_y = sample(index.iotime);
+    d.starvetimes_y = sample(index.starvetime);
+    for (const auto& p : plot_x) {
+        size_t ww = (n - 1) * p;
+        d.latencies_y.push_back(std::chrono::duration<double, std::milli>(t(index.latency[w1 + ww])).count());
+    }
+    return d;
+}
+
+int latency_pyramid::bin(double latency) {
+    int b = int(std::floor(std::log10(std::max(latency, min_latency) / min_latency) * bins_per_decade));
+    return std::clamp(b, 0, n_bins - 1);
+}
+
+double latency_pyramid::bin_latency(int bin) {
+    return min_latency * std::pow(10.0, double(bin) / bins_per_decade);
+}
+
+latency_pyramid make_latency_pyramid(std::span<const query> queries, unsigned n_threads) {
+    constexpr size_t max_buckets = 16384;
+    auto p = latency_pyramid();
+    if (queries.empty()) {
+        p.levels.emplace_back(latency_pyramid::n_bins);
+        return p;
+    }
+    auto [first, last] = std::ranges::minmax(queries | std::views::transform([] (const query& q) {return q.start_ts;}));
+    p.first_ts = first;
+    p.bucket_ticks = std::max<int64_t>(1, (last - first) / max_buckets + 1);
+    size_t n_buckets = (last - first) / p.bucket_ticks + 1;
+    p.levels.emplace_back(n_buckets * latency_pyramid::n_bins);
+    for (const auto& q : queries) {
+        size_t bucket = (q.start_ts - first) / p.bucket_ticks;
+        p.levels[0][bucket * latency_pyramid::n_bins + latency_pyramid::bin(q.latency.count())] += 1;
+    }
+    while (p.n_buckets(p.levels.size() - 1) > 1) {
+        const auto& below = p.levels.back();
+        size_t n_below = below.size() / latency_pyramid::n_bins;
+        auto above = std::vector<uint32_t>((n_below + 1) / 2 * latency_pyramid::n_bins);
+        parallel_for((n_below + 1) / 2, n_threads, [&] (size_t begin, size_t end, unsigned) {
+            for (size_t k = begin; k < end; ++k) {
+                for (int b = 0; b < latency_pyramid::n_bins; ++b) {
+                    uint32_t sum = below[2 * k * latency_pyramid::n_bins + b];
+                    if (2 * k + 1 < n_below) {
+                        sum += below[(2 * k + 1) * latency_pyramid::n_bins + b];
+                    }
+                    above[k * latency_pyramid::n_bins + b] = sum;
+                }
+            }
+        });
+        p.levels.push_back(std::move(above));
+    }
+    return p;
+}
+
+std::vector<double> latency_pyramid::view(int64_t begin_ts, int64_t end_ts, size_t n_columns, size_t& level) const {
+    n_columns = std::max<size_t>(n_columns, 1);
+    auto out = std::vector<double>(n_columns * n_bins);
+    end_ts = std::max(end_ts, begin_ts + 1);
+    // The coarsest level whose buckets are no wider than a column.
+    level = 0;
+    while (level + 1 < levels.size() && (bucket_ticks << (level + 1)) * int64_t(n_columns) <= end_ts - begin_ts) {
+        ++level;
+    }
+    int64_t width = bucket_ticks << level;
+    const auto& counts = levels[level];
+    size_t n = n_buckets(level);
+    // Every bucket starting in a column goes to it; zoomed in past level 0, a column without
+    // one shows the bucket it is in.
+    for (size_t c = 0; c < n_columns; ++c) {
+        int64_t lo = begin_ts + (end_ts - begin_ts) * int64_t(c) / int64_t(n_columns);
+        int64_t hi = begin_ts + (end_ts - begin_ts) * int64_t(c + 1) / int64_t(n_columns);
+        int64_t first_bucket = std::max<int64_t>(0, (lo - first_ts + width - 1) / width);
+        int64_t end_bucket = std::min<int64_t>(n, std::max<int64_t>(0, (hi - first_ts + width - 1) / width));
+        if (first_bucket >= end_bucket && lo >= first_ts && (lo - first_ts) / width < int64_t(n)) {
+            first_bucket = (lo - first_ts) / width;
+            end_bucket = first_bucket + 1;
+        }
+        for (int64_t k = first_bucket; k < end_bucket; ++k) {
+            for (int b = 0; b < n_bins; ++b) {
+                out[size_t(n_bins - 1 - b) * n_columns + c] += counts[k * n_bins + b];
+            }
+        }
+    }
+    return out;
+}
+
+hdr_histogram::hdr_histogram(int significant_digits, uint64_t highest) : significant_digits(significant_digits), highest(std::max<uint64_t>(highest, 1)) {
+    if (significant_digits < 1 || significant_digits > 5) {
+        throw std::runtime_error(fmt::format("hdr_histogram: {} significant digits, not 1 to 5", significant_digits));
+    }
+    // Sub-buckets one value wide up to 2 * 10^digits tell values that far apart, and every
+    // bucket above keeps the same relative width.
+    uint64_t resolution = 2;
+    for (int d = 0; d < significant_digits; ++d) {
+        resolution *= 10;
+    }
+    half_bits = std::bit_width(resolution - 1) - 1;
+    counts.resize(index_of(this->highest) + 1);
+}
+
+uint64_t hdr_histogram::lowest_at(size_t index) const {
+    if (index < (size_t(2) << half_bits)) {
+        return index;
+    }
+    int bucket = int(index >> half_bits) - 1;
+    uint64_t sub = (index & ((size_t(1) << half_bits) - 1)) + (uint64_t(1) << half_bits);
+    return sub << bucket;
+}
+
+uint64_t hdr_histogram::highest_at(size_t index) const {
+    int bucket = index < (size_t(2) << half_bits) ? 0 : int(index >> half_bits) - 1;
+    return lowest_at(index) + (uint64_t(1) << bucket) - 1;
+}
+
+void hdr_histogram::merge(const hdr_histogram& other) {
+    if (other.significant_digits != significant_digits || other.highest != highest) {
+        throw std::runtime_error("hdr_histogram: merging histograms of different precision or range");
+    }
+    for (size_t i = 0; i < counts.size(); ++i) {
+        counts[i] += other.counts[i];
+    }
+    total += other.total;
+    min = std::min(min, other.min);
+    max = std::max(max, other.max);
+}
+
+std::vector<double> hdr_histogram::seconds_at(std::span<const double> ps) const {
+    auto out = std::vector<double>(ps.size());
+    if (total == 0) {
+        return out;
+    }
+    auto order = std::vector<size_t>(ps.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::ranges::sort(order, std::ranges::less(), [&] (size_t k) {return ps[k];});
+    size_t index = 0;
+    uint64_t below = 0;
+    for (size_t k : order) {
+        uint64_t rank = quantile_index(total, ps[k]);
+        while (below + counts[index] <= rank) {
+            below += counts[index++];
+        }
+        out[k] = std::clamp(highest_at(index), min, max) * 1e-9;
+    }
+    return out;
+}
+
+// A varint per non-empty sub-bucket, of its count shifted left once, and per run of empty
+// ones, of its length shifted left once with the low bit set; trailing empty ones are left
+// out.
+std::string hdr_histogram::serialize() const {
+    auto out = std::string("HDR1");
+    auto varint = [&] (uint64_t v) {
+        for (; v >= 0x80; v >>= 7) {
+            out += char(v | 0x80);
+        }
+        out += char(v);
+    };
+    auto items = std::vector<uint64_t>();
+    for (size_t i = 0; i < counts.size(); ) {
+        size_t run = 0;
+        while (i + run < counts.size() && counts[i + run] == 0) {
+            ++run;
+        }
+        if (i + run == counts.size()) {
+            break;
+        }
+        if (run) {
+            items.push_back(run << 1 | 1);
+        }
+        i += run;
+        items.push_back(counts[i++] << 1);
+    }
+    varint(significant_digits);
+    varint(highest);
+    varint(min);
+    varint(max);
+    varint(items.size());
+    for (auto item : items) {
+        varint(item);
+    }
+    return out;
+}
+
+hdr_histogram hdr_histogram::deserialize(std::string_view& in) {
+    auto fail = [] {
+        throw std::runtime_error("hdr_histogram: not a serialized histogram");
+    };
+    auto varint = [&] {
+        uint64_t v = 0;
+        for (int shift = 0; ; shift += 7) {
+            if (in.empty() || shift > 63) {
+                fail();
+            }
+            auto byte = uint8_t(in.front());
+            in.remove_prefix(1);
+            v |= uint64_t(byte & 0x7f) << shift;
+            if (!(byte & 0x80)) {
+                return v;
+            }
+        }
+    };
+    if (!in.starts_with("HDR1")) {
+        fail();
+    }
+    in.remove_prefix(4);
+    uint64_t digits = varint();
+    uint64_t highest = varint();
+    if (digits < 1 || digits > 5 || highest == 0 || highest > default_highest * 1000) {
+        fail();
+    }
+    auto h = hdr_histogram(int(digits), highest);
+    h.min = varint();
+    h.max = varint();
+    uint64_t n_items = varint();
+    size_t at = 0;
+    for (uint64_t k = 0; k < n_items; ++k) {
+        uint64_t item = varint();
+        if (item & 1) {
+            at += item >> 1;
+        } else if (at < h.counts.size()) {
+            h.counts[at++] = item >> 1;
+            h.total += item >> 1;
+        } else {
+            fail();
+        }
+        if (at > h.counts.size()) {
+            fail();
+        }
+    }
+    return h;
+}
+
+time_histograms make_time_histograms(std::span<const query> queries, unsigned n_threads, int significant_digits) {
+    // Each thread's histograms are worth zeroing for a share of at least this many queries.
+    constexpr size_t min_share = 65536;
+    n_threads = std::clamp<size_t>(queries.size() / min_share, 1, std::max(n_threads, 1u));
+    auto parts = std::vector<time_histograms>(n_threads, time_histograms(significant_digits));
+    parallel_for(queries.size(), n_threads, [&] (size_t begin, size_t end, unsigned t) {
+        for (size_t q = begin; q < end; ++q) {
+            parts[t].record(queries[q]);
+        }
+    });
+    for (unsigned t = 1; t < n_threads; ++t) {
+        parts[0].merge(parts[t]);
+    }
+    return std::move(parts[0]);
+}
+
+size_t quantile_index(size_t n, double p) {
+    return std::clamp(n - size_t((1.0 - p) * n), size_t(0), n - 1);
+}
+
+void write_report(FILE* out, const std::vector<query>& queries, report_format format, size_t top_n) {
+    using ms = std::chrono::duration<double, std::milli>;
+    struct row {
+        std::string kind;
+        std::string name;
+        size_t count;
+        double latency;
+        double cputime;
+        double iotime;
+        double starvetime;
+    };
+    auto rows = std::vector<row>();
+    if (!queries.empty()) {
+        const double quantiles[] = {0, 0.5, 0.75, 0.9, 0.95, 0.99, 0.999, 0.9999, 1};
+        for (double p : quantiles) {
+            const auto& q = queries[quantile_index(queries.size(), p)];
+            rows.push_back(row{"quantile", fmt::format("{}", p), 1, ms(q.latency).count(), ms(q.cputime).count(), ms(q.iotime).count(), ms(q.starvetime).count()});
+        }
+        const double bands[] = {0, 0.5, 0.9, 0.99, 0.999, 1};
+        for (size_t b = 0; b + 1 < std::size(bands); ++b) {
+            size_t w1 = quantile_index(queries.size(), bands[b]);
+            size_t w2 = b + 2 == std::size(bands) ? queries.size() : quantile_index(queries.size(), bands[b + 1]);
+            if (w2 <= w1) {
+                continue;
+            }
+            auto r = row{"band", fmt::format("{}-{}", bands[b], bands[b + 1]), w2 - w1};
+            for (size_t i = w1; i < w2; ++i) {
+                r.latency += ms(queries[i].latency).count() / r.count;
+                r.cputime += ms(queries[i].cputime).count() / r.count;
+                r.iotime += ms(queries[i].iotime).count() / r.count;
+                r.starvetime += ms(queries[i].starvetime).count() / r.count;
+            }
+            rows.push_back(r);
+        }
+        for (size_t i = queries.size(); i-- > queries.size() - std::min(top_n, queries.size()); ) {
+            const auto& q = queries[i];
+            rows.push_back(row{"slowest", fmt::format("{:016x}", q.id), 1, ms(q.latency).count(), ms(q.cputime).count(), ms(q.iotime).count(), ms(q.starvetime).count()});
+        }
+    }
+
+    if (format == report_format::csv) {
+        fmt::print(out, "kind,name,count,latency_ms,cpu_ms,io_ms,starve_ms\n");
+        for (const auto& r : rows) {
+            fmt::print(out, "{},{},{},{:.9f},{:.9f},{:.9f},{:.9f}\n", r.kind, r.name, r.count, r.latency, r.cputime, r.iotime, r.starvetime);
+        }
+        return;
+    }
+    fmt::print(out, "{{\n  \"queries\": {},\n", queries.size());
+    const char* sections[] = {"quantile", "band", "slowest"};
+    for (const char* section : sections) {
+        fmt::print(out, "  \"{}\": [", section);
+        const char* sep = "\n";
+        for (const auto& r : rows) {
+            if (r.kind != section) {
+                continue;
+            }
+            fmt::print(out, "{}    {{\"name\": \"{}\", \"count\": {}, \"latency_ms\": {:.9f}, \"cpu_ms\": {:.9f}, \"io_ms\": {:.9f}, \"starve_ms\": {:.9f}}}",
+                sep, r.name, r.count, r.latency, r.cputime, r.iotime, r.starvetime);
+            sep = ",\n";
+        }
+        fmt::print(out, "\n  ]{}\n", section == sections[std::size(sections) - 1] ? "" : ",");
+    }
+    fmt::print(out, "}}\n");
+}
@@ -0,0 +1,748 @@
+#pragma once
+
+#include <algorithm>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <span>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <string>
+#include <string_view>
+#include <memory>
+#include <deque>
+#include <mutex>
+#include <utility>
+#include <functional>
+#include <atomic>
+#include <unordered_map>
+#include <limits>
+#include <bit>
+#include <cmath>
+#include <fmt/core.h>
+
+const double MULTIPLIER = 0.2941171840072451;
+
+struct entry {
+    uint64_t event;
+    uint64_t id;
+    uint64_t arg;
+    int64_t ts;
+
+    uint64_t query() const {
+        if (event == 0 || event == 1 || event == 0xa || event == 0xb) {
+            return arg;
+        } else {
+            return id;
+        }
+    }
+};
+template <> struct fmt::formatter<entry> : formatter<string_view> {
+    auto format(const entry& e, auto& ctx) const -> decltype(ctx.out()) {
+        // ctx.out() is an output iterator to write to.
+        return fmt::format_to(ctx.out(), "({:016x} {:016x} {:016x} {:016x})", e.event, e.id, e.arg, e.ts);
+    }
+};
+
+// The human-readable part of a log row.
+std::string describe(const entry& e);
+
+// Splits [0, n) into one contiguous chunk per thread and runs func(begin, end, thread) on each.
+template <typename Func>
+void parallel_for(size_t n, unsigned n_threads, Func func) {
+    n_threads = std::max<size_t>(1, std::min<size_t>(n_threads, std::max<size_t>(n, 1)));
+    auto threads = std::vector<std::thread>();
+    for (unsigned t = 1; t < n_threads; ++t) {
+        threads.emplace_back(func, n * t / n_threads, n * (t + 1) / n_threads, t);
+    }
+    func(0, n / n_threads, 0);
+    for (auto& t : threads) {
+        t.join();
+    }
+}
+
+// Runs func(task) for every task in [0, n_tasks) on n_threads workers. Each worker starts
+// with a contiguous share of the tasks in its own deque and pops from the back of it;
+// a worker that runs dry steals from the front of the other workers' deques.
+template <typename Func>
+void parallel_tasks(size_t n_tasks, unsigned n_threads, Func func) {
+    struct worker {
+        std::mutex mutex;
+        std::deque<size_t> tasks;
+    };
+    n_threads = std::max<size_t>(1, std::min<size_t>(n_threads, std::max<size_t>(n_tasks, 1)));
+    auto workers = std::vector<worker>(n_threads);
+    for (unsigned t = 0; t < n_threads; ++t) {
+        for (size_t i = n_tasks * t / n_threads; i < n_tasks * (t + 1) / n_threads; ++i) {
+            workers[t].tasks.push_back(i);
+        }
+    }
+    auto take = [&] (unsigned t, bool steal) -> size_t {
+        auto lock = std::lock_guard(workers[t].mutex);
+        auto& tasks = workers[t].tasks;
+        if (tasks.empty()) {
+            return -1;
+        }
+        size_t task = steal ? tasks.front() : tasks.back();
+        steal ? tasks.pop_front() : tasks.pop_back();
+        return task;
+    };
+    auto work = [&] (unsigned t) {
+        while (true) {
+            size_t task = take(t, false);
+            for (unsigned k = 1; task == size_t(-1) && k < n_threads; ++k) {
+                task = take((t + k) % n_threads, true);
+            }
+            if (task == size_t(-1)) {
+                return;
+            }
+            func(task);
+        }
+    };
+    auto threads = std::vector<std::thread>();
+    for (unsigned t = 1; t < n_threads; ++t) {
+        threads.emplace_back(work, t);
+    }
+    work(0);
+    for (auto& t : threads) {
+        t.join();
+    }
+}
+
+// Adds the time spent in its scope, in seconds, to total, or up to stop() if that comes
+// first.
+struct scoped_timer {
+    double& total;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    bool running = true;
+
+    ~scoped_timer() {
+        stop();
+    }
+    void stop() {
+        if (running) {
+            total += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            running = false;
+        }
+    }
+};
+
+// Spreads the bits of a query id, which are often aligned pointers, over the whole word.
+inline uint64_t mix(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+// How far a long pass has got, from 0 to 1, for another thread to show. The passes that
+// take one update it every so often; it may be null.
+using progress = std::atomic<double>;
+
+// The vector kernels use the widest of these the CPU supports, or the one named by
+// TRACE_SIMD=scalar|avx2|avx512 if that is narrower.
+enum class simd_level { scalar, avx2, avx512 };
+simd_level simd();
+std::string_view simd_name(simd_level level);
+
+// The trace with one array per field, for the scans that look at one or two fields of
+// every entry and would otherwise read all 32 bytes of it. query holds entry::query(),
+// computed once; event codes that don't fit a byte read as 0xff. event is followed by
+// padding, so that gathers may read a word at any of its positions. storage keeps the
+// arrays alive.
+struct trace_columns {
+    std::span<const uint8_t> event;
+    std::span<const int64_t> ts;
+    std::span<const uint64_t> query;
+    std::span<const uint64_t> arg;
+    std::shared_ptr<const void> storage;
+
+    size_t size() const {
+        return ts.size();
+    }
+    // The first position whose timestamp is not less than, or greater than, ts. A binary
+    // search narrows down to a few cache lines, which are then compared whole.
+    size_t lower_bound(int64_t ts) const;
+    size_t upper_bound(int64_t ts) const;
+    // The first of positions that holds a code event, or positions.size().
+    size_t find_event(std::span<const uint32_t> positions, uint8_t code) const;
+};
+
+// Splits span into columns, n_threads chunks at a time.
+trace_columns make_columns(std::span<const entry> span, unsigned n_threads);
+
+// Per-query index over the trace. Every distinct query() gets a dense ordinal in id
+// order, and the events of ordinal o are the slots [offsets[o], offsets[o + 1]), each
+// holding the event's position in the trace, in (ts, position) order. Positions take
+// 4 bytes, plus a fifth for traces of 2^32 entries or more.
+//
+// Ids are found through an open-addressing table of ordinal + 1 (0 marks a free bucket),
+// so that the whole index is flat arrays: they live either in memory or in a mapped
+// sidecar file, and storage keeps whichever it is alive.
+struct query_index {
+    std::span<const entry> trace;
+    std::span<const uint64_t> ids;
+    std::span<const uint64_t> offsets;
+    std::span<const uint32_t> positions_lo;
+    std::span<const uint8_t> positions_hi;
+    std::span<const uint32_t> buckets;
+    std::shared_ptr<const void> storage;
+
+    static constexpr uint32_t none = -1;
+
+    size_t size() const {
+        return positions_lo.size();
+    }
+    uint64_t position(uint64_t slot) const {
+        return positions_lo[slot] | (positions_hi.empty() ? 0 : uint64_t(positions_hi[slot]) << 32);
+    }
+    const entry& event(uint64_t slot) const {
+        return trace[position(slot)];
+    }
+    uint32_t ordinal(uint64_t id) const {
+        if (buckets.empty()) {
+            return none;
+        }
+        size_t mask = buckets.size() - 1;
+        for (size_t b = mix(id) & mask; buckets[b]; b = (b + 1) & mask) {
+            if (ids[buckets[b] - 1] == id) {
+                return buckets[b] - 1;
+            }
+        }
+        return none;
+    }
+    // The [begin, end) slots of the query's events; empty if it never occurs.
+    std::pair<uint64_t, uint64_t> slots(uint64_t id) const {
+        uint32_t o = ordinal(id);
+        if (o == none) {
+            return {0, 0};
+        }
+        return {offsets[o], offsets[o + 1]};
+    }
+};
+
+// Builds the query index of span.
+//
+// span is already in timestamp order, so a stable LSD radix sort on query() alone yields
+// the (query, ts) order. Each pass counts digits per thread, prefix-sums the counts and
+// lets every thread scatter its own chunk, which keeps the pass stable. Digits that are
+// equal across the whole trace (typically the high bytes of the ids) are skipped. The keys
+// and timestamps are read from columns, the columns of span.
+query_index build_index(std::span<const entry> span, const trace_columns& columns, unsigned n_threads, progress* done = nullptr);
+
+inline query_index build_index(std::span<const entry> span, unsigned n_threads) {
+    return build_index(span, make_columns(span, n_threads), n_threads);
+}
+
+// What a query did besides running, from its own events: how many IOs it issued, the RCS
+// statuses it got (bit n for status n), and whether it had PERMIT and ES events.
+struct query_traits {
+    uint32_t n_io = 0;
+    uint8_t rcs = 0;
+    bool permit = false;
+    bool es = false;
+
+    void add(uint64_t event, uint64_t arg) {
+        if (event == 0x4) {
+            n_io += 1;
+        } else if (event == 0x3) {
+            rcs |= arg < 8 ? 1 << arg : 0;
+        } else if (event == 0xa) {
+            permit = true;
+        } else if (event == 0xb) {
+            es = true;
+        }
+    }
+    void merge(const query_traits& other) {
+        n_io += other.n_io;
+        rcs |= other.rcs;
+        permit |= other.permit;
+        es |= other.es;
+    }
+};
+
+struct query {
+    std::chrono::duration<double> latency;
+    uint64_t id;
+    std::chrono::duration<double> cputime;
+    std::chrono::duration<double> iotime;
+    std::chrono::duration<double> starvetime;
+    int64_t first_ts;
+    int64_t start_ts;
+    int64_t end_ts;
+    // The trace (one per reactor shard) the query ran in.
+    uint32_t shard = 0;
+    query_traits traits;
+};
+
+// Who held the reactor while queries were starved. A query's starved time is charged to
+// whatever took the CPU from it: the query or task of the foreign event that preempted
+// it, or, when its IO completed while it was off CPU, of the event before the IO_END. A
+// query's cells thus sum to its starvetime.
+struct blame_matrix {
+    struct cell {
+        uint64_t victim;
+        uint64_t culprit;
+        std::chrono::duration<double> starved;
+        // Whether the culprit is a task rather than a query of the table.
+        bool task;
+    };
+    struct offender {
+        uint64_t culprit;
+        std::chrono::duration<double> starved;
+        uint64_t n_victims;
+        bool task;
+    };
+    // By victim id, and by starved time, longest first, within a victim.
+    std::vector<cell> cells;
+    // Every culprit, by total starved time charged to it, longest first.
+    std::vector<offender> offenders;
+
+    std::span<const cell> of(uint64_t victim) const;
+    size_t bytes() const {
+        return cells.size() * sizeof(cell) + offenders.size() * sizeof(offender);
+    }
+};
+
+// Fills cputime, iotime, starvetime and traits of every query.
+//
+// A query is on CPU from each of its own events (except IO_END, which doesn't change it)
+// until the next foreign event, is in IO while its IO_BEGIN/IO_END stack is non-empty,
+// and is starved when neither. Only the owner of the previous event can be on CPU, so
+// every event settles at most two in-flight queries; the others keep their last state
+// and catch up lazily on their next own event.
+//
+// The trace is cut into segments swept in parallel. A first pass collects each segment's
+// net IO depth change per query, which is enough to derive every query's state at every
+// segment boundary; a second pass then sweeps each segment from those states. Tick sums
+// are exact, so the result doesn't depend on the thread count or the schedule.
+//
+// With blame, the same sweep also fills it: each segment accumulates its charges in a
+// table keyed by victim and culprit, at most one per own event of a starved query.
+void attribute(const trace_columns& columns, const query_index& index, std::vector<query>& queries, unsigned n_threads, progress* done = nullptr, blame_matrix* blame = nullptr);
+
+// What one query was doing over its lifetime, as drawn by "Full log plot": the runs of
+// time it was on CPU, and the spans during which it had IO in flight. Each track keeps
+// prefix sums of its interval lengths, so the CPU or IO time within any range, at any
+// zoom, takes two binary searches.
+struct timeline {
+    struct interval {
+        int64_t begin;
+        int64_t end;
+    };
+    struct track {
+        std::vector<interval> intervals;
+        std::vector<uint64_t> before;
+
+        // Adds [begin, end), at or after the last interval, which it extends if they touch.
+        void add(int64_t begin, int64_t end) {
+            if (!intervals.empty() && begin == intervals.back().end) {
+                intervals.back().end = end;
+                return;
+            }
+            before.push_back(intervals.empty() ? 0 : before.back() + (intervals.back().end - intervals.back().begin));
+            intervals.push_back(interval{begin, end});
+        }
+        // Time covered by the intervals up to ts.
+        uint64_t covered(int64_t ts) const {
+            auto it = std::ranges::upper_bound(intervals, ts, std::ranges::less(), [] (const auto& x) {return x.begin;});
+            if (it == intervals.begin()) {
+                return 0;
+            }
+            size_t k = it - intervals.begin() - 1;
+            return before[k] + std::clamp<int64_t>(ts - intervals[k].begin, 0, intervals[k].end - intervals[k].begin);
+        }
+        // The intervals overlapping [begin, end].
+        std::span<const interval> overlapping(int64_t begin, int64_t end) const {
+            auto first = std::ranges::lower_bound(intervals, begin, std::ranges::less(), [] (const auto& x) {return x.end;});
+            auto last = std::ranges::upper_bound(intervals, end, std::ranges::less(), [] (const auto& x) {return x.begin;});
+            return std::span<const interval>(first, std::max(first, last));
+        }
+    };
+    uint64_t id = -1;
+    int64_t start_ts = 0;
+    int64_t end_ts = 0;
+    track cpu;
+    track io;
+};
+
+timeline build_timeline(const trace_columns& columns, uint64_t id, int64_t start_ts, int64_t end_ts);
+
+// The timelines last drawn, so that going back to a query, or switching between two,
+// doesn't sweep their windows again. The least recently used one goes first once full.
+struct timeline_cache {
+    size_t capacity = 64;
+    // By shard, most recently used last.
+    std::vector<std::pair<uint32_t, std::shared_ptr<const timeline>>> entries;
+
+    // The timeline of query id of a shard, from build unless cached.
+    std::shared_ptr<const timeline> get(uint32_t shard, uint64_t id, const std::function<timeline()>& build);
+    void clear() {
+        entries.clear();
+    }
+};
+
+// One IO of the trace: an IO_BEGIN and the IO_END that closes it, which carry the same IO
+// id in arg. depth is how many other IOs its query had in flight when it began.
+struct io_request {
+    uint64_t id;
+    uint64_t query;
+    int64_t start_ts;
+    int64_t end_ts;
+    uint32_t depth;
+
+    std::chrono::duration<double> latency() const {
+        return std::chrono::duration<double, std::nano>(double(end_ts - start_ts) * MULTIPLIER);
+    }
+};
+
+// Pairs every IO_BEGIN of the trace with the next IO_END of the same IO id, and returns
+// the pairs in start order; IOs still in flight at the end of the trace are left out.
+//
+// The trace is cut into segments paired in parallel, each through open-addressing tables
+// of its pending IOs and of its queries' IO depths. The begins left pending and ends left
+// unmatched in each segment are then paired in trace order, and the depths offset by
+// their queries' depth at the segment start.
+std::vector<io_request> pair_ios(const trace_columns& columns, unsigned n_threads);
+
+// Finds the queries of the index: every id with a START event, timed from its first START
+// to its last event. columns are those of the index's trace.
+std::vector<query> segment_queries(const query_index& index, const trace_columns& columns);
+
+// One sequential pass over the trace, keeping the state of every query it has seen. It
+// settles a query's times only on the query's own events, remembering when it was
+// preempted in between, so a state is complete after every own event: it can be set
+// aside and restored, and reads as a query at any point.
+struct query_sweep {
+    struct state {
+        uint64_t id;
+        int64_t first_ts;
+        int64_t start_ts;
+        int64_t last_ts;
+        int64_t preempt_ts;
+        uint64_t iostack;
+        uint64_t cputime;
+        uint64_t iotime;
+        uint64_t starvetime;
+        bool cpu;
+        bool preempted;
+        bool started;
+        query_traits traits;
+
+        query as_query() const;
+    };
+    std::unordered_map<uint64_t, state> states;
+    // Called with the fresh state of a query missing from states, to fill in one set aside.
+    std::function<void(state&)> restore;
+    bool have_prev = false;
+    uint64_t prev_id = 0;
+    int64_t prev_ts = 0;
+
+    // Folds e, the next event of the trace, into the state of its query and returns it.
+    state& step(const entry& e);
+};
+
+// Computes the query table of a trace file too large to load, in one sequential pass and
+// bounded memory. The file is read through a read-only window of a quarter of memory_cap
+// that is dropped from memory once swept. Per-query state is kept for the queries active
+// recently; when the table outgrows half of memory_cap, the least recently active half is
+// written to an unlinked spill file and read back if the query shows up again. At the end
+// the spill file holds the state of every query and the table is collected from it.
+//
+// Columnar traces are decoded a block at a time instead.
+//
+// Segmentation and attribution match segment_queries() and attribute(); it is a
+// query_sweep whose evicted states go to the spill file and are restored from it.
+std::vector<query> stream_queries(int fd, size_t file_size, size_t memory_cap, progress* done = nullptr);
+
+// A first look at a trace too large to wait for: the queries that START in a short seed
+// range at a random offset of each of n_strata strata of equal size, segmented and
+// attributed by segment_queries() and attribute() from a window of the entries that
+// follow. The window doubles until none of its seeded queries has an event in the second
+// half of what follows the seed, or it reaches max_window; those still active then are
+// censored, their latency known only to be at least what was seen.
+//
+// Strata are sampled in parallel, each window swept by one thread. Offsets derive from
+// seed, so rounds with different seeds draw new ones and can be pooled with merge().
+struct trace_sample {
+    static constexpr size_t seed_entries = 1024;
+    static constexpr size_t min_window = 16384;
+    static constexpr size_t max_window = size_t(1) << 20;
+    // The complete queries, in latency order.
+    std::vector<query> queries;
+    size_t n_censored = 0;
+    // The entries seeded from, and those swept to follow their queries.
+    size_t n_seeded = 0;
+    size_t n_swept = 0;
+    // The seeded queries, complete or not, and counted again where pooled samples overlap,
+    // as the entries seeded from are.
+    size_t n_found = 0;
+
+    // How many queries the whole trace has, going by the density of STARTs seeded from.
+    double estimated_queries(size_t trace_size) const {
+        return n_seeded ? double(n_found) * trace_size / n_seeded : 0;
+    }
+    // Pools another sample in, leaving out the queries already in this one.
+    void merge(trace_sample other);
+};
+
+trace_sample sample_queries(std::span<const entry> trace, size_t n_strata, uint64_t seed, unsigned n_threads);
+
+// A trace file that is still being written. Every update() grows the mapping to the
+// entries appended since the last one, folds just those into the in-flight query states
+// and moves the queries they touched within the latency-sorted table; the first one sweeps
+// the whole file. A partially written entry at the end waits for the next update.
+// How a latency-sorted query table changed: the rows taken out, as they were, at their
+// positions before, and the rows put in at their positions after, both in position order.
+struct table_change {
+    std::vector<query> removed;
+    std::vector<size_t> removed_at;
+    std::vector<query> added;
+    std::vector<size_t> added_at;
+};
+
+// Takes the rows at positions removed_at (ascending) out of a latency-sorted table and
+// merges in added, sorted by latency, each after the rows of equal latency already there.
+table_change change_table(std::vector<query>& table, std::vector<size_t> removed_at, std::vector<query> added);
+
+struct live_trace {
+    int fd;
+    const entry* data = nullptr;
+    size_t mapped_size = 0;
+    size_t n_entries = 0;
+    query_sweep sweep;
+
+    explicit live_trace(int fd);
+    live_trace(const live_trace&) = delete;
+    live_trace& operator=(const live_trace&) = delete;
+    ~live_trace();
+
+    std::span<const entry> span() const {
+        return std::span<const entry>(data, n_entries);
+    }
+    // Folds what was appended to the trace into queries, and says how they changed.
+    table_change update(std::vector<query>& queries);
+};
+
+// Writes the sidecar through a temporary file and a rename, so a reader never sees a
+// partial one. Failing to write it only costs the next open a recompute.
+void save_sidecar(const std::string& sidecar_path, const struct stat& sb, std::span<const entry> span, const query_index& index, const std::vector<query>& queries,
+    const blame_matrix* blame = nullptr, const std::vector<io_request>* ios = nullptr);
+
+// Maps the sidecar, if there is a valid one for this trace, and points index and queries
+// at its contents. If blame and ios are given, they get the sidecar's blame matrix and IO
+// table, if it has them.
+bool load_sidecar(const std::string& sidecar_path, const struct stat& sb, std::span<const entry> span, query_index& index, std::vector<query>& queries,
+    std::shared_ptr<const blame_matrix>* blame = nullptr, std::shared_ptr<const std::vector<io_request>>* ios = nullptr);
+
+// An event of one of several shards' traces.
+struct shard_event {
+    uint32_t shard;
+    uint64_t position;
+};
+
+// The events of all traces with begin_ts <= ts < end_ts, merged in timestamp order (ties
+// going to the lower shard) with a k-way heap merge over the traces.
+std::vector<shard_event> merge_shards(std::span<const std::span<const entry>> traces, int64_t begin_ts, int64_t end_ts);
+
+// What "TimeDist" shows for slots [w1, w2] of the latency-sorted query table: the average
+// times, and the distribution of each time sampled at the fractions in plot_x, in ms.
+struct time_dist {
+    std::chrono::duration<double> avgcputime;
+    std::chrono::duration<double> avgiotime;
+    std::chrono::duration<double> avgstarvetime;
+    std::chrono::duration<double> avglatency;
+    std::vector<double> cputimes_y;
+    std::vector<double> iotimes_y;
+    std::vector<double> starvetimes_y;
+    std::vector<double> latencies_y;
+};
+
+// A sequence of integers below 2^n_bits that finds the k-th smallest of any range in one
+// step per bit. Level l holds bit n_bits - 1 - l of every value, in the order the levels
+// above sort them to: stably by that prefix of bits, zeros first. Each level's bits have a
+// count of ones before every 256, so that a rank takes a lookup and four popcounts.
+struct wavelet_matrix {
+    struct level {
+        std::vector<uint64_t> bits;
+        std::vector<uint32_t> ones_before;
+        size_t zeros = 0;
+
+        // Ones in bits [0, i).
+        size_t rank(size_t i) const;
+    };
+    std::vector<level> levels;
+
+    explicit wavelet_matrix(std::vector<uint64_t> values = {});
+    // The k-th smallest (from 0) of values [begin, end); k < end - begin.
+    uint64_t kth(size_t begin, size_t end, size_t k) const;
+};
+
+// Answers make_time_dist() for any slot range of one latency-sorted table in O(log n) per
+// sample. Each time keeps prefix sums, for the averages, and a wavelet matrix of its
+// ranks, for the samples. Latencies are in order already, so they are read directly.
+struct time_dist_index {
+    struct metric {
+        std::vector<double> sorted;
+        // The position of every rank, which update_time_dist_index() merges changes into.
+        std::vector<uint64_t> positions;
+        wavelet_matrix ranks;
+        std::vector<double> prefix;
+    };
+    metric cputime;
+    metric iotime;
+    metric starvetime;
+    std::vector<double> latency;
+    std::vector<double> latency_prefix;
+};
+
+time_dist_index make_time_dist_index(std::span<const query> queries, unsigned n_threads);
+// Brings the index of a table up to date with queries, the table after change: the prefix
+// sums are extended from the first position that changed, and the times of the rows added
+// are merged into the order of those kept, with no sort of the whole table.
+void update_time_dist_index(time_dist_index& index, std::span<const query> queries, const table_change& change, unsigned n_threads);
+
+time_dist make_time_dist(const time_dist_index& index, size_t w1, size_t w2, std::span<const double> plot_x);
+
+// Counts of queries by start time and latency, for the "Heatmap" window. Latencies fall in
+// bins_per_decade log-spaced bins per decade from min_latency; start times in buckets of
+// bucket_ticks at level 0, and every level above merges pairs of buckets of the one below.
+// A view of any span of the trace reads from the coarsest level that still gives every
+// column a bucket, so its cost depends on the pixels, not on the span.
+struct latency_pyramid {
+    static constexpr double min_latency = 1e-6;
+    static constexpr int bins_per_decade = 8;
+    static constexpr int n_bins = 8 * bins_per_decade;
+    int64_t first_ts = 0;
+    int64_t bucket_ticks = 1;
+    // Level l holds n_bins counts per bucket of bucket_ticks << l, bucket after bucket.
+    std::vector<std::vector<uint32_t>> levels;
+
+    static int bin(double latency);
+    // The lowest latency of a bin.
+    static double bin_latency(int bin);
+    size_t n_buckets(size_t level) const {
+        return levels[level].size() / n_bins;
+    }
+    // The counts of [begin_ts, end_ts) in n_columns columns, bin after bin (row-major, the
+    // highest latencies first, as ImPlot draws heatmaps); level is the one read.
+    std::vector<double> view(int64_t begin_ts, int64_t end_ts, size_t n_columns, size_t& level) const;
+};
+
+latency_pyramid make_latency_pyramid(std::span<const query> queries, unsigned n_threads);
+
+// A log-linear histogram of durations in nanoseconds, laid out as HdrHistogram's: buckets
+// of doubling width, each split into the same power of two of linear sub-buckets, enough
+// for every value to be told from any 10^-significant_digits apart from it. Values above
+// highest count as highest. Recording is a shift and an increment, and the size depends on
+// the precision and the range but not on the number of values, so per-thread histograms
+// are cheap, and they merge by adding counts.
+struct hdr_histogram {
+    static constexpr uint64_t default_highest = uint64_t(3600) * 1000000000;
+    int significant_digits = 3;
+    uint64_t highest = default_highest;
+    // Half the sub-buckets of every bucket but the first, which has them all.
+    int half_bits = 0;
+    std::vector<uint64_t> counts;
+    uint64_t total = 0;
+    uint64_t min = std::numeric_limits<uint64_t>::max();
+    uint64_t max = 0;
+
+    // Throws std::runtime_error unless 1 <= significant_digits <= 5.
+    explicit hdr_histogram(int significant_digits = 3, uint64_t highest = default_highest);
+
+    size_t index_of(uint64_t ns) const {
+        uint64_t sub_mask = (uint64_t(2) << half_bits) - 1;
+        int bucket = 64 - std::countl_zero(ns | sub_mask) - (half_bits + 1);
+        return (size_t(bucket + 1) << half_bits) + (ns >> bucket) - (uint64_t(1) << half_bits);
+    }
+    // The lowest and highest values counted at an index.
+    uint64_t lowest_at(size_t index) const;
+    uint64_t highest_at(size_t index) const;
+
+    static uint64_t nanoseconds(std::chrono::duration<double> d) {
+        return uint64_t(std::max(0.0, std::round(d.count() * 1e9)));
+    }
+    void record(uint64_t ns, uint64_t n = 1) {
+        ns = std::min(ns, highest);
+        counts[index_of(ns)] += n;
+        total += n;
+        min = std::min(min, ns);
+        max = std::max(max, ns);
+    }
+    void record(std::chrono::duration<double> d) {
+        record(nanoseconds(d));
+    }
+    // Takes back n records of ns. min and max are left as they were, which keeps them
+    // bounds of what is left, if no longer its extremes.
+    void remove(uint64_t ns, uint64_t n = 1) {
+        counts[index_of(std::min(ns, highest))] -= n;
+        total -= n;
+    }
+    void remove(std::chrono::duration<double> d) {
+        remove(nanoseconds(d));
+    }
+    // Adds other's counts; throws std::runtime_error if its precision or range differ.
+    void merge(const hdr_histogram& other);
+
+    // The value at every fraction in ps (in any order), in seconds, all in one pass: the
+    // highest value of the sub-bucket of the order statistic quantile_index() picks, which
+    // is within the precision of it.
+    std::vector<double> seconds_at(std::span<const double> ps) const;
+    size_t bytes() const {
+        return counts.size() * sizeof(uint64_t);
+    }
+
+    // The histogram as bytes, every run of empty sub-buckets in a single varint, and back;
+    // deserialize() throws std::runtime_error on anything that isn't one, and consumes it from in.
+    std::string serialize() const;
+    static hdr_histogram deserialize(std::string_view& in);
+};
+
+// Histograms of the times of queries.
+struct time_histograms {
+    hdr_histogram latency;
+    hdr_histogram cputime;
+    hdr_histogram iotime;
+    hdr_histogram starvetime;
+
+    explicit time_histograms(int significant_digits = 3)
+        : latency(significant_digits), cputime(significant_digits), iotime(significant_digits), starvetime(significant_digits) {
+    }
+
+    void record(const query& q) {
+        latency.record(q.latency);
+        cputime.record(q.cputime);
+        iotime.record(q.iotime);
+        starvetime.record(q.starvetime);
+    }
+    void remove(const query& q) {
+        latency.remove(q.latency);
+        cputime.remove(q.cputime);
+        iotime.remove(q.iotime);
+        starvetime.remove(q.starvetime);
+    }
+    void merge(const time_histograms& other) {
+        latency.merge(other.latency);
+        cputime.merge(other.cputime);
+        iotime.merge(other.iotime);
+        starvetime.merge(other.starvetime);
+    }
+};
+
+// One histogram per thread over a share of the queries, merged.
+time_histograms make_time_histograms(std::span<const query> queries, unsigned n_threads, int significant_digits = 3);
+
+// Position of the p-th quantile in a latency-sorted query table, picked the same way as the
+// "HdrHistogram" plot does.
+size_t quantile_index(size_t n, double p);
+
+enum class report_format { json, csv };
+
+// Summarizes the query table for batch use: latency quantiles, the average cpu/io/starve
+// breakdown of each quantile band (what "TimeDist" shows for a selected band), and the
+// slowest queries. Times are in milliseconds.
+void write_report(FILE* out, const std::vector<query>& queries, report_format format, size_t top_n);